@@ -0,0 +1,63 @@
+"""
+Benchmarks of the native tree scans against the equivalent python code.
+
+    python bench.py
+"""
+import heapq
+import timeit
+import property_tree as ptree
+
+
+def build(count):
+    tree = ptree.Tree()
+    shows = tree.add("shows", ptree.Tree())
+
+    for i in range(count):
+        show = ptree.Tree(id=i, name="Show %d" % i, language="English")
+        show.add("summary", ptree.Tree("<p>An episode summary of show number %d, "
+                                       "%s.</p>" % (i, "panda" if i % 100 == 0 else "cat")))
+        shows.append("", show)
+
+    return tree
+
+
+def py_grep(tree, needle, path=""):
+    for index, (key, value) in enumerate(tree.items()):
+        sub = path + ("[%d]" % index if not key else ("." if path else "") + key)
+        if needle in value.value:
+            yield sub
+        yield from py_grep(value, needle, sub)
+
+
+def py_walk(tree, path=""):
+    for index, (key, value) in enumerate(tree.items()):
+        sub = path + ("[%d]" % index if not key else ("." if path else "") + key)
+        yield sub, value
+        yield from py_walk(value, sub)
+
+
+def py_nlargest(tree, k):
+    return heapq.nlargest(k, tree.values(), key=lambda value: float(value.id))
+
+
+def bench(name, native, python, number=5):
+    native_time = min(timeit.repeat(native, number=number, repeat=3)) / number
+    python_time = min(timeit.repeat(python, number=number, repeat=3)) / number
+    print("%-9s native %8.2f ms   python %8.2f ms   x%.1f" %
+          (name, native_time * 1000, python_time * 1000, python_time / native_time))
+
+
+if __name__ == '__main__':
+    tree = build(50000)
+
+    assert list(tree.grep("panda")) == list(py_grep(tree, "panda"))
+    assert [p for p, v in tree.walk()] == [p for p, v in py_walk(tree)]
+    assert tree.column("shows.*.id").tolist() == [float(v.id) for k, v in tree.shows]
+    assert [v.id for v in tree.shows.nlargest(20, "id")] == [v.id for v in py_nlargest(tree.shows, 20)]
+
+    bench("walk", lambda: list(tree.walk()), lambda: list(py_walk(tree)))
+    bench("column", lambda: tree.column("shows.*.id"), lambda: [float(v.id) for k, v in tree.shows])
+    bench("nlargest", lambda: tree.shows.nlargest(20, "id"), lambda: py_nlargest(tree.shows, 20))
+    bench("sort", lambda: tree.shows.sort(by="id", numeric=True, reverse=True),
+          lambda: sorted(tree.shows.items(), key=lambda item: float(item[1].id), reverse=True))
+    bench("grep", lambda: list(tree.grep("panda")), lambda: list(py_grep(tree, "panda")))
@@ -37,21 +37,23 @@ while True:
             print(f"stopped at page {params['page']}")
             break
 
-    for key, value in feed:
-        if value.id not in tree.shows:
-            tree.shows.append(value.id.value, value)
-            print(value.name)
-            updated = True
+    # add the shows of the page keyed by id, the ones that are already in
+    # the tree are left alone
+    inserted, _ = tree.shows.upsert_from(feed, "id", mode="insert")
+
+    if inserted:
+        print(f"{inserted} new shows")
+        updated = True
 
     print(f"downloaded page {params['page']}")
     params['page'] += 1
 
 if updated is True:
-    # sort using a python function -- builtin sort function
-    # sorts by string value which isn't what we want here.
+    # sort numerically by id -- the default sort compares the keys
+    # as strings which isn't what we want here.
     # Actually, this probably isn't even needed since the shows
     # should already be in proper order but anyhoo...
-    tree.shows.sort(lambda lhs, rhs: int(lhs[0]) < int(rhs[0]))
+    tree.shows.sort(by="id", numeric=True)
 
     # save the file
     ptree.json.dump('tvmaze.json', tree, pretty_print=False)
@@ -69,6 +71,11 @@ for k, v in tree.shows.search(lambda k, v: "Panda" in v.name):
     print(v.name)
 
 
+# ...or with a native predicate
+for k, v in tree.shows.search(ptree.where("name").contains("Panda")):
+    print(v.name)
+
+
 # more complex query with a filter function
 def filter_func(k, v):
     return "2018" in v.premiered and \
@@ -80,7 +87,28 @@ for k, v in tree.shows.search(filter_func):
     print(v.name)
 
 
+# a similar query evaluated natively, without calling into python per show
+for name in tree.select("shows[?premiered >= '2018' && premiered < '2019' && "
+                        "language == 'English' && schedule.time == '22:00'].name"):
+    print(name)
+
+
 # find all running BBC One shows where __getattribute__ might throw using list comprehension
 for show in [v for k, v in tree.shows if v.get('network.id', 0) == 12 and v.status == "Running"]:
     print(show.name)
+
+
+# ...and the same query using native predicates
+for k, v in tree.shows.search((ptree.where("network.id") == 12) & (ptree.where("status") == "Running")):
+    print(v.name)
+
+
+# pull the same fields out of every show into namedtuples
+from collections import namedtuple
+Show = namedtuple('Show', 'id name rating')
+
+extract = ptree.Extractor({'id': int, 'name': str, 'rating': ('rating.average', float, None)}, into=Show)
+
+for show in extract.many(tree.shows):
+    print(show)
 '''
@@ -14,21 +14,54 @@
 #include <boost/property_tree/xml_parser.hpp>
 #include <boost/property_tree/ini_parser.hpp>
 #include <boost/property_tree/info_parser.hpp>
+#include <boost/xpressive/xpressive_dynamic.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 typedef enum _PyPropertyTree_Flags {
    PTREE_FLAG_NONE = 0,
    PTREE_FLAG_OBJECT_NOT_OWNED = (1<<0),
+   PTREE_FLAG_READ_ONLY = (1<<1),
 } PyPropertyTree_Flags;
 
 
 /* --- forward declarations --- */
 
 
-typedef struct {
+typedef struct _PyPropertyTree {
     PyObject_HEAD
     boost::property_tree::ptree *obj;
     PyPropertyTree_Flags flags:8;
+    struct _PyPropertyTree *root;   /* the tree owning obj, NULL if this one does */
+    unsigned long generation;       /* bumped on every change, only kept by the owner */
+    PyObject *heirs;                /* trees that children of this one were moved into,
+                                       kept alive for the views of those children */
+    struct _PyPropertyTree *cow_source;                 /* the tree whose obj this copy shares
+                                                           until either of them is changed */
+    std::vector<struct _PyPropertyTree*> *cow_copies;   /* the copies sharing this tree */
+    std::unordered_set<PyObject*> *views;               /* views and iterators of this tree, only kept
+                                                           by the owner */
+    std::vector<std::vector<boost::property_tree::ptree*>*> *cow_scans;     /* nodes found by the parallel
+                                                                           scans of a shared copy */
+    struct ptree_undo_log *undo;    /* the changes of the transaction in progress, only kept by the owner */
+    std::atomic<unsigned> readers;  /* scans running with the GIL released, only kept by the owner,
+                                       those of the copies sharing its tree included */
 } PyPropertyTree;
 
 
@@ -37,6 +70,7 @@ typedef struct {
     PyPropertyTree *container;
     boost::property_tree::ptree::iterator *iterator;
     PyObject *callable;
+    PyObject *predicate;
 } PyPropertyTree_Iter;
 
 
@@ -48,9 +82,142 @@ typedef struct {
 } PyPropertyTree_AssocIter;
 
 
+class ptree_walker;
+struct ptree_walk_filter;
+
+static void ptree_walker_remap(ptree_walker *walker,
+                               std::unordered_map<const boost::property_tree::ptree*, boost::property_tree::ptree*> &nodes);
+static void ptree_walker_rebase(ptree_walker *walker, boost::property_tree::ptree &root);
+
+
+typedef struct {
+    PyObject_HEAD
+    PyPropertyTree *container;
+    ptree_walker *walker;
+    ptree_walk_filter *filter;
+    bool paths_only;
+} PyPropertyTree_WalkIter;
+
+
+/* distinct values in the order they were first seen and the children with each */
+struct ptree_groups
+{
+    std::vector<std::string> field;
+    std::vector<std::string> keys;
+    std::vector<std::vector<boost::property_tree::ptree::value_type*> > members;
+    std::unordered_map<std::string, std::size_t> index;
+
+    void build(boost::property_tree::ptree &tree);
+};
+
+
+typedef struct {
+    PyObject_HEAD
+    PyPropertyTree *container;
+    ptree_groups *groups;
+    unsigned long generation;   /* of the container when the groups were built */
+} PyPropertyTree_GroupBy;
+
+
+struct extractor_field;
+
+
+typedef struct {
+    PyObject_HEAD
+    std::vector<extractor_field> *fields;
+    PyObject *into;
+    PyObject *names;            /* tuple of the field names */
+} PyPropertyTree_Extractor;
+
+
+struct query_plan;
+
+
+typedef struct {
+    PyObject_HEAD
+    query_plan *plan;
+    PyObject *expression;
+} PyPropertyTree_Query;
+
+
+/* records by the value of their field */
+struct ptree_value_index
+{
+    std::unordered_map<std::string, std::vector<boost::property_tree::ptree*> > table;
+
+    void build(boost::property_tree::ptree &root, const query_plan &plan);
+};
+
+
+typedef struct {
+    PyObject_HEAD
+    PyPropertyTree *container;
+    PyPropertyTree_Query *query;
+    ptree_value_index *table;
+    unsigned long generation;   /* of the container when the table was built */
+} PyPropertyTree_Index;
+
+
+struct query_filter;
+
+
+typedef struct {
+    PyObject_HEAD
+    std::shared_ptr<const query_filter> *filter;
+} PyPropertyTree_Predicate;
+
+
+/* A node changed in a transaction, with its value and the addresses of its
+ * children as they were when it started, each saved the first time it changes,
+ * and a copy of each of its children that was erased or moved out */
+struct ptree_undo_state
+{
+    boost::property_tree::ptree *node;      /* NULL once the node is erased or moved out */
+    bool has_value, has_children;
+    std::string value;
+    std::vector<const boost::property_tree::ptree::value_type*> children;
+    std::unordered_map<const boost::property_tree::ptree::value_type*,
+                       std::pair<std::string, boost::property_tree::ptree> > removed;
+};
+
+
+/* The nodes changed in a transaction in the order they first changed */
+struct ptree_undo_log
+{
+    std::vector<ptree_undo_state> states;
+    std::unordered_map<const boost::property_tree::ptree*, std::size_t> index;
+
+    void save_value(boost::property_tree::ptree &node);
+    void save_children(boost::property_tree::ptree &node);
+    void save_removed(boost::property_tree::ptree &parent, const boost::property_tree::ptree::value_type &child);
+    void save_content(boost::property_tree::ptree &node);
+    void rollback();
+
+private:
+    ptree_undo_state &state(boost::property_tree::ptree &node);
+    void copy(const boost::property_tree::ptree &node, boost::property_tree::ptree &copy);
+    void forget(const boost::property_tree::ptree &node);
+    void restore(ptree_undo_state &state);
+};
+
+
+typedef struct {
+    PyObject_HEAD
+    PyPropertyTree *container;  /* the tree owning the nodes changed in the transaction */
+    bool active;
+} PyPropertyTree_Transaction;
+
+
 extern PyTypeObject PyPropertyTree_Type;
 extern PyTypeObject PyPropertyTree_IterType;
 extern PyTypeObject PyPropertyTree_AssocIterType;
+extern PyTypeObject PyPropertyTree_WalkIterType;
+extern PyTypeObject PyPropertyTree_QueryType;
+extern PyTypeObject PyPropertyTree_PredicateType;
+extern PyTypeObject PyPropertyTree_ExtractorType;
+extern PyTypeObject PyPropertyTree_GroupByType;
+extern PyTypeObject PyPropertyTree_IndexType;
+extern PyTypeObject PyPropertyTree_TransactionType;
 
 
 /* --- exceptions --- */
@@ -58,6 +225,7 @@ extern PyTypeObject PyPropertyTree_AssocIterType;
 
 static PyTypeObject *PyPropertyTreeBadDataError_Type;
 static PyTypeObject *PyPropertyTreeBadPathError_Type;
+static PyTypeObject *PyPropertyTreeQueryError_Type;
 static PyTypeObject *PyPropertyTreeJSONParserError_Type;
 static PyTypeObject *PyPropertyTreeXMLParserError_Type;
 static PyTypeObject *PyPropertyTreeINIParserError_Type;
@@ -67,1620 +235,7325 @@ static PyTypeObject *PyPropertyTreeINFOParserError_Type;
 /* --- helpers --- */
 
 
-static PyPropertyTree*
-PyPropertyTree_New(boost::property_tree::ptree *ptree, PyPropertyTree_Flags flag)
+/* The views and iterators of a tree are tracked by its owner, they are moved
+ * along when a shared copy gets a tree of its own or their nodes are moved
+ * to another tree */
+static void
+PyPropertyTree_Track(PyPropertyTree *self, PyObject *user)
 {
-    PyPropertyTree *py_ptree;
-
-    py_ptree = PyObject_New(PyPropertyTree, &PyPropertyTree_Type);
-    py_ptree->obj = ptree;
-    py_ptree->flags = flag;
+    PyPropertyTree *root = self->root ? self->root : self;
 
-    return py_ptree;
+    if (!root->views)
+        root->views = new std::unordered_set<PyObject*>();
+    root->views->insert(user);
 }
 
 
-struct ptree_sort_helper
+static void
+PyPropertyTree_Untrack(PyPropertyTree *self, PyObject *user)
 {
-    PyObject *callable;
+    PyPropertyTree *root = self->root ? self->root : self;
 
-    ptree_sort_helper(PyObject *callable) : callable(callable) {}
+    if (root->views)
+        root->views->erase(user);
+}
 
-    template <typename P>
-    bool operator ()(P& lhs, P& rhs) {
-        PyObject *py_lhs = (PyObject *)PyPropertyTree_New(&lhs.second, PTREE_FLAG_OBJECT_NOT_OWNED);
-        PyObject *py_rhs = (PyObject *)PyPropertyTree_New(&rhs.second, PTREE_FLAG_OBJECT_NOT_OWNED);
 
-        PyObject *retval = PyObject_CallFunction(callable, (char *) "(sO)(sO)",
-                                                           lhs.first.c_str(), py_lhs,
-                                                           rhs.first.c_str(), py_rhs);
+/* The nodes found by a parallel scan of a shared copy are tracked too, from
+ * before the GIL is released until their views are made, the tree can move
+ * in between */
+static void
+PyPropertyTree_TrackScan(PyPropertyTree *self, std::vector<boost::property_tree::ptree*> &found)
+{
+    PyPropertyTree *root = self->root ? self->root : self;
 
-        Py_DECREF(py_lhs);
-        Py_DECREF(py_rhs);
+    if (root->cow_source) {
+        if (!root->cow_scans)
+            root->cow_scans = new std::vector<std::vector<boost::property_tree::ptree*>*>();
+        root->cow_scans->push_back(&found);
+    }
+}
 
-        if (!retval) {
-            throw boost::property_tree::ptree_error("sort function call failed");
-        }
 
-        bool result = PyObject_IsTrue(retval);
+static void
+PyPropertyTree_UntrackScan(PyPropertyTree *self, std::vector<boost::property_tree::ptree*> &found)
+{
+    PyPropertyTree *root = self->root ? self->root : self;
 
-        Py_DECREF(retval);
+    if (root->cow_scans) {
+        std::vector<std::vector<boost::property_tree::ptree*>*>::iterator iter =
+            std::find(root->cow_scans->begin(), root->cow_scans->end(), &found);
 
-        return result;
+        if (iter != root->cow_scans->end())
+            root->cow_scans->erase(iter);
     }
-};
+}
 
 
-static int
-py_value_to_string(PyObject *value, std::string &str)
+/* A view that doesn't own its node keeps the tree owning it alive */
+static PyPropertyTree*
+PyPropertyTree_New(boost::property_tree::ptree *ptree, PyPropertyTree_Flags flag, PyPropertyTree *parent = NULL)
 {
-    const char *value_str;
-    Py_ssize_t value_len;
+    PyPropertyTree *py_ptree;
 
-    if (value == Py_None) {
-        str = "none";
-    } else if (PyBool_Check(value)) {
-        str = (value == Py_True ? "true" : "false");
-    } else if (PyNumber_Check(value)){
-        PyObject *py_str = PyObject_Str(value);
-        value_str = PyUnicode_AsUTF8AndSize(py_str, &value_len);
-        str = std::string(value_str, value_len);
-        Py_DECREF(py_str);
-    } else if (PyUnicode_Check(value)) {
-        value_str = PyUnicode_AsUTF8AndSize(value, &value_len);
-        str = std::string(value_str, value_len);
-    } else {
-        return -1;
+    if (!(py_ptree = PyObject_New(PyPropertyTree, &PyPropertyTree_Type)))
+        return NULL;
+
+    py_ptree->obj = ptree;
+    py_ptree->flags = flag;
+    py_ptree->root = NULL;
+    py_ptree->generation = 0;
+    py_ptree->heirs = NULL;
+    py_ptree->cow_source = NULL;
+    py_ptree->cow_copies = NULL;
+    py_ptree->views = NULL;
+    py_ptree->cow_scans = NULL;
+    py_ptree->undo = NULL;
+    py_ptree->readers = 0;
+
+    if ((flag & PTREE_FLAG_OBJECT_NOT_OWNED) && parent) {
+        py_ptree->root = parent->root ? parent->root : parent;
+        Py_INCREF(py_ptree->root);
+        PyPropertyTree_Track(py_ptree, (PyObject*)py_ptree);
     }
-    return 0;
+
+    return py_ptree;
 }
 
-/* --- classes --- */
 
+/* Make copy a copy of self that shares its tree until either of them is changed */
+static void
+PyPropertyTree_Share(PyPropertyTree *self, PyPropertyTree *copy)
+{
+    PyPropertyTree *root = self->root ? self->root : self;
+    PyPropertyTree *source = root->cow_source ? root->cow_source : root;
 
-PyDoc_STRVAR(PyPropertyTree_value__doc__,
-"string value of this node\n");
+    copy->obj = self->obj;
+    copy->flags = PTREE_FLAG_OBJECT_NOT_OWNED;
 
+    Py_INCREF(source);
+    copy->cow_source = source;
 
-static PyObject*
-PyPropertyTree__get_value(PyPropertyTree *self, void *Py_UNUSED(closure))
-{
-    const std::string &value = self->obj->data();
-    return PyUnicode_DecodeUTF8(value.c_str(), value.size(), NULL);
+    if (!source->cow_copies)
+        source->cow_copies = new std::vector<PyPropertyTree*>();
+    source->cow_copies->push_back(copy);
 }
 
 
-static int
-PyPropertyTree__set_value(PyPropertyTree *self, PyObject *py_val, void *Py_UNUSED(closure))
+static PyPropertyTree*
+PyPropertyTree_Copy(PyPropertyTree *self)
 {
-    try {
-        if (PyUnicode_Check(py_val)) {
-            Py_ssize_t value_len;
-            const char *value = PyUnicode_AsUTF8AndSize(py_val, &value_len);
-            self->obj->put_value<std::string>(std::string(value, value_len));
-        } else {
-            PyErr_SetObject(PyExc_ValueError, py_val);
-            return -1;
-        }
-    } catch (boost::property_tree::ptree_bad_data const &exc) {
-        PyErr_SetString((PyObject *) PyPropertyTreeBadDataError_Type, exc.what());
-        return -1;
-    }
-    return 0;
+    PyPropertyTree *copy = PyPropertyTree_New(NULL, PTREE_FLAG_NONE);
+
+    PyPropertyTree_Share(self, copy);
+
+    return copy;
 }
 
 
-static PyGetSetDef PyPropertyTree__getsets[] = {
-    {
-        (char*) "value",                                         /* attribute name */
-        (getter) PyPropertyTree__get_value,                      /* C function to get the attribute */
-        (setter) PyPropertyTree__set_value,                      /* C function to set the attribute */
-        PyPropertyTree_value__doc__,                             /* optional doc string */
-        NULL                                                     /* optional additional data for getter and setter */
-    },
-    { NULL, NULL, NULL, NULL, NULL }
-};
+/* Map the nodes of a tree to the ones of its copy */
+static void
+ptree_map_nodes(const boost::property_tree::ptree &tree, boost::property_tree::ptree &copy,
+                std::unordered_map<const boost::property_tree::ptree*, boost::property_tree::ptree*> &nodes)
+{
+    boost::property_tree::ptree::iterator copy_child = copy.begin();
 
+    nodes[&tree] = &copy;
 
-PyDoc_STRVAR(PyPropertyTree_add__doc__,
-"add(path, value) -> Tree\n\n"
-"    Add a node at the given path with the given value.\n"
-"    If the node identified by the path does not exist, create it\n"
-"    and all its missing parents.\n"
-"    If the node already exists, add a sibling with the same key.\n");
+    for (const boost::property_tree::ptree::value_type &child : tree)
+        ptree_map_nodes(child.second, (copy_child++)->second, nodes);
+}
 
 
-static PyObject*
-PyPropertyTree_add(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+/* The place in copy, whose nodes are mapped from the ones of tree by nodes,
+ * of an iterator over the children of tree in key order */
+static boost::property_tree::ptree::assoc_iterator
+ptree_map_assoc(boost::property_tree::ptree &tree, boost::property_tree::ptree::assoc_iterator iter,
+                boost::property_tree::ptree &copy,
+                std::unordered_map<const boost::property_tree::ptree*, boost::property_tree::ptree*> &nodes)
 {
-    const char *path;
-    Py_ssize_t path_len;
-    PyObject *value;
-    std::string value_std;
-    boost::property_tree::ptree *retval;
-    const char *keywords[] = {"path", "value", NULL};
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#O:add", (char **) keywords, &path, &path_len, &value)) {
-        return NULL;
-    }
+    if (iter == tree.not_found())
+        return copy.not_found();
 
-    std::string path_std(path, path_len);
+    // children with the same key aren't always in the same order in the copy
+    boost::property_tree::ptree *node = nodes[&iter->second];
+    boost::property_tree::ptree::assoc_iterator found = copy.find(iter->first);
 
-    if (PyObject_IsInstance(value, (PyObject *) &PyPropertyTree_Type)) {
-        retval = &self->obj->add_child(path_std, *(((PyPropertyTree *)value)->obj));
-    } else if (py_value_to_string(value, value_std) == 0) {
-        boost::property_tree::ptree tree(value_std);
-        retval = &self->obj->add_child(path_std, tree);
-    } else {
-        PyErr_SetObject(PyExc_ValueError, value);
-        return NULL;
-    }
+    while (&found->second != node)
+        ++found;
 
-    return (PyObject*)PyPropertyTree_New(retval, PTREE_FLAG_OBJECT_NOT_OWNED);
+    return found;
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_append__doc__,
-"append(key, value) -> Tree\n\n"
-"    Add the value to the end of the child list with the given key.\n");
+/* Move a shared copy, and its views and iterators, to the nodes of a copy of
+ * the tree it shares, mapped by nodes. Iterators keep their place among the
+ * nodes they go through */
+static void
+PyPropertyTree_Move(PyPropertyTree *copy,
+                    std::unordered_map<const boost::property_tree::ptree*, boost::property_tree::ptree*> &nodes)
+{
+    std::vector<std::pair<PyObject*, boost::property_tree::ptree*> > iters;
+
+    if (copy->views) {
+        // the containers of the iterators are views of copy, or copy
+        for (PyObject *user : *copy->views) {
+            if (Py_TYPE(user) == &PyPropertyTree_IterType)
+                iters.push_back(std::make_pair(user, ((PyPropertyTree_Iter*)user)->container->obj));
+            else if (Py_TYPE(user) == &PyPropertyTree_AssocIterType)
+                iters.push_back(std::make_pair(user, ((PyPropertyTree_AssocIter*)user)->container->obj));
+            else if (Py_TYPE(user) == &PyPropertyTree_WalkIterType)
+                iters.push_back(std::make_pair(user, ((PyPropertyTree_WalkIter*)user)->container->obj));
+        }
 
+        for (PyObject *user : *copy->views) {
+            PyPropertyTree *view = (PyPropertyTree*)user;
 
-static PyObject*
-PyPropertyTree_append(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
-{
-    const char *key;
-    Py_ssize_t key_len;
-    PyObject *value;
-    std::string value_std;
-    boost::property_tree::ptree::iterator retval;
-    const char *keywords[] = {"key", "value", NULL};
+            if (Py_TYPE(user) == &PyPropertyTree_Type && nodes.count(view->obj))
+                view->obj = nodes[view->obj];
+        }
+    }
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#O:append", (char **) keywords, &key, &key_len, &value)) {
-        return NULL;
+    copy->obj = nodes[copy->obj];
+
+    if (copy->cow_scans) {
+        for (std::vector<boost::property_tree::ptree*> *found : *copy->cow_scans) {
+            for (boost::property_tree::ptree *&node : *found)
+                node = nodes[node];
+        }
     }
 
-    if (PyObject_IsInstance(value, (PyObject *) &PyPropertyTree_Type)) {
-        retval = self->obj->push_back({std::string(key, key_len), *(((PyPropertyTree *)value)->obj)});
-    } else if (py_value_to_string(value, value_std) == 0) {
-        boost::property_tree::ptree tree(value_std);
-        retval = self->obj->push_back({std::string(key, key_len), tree});
-    } else {
-        PyErr_SetObject(PyExc_ValueError, value);
-        return NULL;
+    for (std::pair<PyObject*, boost::property_tree::ptree*> &user : iters) {
+        boost::property_tree::ptree *tree = user.second, *node = nodes[tree];
+
+        if (Py_TYPE(user.first) == &PyPropertyTree_IterType) {
+            PyPropertyTree_Iter *iter = (PyPropertyTree_Iter*)user.first;
+
+            *iter->iterator = std::next(node->begin(), std::distance(tree->begin(), *iter->iterator));
+        } else if (Py_TYPE(user.first) == &PyPropertyTree_AssocIterType) {
+            PyPropertyTree_AssocIter *iter = (PyPropertyTree_AssocIter*)user.first;
+
+            iter->iterator.first = ptree_map_assoc(*tree, iter->iterator.first, *node, nodes);
+            iter->iterator.second = ptree_map_assoc(*tree, iter->iterator.second, *node, nodes);
+        } else {
+            PyPropertyTree_WalkIter *iter = (PyPropertyTree_WalkIter*)user.first;
+
+            if (iter->walker)
+                ptree_walker_remap(iter->walker, nodes);
+        }
     }
 
-    return (PyObject*)PyPropertyTree_New(&retval->second, PTREE_FLAG_OBJECT_NOT_OWNED);
+    copy->generation++;
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_clear__doc__,
-"clear()\n\n"
-"    Clear this Tree completely of both data and children.\n");
+/* Give a shared copy a tree of its own, its views are moved along */
+static void
+PyPropertyTree_Unshare(PyPropertyTree *copy)
+{
+    PyPropertyTree *source = copy->cow_source;
+    boost::property_tree::ptree *shared = copy->obj;
+    boost::property_tree::ptree *tree = new boost::property_tree::ptree(*shared);
+    std::unordered_map<const boost::property_tree::ptree*, boost::property_tree::ptree*> nodes;
 
+    if ((copy->views && !copy->views->empty()) || copy->cow_scans)
+        ptree_map_nodes(*shared, *tree, nodes);
+    else
+        nodes[shared] = tree;
 
-static PyObject*
-PyPropertyTree_clear(PyPropertyTree *self)
-{
-    self->obj->clear();
-    Py_RETURN_NONE;
-}
+    PyPropertyTree_Move(copy, nodes);
 
+    source->cow_copies->erase(std::find(source->cow_copies->begin(), source->cow_copies->end(), copy));
 
-PyDoc_STRVAR(PyPropertyTree_count__doc__,
-"count(key) -> int\n\n"
-"    Count the number of direct children with the given key.\n");
+    copy->flags = (PyPropertyTree_Flags)(copy->flags & PTREE_FLAG_READ_ONLY);
+    copy->cow_source = NULL;
+    Py_DECREF(source);
+}
 
 
-static PyObject*
-PyPropertyTree_count(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+/* Called before the tree of root changes while copies share it. A single copy
+ * gets a tree of its own, more of them move to one copy of the tree between
+ * them, owned by a tree nothing else refers to, so that the tree is copied
+ * once whatever the number of copies and freed with the last of them */
+static void
+PyPropertyTree_Split(PyPropertyTree *root)
 {
-    const char *key = NULL;
-    Py_ssize_t key_len;
-    const char *keywords[] = {"key", NULL};
+    std::vector<PyPropertyTree*> *copies = root->cow_copies;
+    std::unordered_map<const boost::property_tree::ptree*, boost::property_tree::ptree*> nodes;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#:count", (char **) keywords, &key, &key_len)) {
-        return NULL;
+    if (copies->size() == 1) {
+        PyPropertyTree_Unshare(copies->back());
+        return;
     }
 
-    return PyLong_FromLong(self->obj->count(std::string(key, key_len)));
-}
+    // copies of the same node share a copy of that node, else of the whole tree
+    const boost::property_tree::ptree *shared = copies->front()->obj;
+    bool mapped = false;
 
+    for (PyPropertyTree *copy : *copies) {
+        if (copy->obj != shared)
+            shared = root->obj;
+    }
 
-PyDoc_STRVAR(PyPropertyTree_empty__doc__,
-"empty() -> bool\n\n"
-"    Check whether this tree contains any children.\n");
+    for (PyPropertyTree *copy : *copies)
+        mapped = mapped || copy->obj != shared || (copy->views && !copy->views->empty()) || copy->cow_scans;
 
+    PyPropertyTree *owner = PyPropertyTree_New(new boost::property_tree::ptree(*shared), PTREE_FLAG_NONE);
 
-static PyObject*
-PyPropertyTree_empty(PyPropertyTree *self)
-{
-    return PyBool_FromLong(self->obj->empty());
-}
+    if (mapped)
+        ptree_map_nodes(*shared, *owner->obj, nodes);
+    else
+        nodes[shared] = owner->obj;
 
+    owner->cow_copies = copies;
+    root->cow_copies = NULL;
 
-PyDoc_STRVAR(PyPropertyTree_erase__doc__,
-"erase(key) -> int\n\n"
-"    Erase all the children with the given key and return the count.\n");
+    for (PyPropertyTree *copy : *copies) {
+        PyPropertyTree_Move(copy, nodes);
+        Py_INCREF(owner);
+        copy->cow_source = owner;
+        Py_DECREF(root);
+    }
 
+    Py_DECREF(owner);
+}
 
-static PyObject*
-PyPropertyTree_erase(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+
+/* Called before a tree of self is used for more than a read, a shared copy
+ * gets a tree of its own once its scans are done with the one it shares */
+static void
+PyPropertyTree_Detach(PyPropertyTree *self)
 {
-    const char *key = NULL;
-    Py_ssize_t key_len;
-    const char *keywords[] = {"key", NULL};
+    PyPropertyTree *root = self->root ? self->root : self;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#:erase", (char **) keywords, &key, &key_len)) {
-        return NULL;
+    if (root->cow_source) {
+        while (root->readers)
+            std::this_thread::yield();
+        PyPropertyTree_Unshare(root);
     }
-
-    return PyLong_FromLong(self->obj->erase(std::string(key, key_len)));
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_extend__doc__,
-"extend(iterator)\n\n"
-"    Extend the tree by appending all the items from iterator.\n");
+/* Called before the GIL is released around reads of the tree of self from
+ * other threads, until PyPropertyTree_Unpin() changes to the tree wait. The
+ * readers of a shared copy are counted by the tree it shares too, which
+ * can't change under them either. PyPropertyTree_Unpin() is called before
+ * the GIL is taken back, by then the writers may be holding it, the nodes
+ * found are kept track of with PyPropertyTree_TrackScan() meanwhile */
+static void
+PyPropertyTree_Pin(PyPropertyTree *self)
+{
+    PyPropertyTree *root = self->root ? self->root : self;
+
+    root->readers++;
+    if (root->cow_source)
+        root->cow_source->readers++;
+}
 
 
-static PyObject*
-PyPropertyTree_extend(PyPropertyTree *self, PyObject *obj)
+static void
+PyPropertyTree_Unpin(PyPropertyTree *self)
 {
-    PyObject *item, *iter = PyObject_GetIter(obj);
+    PyPropertyTree *root = self->root ? self->root : self;
 
-    if (iter == NULL) {
-        return NULL;
+    // the shared tree first, a copy still pinned keeps its source
+    if (root->cow_source)
+        root->cow_source->readers--;
+    root->readers--;
+}
+
+
+/* Called before every change to a tree, the indexes built on it see the new
+ * generation of the tree owning it and rebuild when they are next used.
+ * The copies sharing the tree, or the tree shared by a copy, are split first.
+ * While the tree is pinned it waits for the readers, keeping the GIL so that
+ * nothing else changes in the meantime. Fails with TypeError for the trees
+ * of a snapshot */
+static int
+PyPropertyTree_Modified(PyPropertyTree *self)
+{
+    PyPropertyTree *root = self->root ? self->root : self;
+
+    if (root->flags & PTREE_FLAG_READ_ONLY) {
+        PyErr_SetString(PyExc_TypeError, "snapshot is read-only");
+        return -1;
     }
 
-    while ((item = PyIter_Next(iter)) != NULL) {
-        const char *key;
-        Py_ssize_t key_len;
-        PyObject *value;
-        std::string value_std;
+    while (root->readers)
+        std::this_thread::yield();
 
-        if (!PyArg_ParseTuple(item, (char *) "s#O", &key, &key_len, &value)) {
-            Py_DECREF(item);
-            return NULL;
-        }
+    PyPropertyTree_Detach(root);
 
-        if (PyObject_IsInstance(value, (PyObject *) &PyPropertyTree_Type)) {
-            self->obj->push_back({std::string(key, key_len), *((PyPropertyTree *)value)->obj});
-        } else if (py_value_to_string(value, value_std) == 0) {
-            boost::property_tree::ptree tree(value_std);
-            self->obj->push_back({std::string(key, key_len), tree});
-        } else {
-            PyErr_SetObject(PyExc_ValueError, value);
-            Py_DECREF(item);
-            return NULL;
-        }
+    if (root->cow_copies && !root->cow_copies->empty())
+        PyPropertyTree_Split(root);
 
-        Py_DECREF(item);
-    }
+    root->generation++;
 
-    Py_DECREF(iter);
-    Py_RETURN_NONE;
+    return 0;
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_find__doc__,
-"find(key) -> Tree\n\n"
-"    Find a child with the given key or None.\n"
-"    * There is no guarantee about which child is returned if multiple have\n"
-"      the same key.\n");
+/* The transaction in progress on the tree of self, if any */
+static ptree_undo_log*
+PyPropertyTree_Undo(PyPropertyTree *self)
+{
+    return (self->root ? self->root : self)->undo;
+}
 
 
-static PyObject*
-PyPropertyTree_find(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+/* Called after PyPropertyTree_Modified() right before a node of the tree of
+ * self changes, so that the transaction in progress can put it back: its
+ * value, its list of children, one of its children that is erased or moved
+ * out, or all of it */
+static void
+PyPropertyTree_SaveValue(PyPropertyTree *self, boost::property_tree::ptree &node)
 {
-    const char *key;
-    Py_ssize_t key_len;
-    const char *keywords[] = {"key", NULL};
-
+    if (ptree_undo_log *undo = PyPropertyTree_Undo(self))
+        undo->save_value(node);
+}
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#:find", (char **) keywords, &key, &key_len)) {
-        return NULL;
-    }
 
-    boost::property_tree::ptree::assoc_iterator retval = self->obj->find(std::string(key, key_len));
+static void
+PyPropertyTree_SaveChildren(PyPropertyTree *self, boost::property_tree::ptree &node)
+{
+    if (ptree_undo_log *undo = PyPropertyTree_Undo(self))
+        undo->save_children(node);
+}
 
-    if (retval == self->obj->not_found())
-        Py_RETURN_NONE;
 
-    return (PyObject*)PyPropertyTree_New(&retval->second, PTREE_FLAG_OBJECT_NOT_OWNED);
+static void
+PyPropertyTree_SaveRemoved(PyPropertyTree *self, boost::property_tree::ptree &parent,
+                           const boost::property_tree::ptree::value_type &child)
+{
+    if (ptree_undo_log *undo = PyPropertyTree_Undo(self))
+        undo->save_removed(parent, child);
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_get__doc__,
-"get(path, default=None) -> Tree\n\n"
-"    Get the child node at the given path, else default.\n"
-"    If default is not provided a BadPathError is raised.\n");
+static void
+PyPropertyTree_SaveContent(PyPropertyTree *self, boost::property_tree::ptree &node)
+{
+    if (ptree_undo_log *undo = PyPropertyTree_Undo(self))
+        undo->save_content(node);
+}
 
 
-static PyObject*
-PyPropertyTree_get(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+/* Called right before a node is put at path in the tree of self, or added
+ * there if add is true. Walks the path as put_child() and add_child() do:
+ * the node found there is replaced, or the last node of the path that is
+ * in the tree gets a new child */
+static void
+PyPropertyTree_SavePath(PyPropertyTree *self, const std::string &path, bool add)
 {
-    boost::property_tree::ptree *retval;
-    const char *path;
-    Py_ssize_t path_len;
-    PyObject *py_default = NULL;
-    const char *keywords[] = {"path", "default", NULL};
+    ptree_undo_log *undo = PyPropertyTree_Undo(self);
+    boost::property_tree::ptree::path_type fragments(path);
+    boost::property_tree::ptree *node = self->obj;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#|O:get", (char **) keywords, &path, &path_len, &py_default)) {
-        return NULL;
-    }
+    if (!undo)
+        return;
 
-    try {
-        retval = &self->obj->get_child(std::string(path, path_len));
-    } catch (boost::property_tree::ptree_bad_path const &exc) {
-        if (py_default == NULL) {
-            PyErr_SetString((PyObject *) PyPropertyTreeBadPathError_Type, exc.what());
-            return NULL;
-        } else {
-            Py_INCREF(py_default);
-            return py_default;
+    while (!fragments.empty() && !(add && fragments.single())) {
+        boost::property_tree::ptree::assoc_iterator child = node->find(fragments.reduce());
+
+        if (child == node->not_found()) {
+            undo->save_children(*node);
+            return;
         }
+        node = &child->second;
     }
 
-    return (PyObject*)PyPropertyTree_New(retval, PTREE_FLAG_OBJECT_NOT_OWNED);
+    if (add)
+        undo->save_children(*node);
+    else
+        undo->save_content(*node);
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_index__doc__,
-"index(key, start=0, end=-1)\n\n"
-"    Return zero-based index in the tree of the first item\n"
-"    whose value is equal to key\n");
+static unsigned long
+PyPropertyTree_Generation(PyPropertyTree *self)
+{
+    return (self->root ? self->root : self)->generation;
+}
 
 
-static PyObject*
-PyPropertyTree_index(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+struct ptree_sort_helper
 {
-    int start = 0;
-    int end = self->obj->size();
-    int index = 0;
-    const char *key;
-    Py_ssize_t key_len;
-    const char *keywords[] = {"key", "start", "end", NULL};
+    PyObject *callable;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#|ii:index", (char **) keywords,
-                                     &key, &key_len, &start, &end)) {
-        return NULL;
+    ptree_sort_helper(PyObject *callable) : callable(callable) {}
+
+    template <typename P>
+    bool operator ()(P& lhs, P& rhs) {
+        PyObject *py_lhs = (PyObject *)PyPropertyTree_New(&lhs.second, PTREE_FLAG_OBJECT_NOT_OWNED);
+        PyObject *py_rhs = (PyObject *)PyPropertyTree_New(&rhs.second, PTREE_FLAG_OBJECT_NOT_OWNED);
+
+        PyObject *retval = PyObject_CallFunction(callable, (char *) "(sO)(sO)",
+                                                           lhs.first.c_str(), py_lhs,
+                                                           rhs.first.c_str(), py_rhs);
+
+        Py_DECREF(py_lhs);
+        Py_DECREF(py_rhs);
+
+        if (!retval) {
+            throw boost::property_tree::ptree_error("sort function call failed");
+        }
+
+        bool result = PyObject_IsTrue(retval);
+
+        Py_DECREF(retval);
+
+        return result;
     }
+};
 
-    std::string key_std(key, key_len);
-    boost::property_tree::ptree::iterator iter(self->obj->begin());
 
-    while (index < start) {
-        if (iter == self->obj->end())
-            goto error;
-        ++index;
-        ++iter;
+static int
+py_value_to_string(PyObject *value, std::string &str)
+{
+    const char *value_str;
+    Py_ssize_t value_len;
+
+    if (value == Py_None) {
+        str = "none";
+    } else if (PyBool_Check(value)) {
+        str = (value == Py_True ? "true" : "false");
+    } else if (PyNumber_Check(value)){
+        PyObject *py_str = PyObject_Str(value);
+        value_str = PyUnicode_AsUTF8AndSize(py_str, &value_len);
+        str = std::string(value_str, value_len);
+        Py_DECREF(py_str);
+    } else if (PyUnicode_Check(value)) {
+        value_str = PyUnicode_AsUTF8AndSize(value, &value_len);
+        str = std::string(value_str, value_len);
+    } else {
+        return -1;
     }
+    return 0;
+}
 
-    while (index < end) {
-        if (iter == self->obj->end())
-            goto error;
-        else if (iter->first == key_std)
-            return PyLong_FromLong(index);
-        ++index;
-        ++iter;
+
+/* Called before children of source are moved into self: the views of those
+ * children keep the source root alive, which now has to keep the root of
+ * self alive */
+static int
+PyPropertyTree_AddHeir(PyPropertyTree *source, PyPropertyTree *self)
+{
+    PyPropertyTree *source_root = source->root ? source->root : source;
+    PyPropertyTree *self_root = self->root ? self->root : self;
+
+    if (source_root == self_root)
+        return 0;
+
+    if (!source_root->heirs && !(source_root->heirs = PyList_New(0)))
+        return -1;
+
+    if (PySequence_Contains(source_root->heirs, (PyObject *) self_root) == 0 &&
+        PyList_Append(source_root->heirs, (PyObject *) self_root) < 0) {
+        return -1;
     }
 
-error:
-    PyErr_Format(PyExc_ValueError, "%s is not in tree", key);
-    return NULL;
+    return 0;
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_insert__doc__,
-"insert(index, key, value) -> Tree\n\n"
-"    Insert a copy of the given tree with its key\n"
-"    just before the given position in this node.\n");
+/* Map the descendants of a tree to themselves, for the nodes that move
+ * along with their parent */
+static void
+ptree_collect_nodes(const boost::property_tree::ptree &tree,
+                    std::unordered_map<const boost::property_tree::ptree*, boost::property_tree::ptree*> &nodes)
+{
+    for (const boost::property_tree::ptree::value_type &child : tree) {
+        nodes[&child.second] = const_cast<boost::property_tree::ptree*>(&child.second);
+        ptree_collect_nodes(child.second, nodes);
+    }
+}
 
 
-static PyObject*
-PyPropertyTree_insert(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+/* Called when nodes of source went to the tree of self, the descendants of
+ * parents along with them and the nodes in moved replaced by the ones they
+ * are mapped to: their views, and the iterators over them, are handed over
+ * to the root of self, which their changes now go to */
+static void
+PyPropertyTree_Reroot(PyPropertyTree *source, PyPropertyTree *self,
+                      const std::vector<boost::property_tree::ptree*> &parents,
+                      std::unordered_map<const boost::property_tree::ptree*, boost::property_tree::ptree*> &moved)
 {
-    int index;
-    const char *key;
-    Py_ssize_t key_len;
-    PyObject *value;
-    std::string value_std;
-    boost::property_tree::ptree::iterator retval, iter;
-    const char *keywords[] = {"index", "key", "value", NULL};
+    PyPropertyTree *source_root = source->root ? source->root : source;
+    PyPropertyTree *self_root = self->root ? self->root : self;
+    std::vector<PyObject*> users;
+
+    if (!source_root->views)
+        return;
+
+    // nothing to look for when source is the only view
+    if (source_root->views->size() == source_root->views->count((PyObject*)source))
+        return;
+
+    for (boost::property_tree::ptree *parent : parents)
+        ptree_collect_nodes(*parent, moved);
+
+    for (PyObject *user : *source_root->views) {
+        PyPropertyTree *tree = NULL;
+
+        if (Py_TYPE(user) == &PyPropertyTree_Type)
+            tree = (PyPropertyTree*)user;
+        else if (Py_TYPE(user) == &PyPropertyTree_IterType)
+            tree = ((PyPropertyTree_Iter*)user)->container;
+        else if (Py_TYPE(user) == &PyPropertyTree_AssocIterType)
+            tree = ((PyPropertyTree_AssocIter*)user)->container;
+        else if (Py_TYPE(user) == &PyPropertyTree_WalkIterType)
+            tree = ((PyPropertyTree_WalkIter*)user)->container;
+
+        if (tree && moved.count(tree->obj))
+            users.push_back(user);
+    }
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "is#O:insert", (char **) keywords, &index, &key, &key_len, &value)) {
-        return NULL;
+    // the iterators follow the nodes they go through, only walkers keep the node they started from
+    for (PyObject *user : users) {
+        source_root->views->erase(user);
+        PyPropertyTree_Track(self_root, user);
+
+        if (Py_TYPE(user) == &PyPropertyTree_WalkIterType) {
+            PyPropertyTree_WalkIter *iter = (PyPropertyTree_WalkIter*)user;
+
+            if (iter->walker)
+                ptree_walker_rebase(iter->walker, *moved[iter->container->obj]);
+        }
     }
 
-    if (index < 0)
-        index += self->obj->size() + 1;
+    for (PyObject *user : users) {
+        PyPropertyTree *view = (PyPropertyTree*)user;
 
-    if (index < 0 || (std::size_t)index > self->obj->size()) {
-        PyErr_SetString(PyExc_IndexError, "insert index out of range");
-        return NULL;
+        if (Py_TYPE(user) != &PyPropertyTree_Type)
+            continue;
+
+        view->obj = moved[view->obj];
+        view->root = self_root;
+        Py_INCREF(self_root);
+        Py_DECREF(source_root);
     }
+}
 
-    iter = self->obj->begin();
 
-    for (int i = 0; i < index; i++)
-        ++iter;
+/* Whether node is tree or one of its descendants */
+static bool
+ptree_contains_node(const boost::property_tree::ptree &tree, const boost::property_tree::ptree *node)
+{
+    if (&tree == node)
+        return true;
 
-    if (PyObject_IsInstance(value, (PyObject *) &PyPropertyTree_Type)) {
-        retval = self->obj->insert(iter, {std::string(key, key_len), *((PyPropertyTree *)value)->obj});
-    } else if (py_value_to_string(value, value_std) == 0) {
-        boost::property_tree::ptree tree(value_std);
-        retval = self->obj->insert(iter, {std::string(key, key_len), tree});
-    } else {
-        PyErr_SetObject(PyExc_ValueError, value);
-        return NULL;
+    for (const boost::property_tree::ptree::value_type &child : tree) {
+        if (ptree_contains_node(child.second, node))
+            return true;
     }
 
-    return (PyObject*)PyPropertyTree_New(&retval->second, PTREE_FLAG_OBJECT_NOT_OWNED);
+    return false;
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_items__doc__,
-"items() -> iterator\n\n"
-"    Return an iterator to the ((key, value) pairs) of children.\n");
+/* Convert a python value into the node to add to self, a tree is copied or,
+ * if move is true, its children and data are taken in O(1) and it is left
+ * empty where it is. Returns -1 with an exception set */
+static int
+py_value_to_ptree(PyPropertyTree *self, PyObject *value, bool move, boost::property_tree::ptree &tree)
+{
+    std::string value_std;
 
+    if (!PyObject_IsInstance(value, (PyObject *) &PyPropertyTree_Type)) {
+        if (py_value_to_string(value, value_std) < 0) {
+            PyErr_SetObject(PyExc_ValueError, value);
+            return -1;
+        }
+        tree.data() = value_std;
+        return 0;
+    }
 
-static PyObject*
-PyPropertyTree_items(PyPropertyTree *self)
-{
-    PyPropertyTree_Iter *iter;
+    PyPropertyTree *source = (PyPropertyTree *) value;
 
-    iter = PyObject_GC_New(PyPropertyTree_Iter, &PyPropertyTree_IterType);
-    Py_INCREF(self);
-    iter->container = self;
-    iter->iterator = new boost::property_tree::ptree::iterator(self->obj->begin());
-    iter->callable = NULL;
+    if (!move) {
+        tree = *source->obj;
+        return 0;
+    }
 
-    return (PyObject*)iter;
-}
+    PyPropertyTree *source_root = source->root ? source->root : source;
+    PyPropertyTree *self_root = self->root ? self->root : self;
 
+    if (source_root == self_root && ptree_contains_node(*source->obj, self->obj)) {
+        PyErr_SetString(PyExc_ValueError, "can't move a tree into itself");
+        return -1;
+    }
 
-PyDoc_STRVAR(PyPropertyTree_keys__doc__,
-"keys()\n\n"
-"    Get a list of all the child keys.\n");
+    if (!source->obj->empty() && PyPropertyTree_AddHeir(source, self) < 0)
+        return -1;
 
+    if (PyPropertyTree_Modified(source) < 0)
+        return -1;
 
-static PyObject*
-PyPropertyTree_keys(PyPropertyTree *self)
-{
-    PyObject *list = PyList_New(self->obj->size());
-    boost::property_tree::ptree::iterator iter = self->obj->begin();
+    PyPropertyTree_SaveContent(source, *source->obj);
+    tree.swap(*source->obj);
 
-    for (Py_ssize_t i = 0; iter != self->obj->end(); iter++, i++) {
-        const std::string &key = iter->first;
+    if (source_root != self_root) {
+        std::unordered_map<const boost::property_tree::ptree*, boost::property_tree::ptree*> moved;
 
-        PyList_SET_ITEM(list, i, PyUnicode_DecodeUTF8(key.c_str(), key.size(), NULL));
+        PyPropertyTree_Reroot(source, self, {&tree}, moved);
     }
 
-    return list;
+    return 0;
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_pop__doc__,
-"pop(key, default=None) -> Tree\n\n"
-"    Remove the child with the given key and return its value, else default.\n"
-"    If default is not given and key is not in the tree, a KeyError is raised.\n"
-"    * There is no guarantee about which child is returned if multiple have\n"
-"      the same key.\n");
+static bool
+ptree_parse_number(const std::string &str, double &value)
+{
+    const char *first = str.c_str();
+    const char *last = first + str.size();
 
+    // from_chars doesn't accept a leading '+'
+    if (first != last && *first == '+')
+        ++first;
 
-static PyObject*
-PyPropertyTree_pop(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+    std::from_chars_result result = std::from_chars(first, last, value);
+
+    return first != last && result.ec == std::errc() && result.ptr == last;
+}
+
+
+/* Split a dotted path into its keys, an empty path is the node itself */
+static std::vector<std::string>
+ptree_split_path(const std::string &path)
 {
-    const char *key = NULL;
-    Py_ssize_t key_len;
-    PyObject *py_default = NULL;
-    PyPropertyTree *py_ptree;
-    const char *keywords[] = {"index", "default", NULL};
+    std::vector<std::string> keys;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#|O:pop", (char **) keywords, &key, &key_len, &py_default)) {
-        return NULL;
+    for (std::size_t start = 0, i = 0; !path.empty() && i <= path.size(); i++) {
+        if (i == path.size() || path[i] == '.') {
+            keys.push_back(path.substr(start, i - start));
+            start = i + 1;
+        }
     }
 
-    boost::property_tree::ptree::assoc_iterator iter(self->obj->find(std::string(key, key_len)));
+    return keys;
+}
 
-    if (iter == self->obj->not_found()) {
-        if (py_default == NULL) {
-            PyErr_SetString(PyExc_KeyError, key);
-            return NULL;
-        } else {
-            Py_INCREF(py_default);
-            return py_default;
+
+/* Find needle in haystack, NULL if not found. With SSE2 sixteen candidate
+ * positions are tested at a time by comparing the first and last bytes of
+ * the needle, only the positions where both match are compared in full. */
+static const char*
+ptree_memmem(const char *haystack, std::size_t haystack_len, const char *needle, std::size_t needle_len)
+{
+    if (needle_len == 0)
+        return haystack;
+    if (haystack_len < needle_len)
+        return NULL;
+
+    const std::size_t last = needle_len - 1;
+    const std::size_t end = haystack_len - last;    // one past the last candidate
+    std::size_t i = 0;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+    const __m128i first_byte = _mm_set1_epi8(needle[0]);
+    const __m128i last_byte = _mm_set1_epi8(needle[last]);
+
+    for (; i + 16 <= end; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *) (haystack + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *) (haystack + i + last));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first_byte),
+                                                        _mm_cmpeq_epi8(block_last, last_byte)));
+        while (mask) {
+            std::size_t pos = i + __builtin_ctz(mask);
+
+            if (memcmp(haystack + pos + 1, needle + 1, last) == 0)
+                return haystack + pos;
+            mask &= mask - 1;
         }
     }
+#endif
 
-    py_ptree = PyPropertyTree_New(new boost::property_tree::ptree(iter->second), PTREE_FLAG_NONE);
+    for (; i < end; ++i) {
+        if (haystack[i] == needle[0] && haystack[i + last] == needle[last] &&
+            memcmp(haystack + i + 1, needle + 1, last) == 0)
+            return haystack + i;
+    }
 
-    self->obj->erase(self->obj->to_iterator(iter));
+    return NULL;
+}
 
-    return (PyObject*) py_ptree;
+/* a json array: children that all have an empty key */
+static bool
+ptree_is_array(const boost::property_tree::ptree &node)
+{
+    if (node.empty())
+        return false;
+
+    for (const boost::property_tree::ptree::value_type &child : node) {
+        if (!child.first.empty())
+            return false;
+    }
+    return true;
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_popitem__doc__,
-"popitem(index=-1) -> (key, value)\n\n"
-"    Remove and return the child at the given index.\n"
-"    If no index is specified remove and return the last child.\n");
+enum ptree_merge_strategy {
+    PTREE_MERGE_REPLACE,
+    PTREE_MERGE_APPEND,
+    PTREE_MERGE_KEEP,
+};
 
 
-static PyObject*
-PyPropertyTree_popitem(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+/* Deep merge src into dst: objects are merged key by key, the first child
+ * with a key is merged with the one in src, arrays are replaced or
+ * concatenated. Anything else is a conflict that the strategy resolves,
+ * returns false for an append conflict, which the caller resolves by
+ * adding src next to dst. The nodes of dst are saved in undo before they
+ * change if a transaction is in progress */
+static bool
+ptree_merge(boost::property_tree::ptree &dst, const boost::property_tree::ptree &src,
+            ptree_merge_strategy strategy = PTREE_MERGE_REPLACE, bool concat = false,
+            ptree_undo_log *undo = NULL)
 {
-    int index = self->obj->size() - 1;
-    PyPropertyTree *py_ptree;
-    const char *keywords[] = {"index", NULL};
+    bool src_array = ptree_is_array(src), dst_array = ptree_is_array(dst);
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "|i:popitem", (char **) keywords, &index)) {
-        return NULL;
+    if (src_array && dst_array) {
+        if (concat) {
+            if (undo)
+                undo->save_children(dst);
+            dst.insert(dst.end(), src.begin(), src.end());
+        } else {
+            if (undo)
+                undo->save_content(dst);
+            dst = src;
+        }
+        return true;
     }
 
-    if (index < 0)
-        index += self->obj->size();
+    // an empty object changes nothing
+    if (src.empty() && (src.data() == dst.data() || (src.data().empty() && !dst.empty())))
+        return true;
 
-    if (index < 0 || (std::size_t)index >= self->obj->size()) {
-        PyErr_SetString(PyExc_IndexError, "popitem index out of range");
-        return NULL;
+    if (src.empty() || dst.empty() || src_array || dst_array) {
+        if (strategy == PTREE_MERGE_REPLACE) {
+            if (undo)
+                undo->save_content(dst);
+            dst = src;
+        }
+        return strategy != PTREE_MERGE_APPEND;
     }
 
-    boost::property_tree::ptree::iterator iter(self->obj->begin());
-
-    for (int i = 0; i < index; i++)
-        ++iter;
+    if (!src.data().empty() && (dst.data().empty() || strategy == PTREE_MERGE_REPLACE)) {
+        if (undo)
+            undo->save_value(dst);
+        dst.data() = src.data();
+    }
 
-    std::string key = iter->first;
-    py_ptree = PyPropertyTree_New(new boost::property_tree::ptree(iter->second), PTREE_FLAG_NONE);
+    for (const boost::property_tree::ptree::value_type &child : src) {
+        boost::property_tree::ptree::assoc_iterator found = dst.find(child.first);
 
-    self->obj->erase(iter);
+        if (found == dst.not_found() || !ptree_merge(found->second, child.second, strategy, concat, undo)) {
+            if (undo)
+                undo->save_children(dst);
+            dst.push_back(child);
+        }
+    }
 
-    return Py_BuildValue((char *) "s#N", key.c_str(), key.size(), py_ptree);
+    return true;
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_put__doc__,
-"put(path, value) -> Tree\n\n"
-"    Set the node at the given path to the given value.\n"
-"    If the node identified by the path does not exist, create it and\n"
-"    all its missing parents.\n"
-"    If the node at the path already exists, replace its value.\n");
+/* --- parallel evaluation --- */
 
 
-static PyObject*
-PyPropertyTree_put(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+/* smallest number of items worth handing to another thread */
+#define PTREE_PARALLEL_MIN_CHUNK 4096
+
+
+static unsigned
+ptree_thread_count(int threads)
 {
-    const char *path;
-    Py_ssize_t path_len;
-    PyObject *value;
-    std::string value_std;
-    boost::property_tree::ptree *retval;
-    const char *keywords[] = {"path", "value", NULL};
+    if (threads <= 0)
+        threads = std::thread::hardware_concurrency();
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#O:put", (char **) keywords, &path, &path_len, &value)) {
-        return NULL;
+    return threads > 0 ? threads : 1;
+}
+
+
+/* call function(begin, end) over [0, count) split into contiguous chunks,
+ * one per thread, the calling thread takes the first chunk.
+ * Doesn't touch the GIL, callers release it around the call. */
+template <typename Function>
+static void
+ptree_parallel_for(std::size_t count, unsigned threads, Function function)
+{
+    std::size_t chunks = std::min<std::size_t>(threads, count / PTREE_PARALLEL_MIN_CHUNK);
+
+    if (chunks <= 1) {
+        function(std::size_t(0), count);
+        return;
     }
 
-    std::string path_std(path, path_len);
+    std::size_t chunk_size = (count + chunks - 1) / chunks;
+    std::vector<std::thread> workers;
 
-    if (PyObject_IsInstance(value, (PyObject *) &PyPropertyTree_Type)) {
-        retval = &self->obj->put_child(path_std, *(((PyPropertyTree *)value)->obj));
-    } else if (py_value_to_string(value, value_std) == 0) {
-        boost::property_tree::ptree tree(value_std);
-        retval = &self->obj->put_child(path_std, tree);
-    } else {
-        PyErr_SetObject(PyExc_ValueError, value);
-        return NULL;
+    for (std::size_t begin = chunk_size; begin < count; begin += chunk_size) {
+        std::size_t end = std::min(begin + chunk_size, count);
+
+        try {
+            workers.emplace_back(function, begin, end);
+        } catch (std::system_error const &) {
+            // out of threads, do it here instead
+            function(begin, end);
+        }
     }
 
-    return (PyObject*)PyPropertyTree_New(retval, PTREE_FLAG_OBJECT_NOT_OWNED);
+    function(std::size_t(0), std::min(chunk_size, count));
+
+    for (std::thread &worker : workers)
+        worker.join();
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_setdefault__doc__,
-"setdefault(path, default=None) -> Tree\n\n"
-"    If path is in the tree, return its value.\n"
-"    If the node identified by the path does not exist, create it and\n"
-"    all its missing parents.\n");
+/* --- query engine --- */
 
 
-PyDoc_STRVAR(PyPropertyTree_remove__doc__,
-"remove(key)\n\n"
-"    Remove the first child whose value is equal to key.\n");
+/* deepest nesting of filters, they are evaluated and freed recursively */
+#define QUERY_MAX_DEPTH 1000
 
 
-static PyObject*
-PyPropertyTree_remove(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+struct query_error : public boost::property_tree::ptree_error
 {
-    const char *key ;
-    Py_ssize_t key_len;
-    const char *keywords[] = {"key", NULL};
+    query_error(const std::string &what) : boost::property_tree::ptree_error(what) {}
+};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#:remove", (char **) keywords, &key, &key_len)) {
-        return NULL;
-    }
 
-    std::string key_std(key, key_len);
+struct query_literal
+{
+    enum literal_type { STRING, NUMBER, BOOLEAN, NONE };
 
-    for (boost::property_tree::ptree::iterator iter = self->obj->begin(); iter != self->obj->end(); iter++) {
-        if (iter->first == key_std) {
-            self->obj->erase(iter);
-            Py_RETURN_NONE;
-        }
-    }
+    literal_type type;
+    std::string str;
+    double number;
+    bool boolean;
+};
 
-    PyErr_SetNone(PyExc_ValueError);
-    return NULL;
-}
 
+struct query_filter
+{
+    enum filter_op { OR, AND, NOT, EXISTS, EQ, NE, LT, LE, GT, GE, CONTAINS };
 
-PyDoc_STRVAR(PyPropertyTree_reverse__doc__,
-"reverse()\n\n"
-"    Reverse the children in place.\n");
+    filter_op op;
+    std::shared_ptr<const query_filter> lhs;
+    std::shared_ptr<const query_filter> rhs;
+    std::vector<std::string> field;   // path relative to the tested node, empty for '@'
+    query_literal literal;
+    std::size_t depth = 1;            // filters on the longest path down from this one
 
+    bool eval(const boost::property_tree::ptree &node) const;
+};
 
-static PyObject*
-PyPropertyTree_reverse(PyPropertyTree *self)
+
+struct query_step
 {
-    self->obj->reverse();
-    Py_RETURN_NONE;
-}
+    enum step_type { CHILD, WILDCARD, INDEX, FILTER, DESCEND };
 
+    step_type type;
+    std::string key;
+    long index;
+    std::shared_ptr<const query_filter> filter;
+};
 
-PyDoc_STRVAR(PyPropertyTree_search__doc__,
-"search(arg) -> iterator\n\n"
-"    Return an iterator to the children that match this key.\n"
-"    Argument can be a string or function of the type: func(key, value) -> Bool\n");
 
-static PyObject*
-PyPropertyTree_search(PyPropertyTree *self, PyObject *arg)
+struct query_plan
 {
-    const char *key;
-    Py_ssize_t key_len;
-
-    if (PyUnicode_Check(arg)) {
-        PyPropertyTree_AssocIter *iter;
-
-        key = PyUnicode_AsUTF8AndSize(arg, &key_len);
-        iter = PyObject_GC_New(PyPropertyTree_AssocIter, &PyPropertyTree_AssocIterType);
+    std::vector<query_step> steps;
 
-        Py_INCREF(self);
+    void eval(boost::property_tree::ptree &root, std::vector<boost::property_tree::ptree*> &result,
+              unsigned threads = 1) const;
+    void eval_field(boost::property_tree::ptree &root, std::vector<const boost::property_tree::ptree*> &result,
+                    std::vector<boost::property_tree::ptree*> *owners = NULL) const;
+};
 
-        iter->container = self;
-        iter->iterator = self->obj->equal_range(std::string(key, key_len));
 
-        return (PyObject*)iter;
+static const boost::property_tree::ptree*
+query_resolve_field(const boost::property_tree::ptree &node, const std::vector<std::string> &field)
+{
+    const boost::property_tree::ptree *retval = &node;
 
-    } else if (PyCallable_Check(arg)) {
-        PyPropertyTree_Iter *iter;
-        iter = PyObject_GC_New(PyPropertyTree_Iter, &PyPropertyTree_IterType);
+    for (const std::string &key : field) {
+        boost::property_tree::ptree::const_assoc_iterator iter = retval->find(key);
 
-        Py_INCREF(self);
-        Py_XINCREF(arg);
+        if (iter == retval->not_found())
+            return NULL;
 
-        iter->container = self;
-        iter->iterator = new boost::property_tree::ptree::iterator(self->obj->begin());
-        iter->callable = arg;
-    
-        return (PyObject*)iter;
+        retval = &iter->second;
     }
 
-    PyErr_SetString(PyExc_TypeError, "argument not a string or callable object");
-    return NULL;
+    return retval;
 }
 
 
-static PyObject*
-PyPropertyTree_setdefault(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+static bool
+query_compare(const std::string &data, query_filter::filter_op op, const query_literal &literal)
 {
-    const char *path;
-    Py_ssize_t path_len;
-    PyObject *value = Py_None;
-    std::string value_std;
-    boost::property_tree::ptree *retval;
-    const char *keywords[] = {"path", "default", NULL};
+    int cmp = 0;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#|O:setdefault", (char **) keywords, &path, &path_len, &value)) {
-        return NULL;
-    }
+    switch (literal.type) {
+        case query_literal::NUMBER: {
+            double value;
 
-    std::string path_std(path, path_len);
+            // values that aren't numbers (or are NaN) only compare unequal
+            if (!ptree_parse_number(data, value) || value != value)
+                return op == query_filter::NE;
 
-    try {
-        retval = &self->obj->get_child(path_std);
-    } catch (boost::property_tree::ptree_bad_path const &exc) {
-        if (PyObject_IsInstance(value, (PyObject *) &PyPropertyTree_Type)) {
-            retval = &self->obj->put_child(path_std, *(((PyPropertyTree *)value)->obj));
-        } else if (py_value_to_string(value, value_std) == 0) {
-            boost::property_tree::ptree tree(value_std);
-            retval = &self->obj->put_child(path_std, tree);
-        } else {
-            PyErr_SetObject(PyExc_ValueError, value);
-            return NULL;
+            cmp = (value < literal.number) ? -1 : (value > literal.number);
+            break;
+        }
+        case query_literal::STRING:
+            cmp = data.compare(literal.str);
+            break;
+        case query_literal::BOOLEAN: {
+            bool value;
+
+            if (data == "true" || data == "1")
+                value = true;
+            else if (data == "false" || data == "0")
+                value = false;
+            else
+                return op == query_filter::NE;
+
+            cmp = (int)value - (int)literal.boolean;
+            break;
+        }
+        case query_literal::NONE: {
+            // json null is stored as "null", python None as "none"
+            bool is_null = (data == "null" || data == "none");
+
+            if (op == query_filter::EQ)
+                return is_null;
+            else if (op == query_filter::NE)
+                return !is_null;
+            return false;
         }
     }
 
-    return (PyObject*)PyPropertyTree_New(retval, PTREE_FLAG_OBJECT_NOT_OWNED);
+    switch (op) {
+        case query_filter::EQ: return cmp == 0;
+        case query_filter::NE: return cmp != 0;
+        case query_filter::LT: return cmp < 0;
+        case query_filter::LE: return cmp <= 0;
+        case query_filter::GT: return cmp > 0;
+        case query_filter::GE: return cmp >= 0;
+        default:               return false;
+    }
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_sort__doc__,
-"sort(key=None)\n\n"
-"    Sort the children according to key order or a callable object.\n");
+bool
+query_filter::eval(const boost::property_tree::ptree &node) const
+{
+    switch (op) {
+        case OR:
+            return lhs->eval(node) || rhs->eval(node);
+        case AND:
+            return lhs->eval(node) && rhs->eval(node);
+        case NOT:
+            return !lhs->eval(node);
+        default:
+            break;
+    }
 
+    const boost::property_tree::ptree *target = query_resolve_field(node, field);
 
-static PyObject*
-PyPropertyTree_sort(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
-{
-    PyObject *callable = NULL;
-    const char *keywords[] = {"key", NULL};
+    if (op == EXISTS)
+        return target != NULL;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "|O:sort", (char **) keywords, &callable)) {
-        return NULL;
-    }
+    // a missing field is unequal to everything
+    if (target == NULL)
+        return op == NE;
 
-    if (!callable) {
-        self->obj->sort();
-        Py_RETURN_NONE;
-    }
+    if (op == CONTAINS)
+        return target->data().find(literal.str) != std::string::npos;
 
-    if (!PyCallable_Check(callable)) {
-        PyErr_SetString(PyExc_TypeError, "object not callable");
-        return NULL;
-    }
+    return query_compare(target->data(), op, literal);
+}
 
-    try {
-        Py_INCREF(callable);
 
-        self->obj->sort(ptree_sort_helper(callable));
+static void
+query_descend(boost::property_tree::ptree *node,
+              std::vector<boost::property_tree::ptree*> &result,
+              std::unordered_set<const boost::property_tree::ptree*> *seen)
+{
+    typedef boost::property_tree::ptree::iterator iterator;
+    std::vector<std::pair<iterator, iterator> > stack;
 
-        Py_DECREF(callable);
+    if (seen && !seen->insert(node).second)
+        return;
 
-        Py_RETURN_NONE;
+    result.push_back(node);
+    stack.emplace_back(node->begin(), node->end());
 
-    } catch (boost::property_tree::ptree_error const &exc) {
-        /* if python threw an error use that */
-        if (!PyErr_Occurred())
-            PyErr_SetString((PyObject *) PyExc_RuntimeError, exc.what());
+    while (!stack.empty()) {
+        if (stack.back().first == stack.back().second) {
+            stack.pop_back();
+            continue;
+        }
 
-        return NULL;
+        boost::property_tree::ptree &child = (stack.back().first++)->second;
+
+        if (seen && !seen->insert(&child).second)
+            continue;
+
+        result.push_back(&child);
+
+        if (!child.empty())
+            stack.emplace_back(child.begin(), child.end());
     }
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_sorted__doc__,
-"sorted() -> iterator\n\n"
-"    Get an iterator to the sorted children of this node, in key order.\n");
+void
+query_plan::eval(boost::property_tree::ptree &root, std::vector<boost::property_tree::ptree*> &result,
+                 unsigned threads) const
+{
+    std::vector<boost::property_tree::ptree*> current(1, &root), next;
+
+    for (const query_step &step : steps) {
+        next.clear();
+
+        switch (step.type) {
+            case query_step::CHILD:
+                for (boost::property_tree::ptree *node : current) {
+                    std::pair<boost::property_tree::ptree::assoc_iterator,
+                              boost::property_tree::ptree::assoc_iterator> range = node->equal_range(step.key);
+
+                    for (; range.first != range.second; ++range.first)
+                        next.push_back(&range.first->second);
+                }
+                break;
+
+            case query_step::WILDCARD:
+                for (boost::property_tree::ptree *node : current) {
+                    for (boost::property_tree::ptree::iterator iter = node->begin(); iter != node->end(); ++iter)
+                        next.push_back(&iter->second);
+                }
+                break;
+
+            case query_step::INDEX:
+                for (boost::property_tree::ptree *node : current) {
+                    long index = step.index < 0 ? step.index + (long)node->size() : step.index;
+
+                    if (index >= 0 && index < (long)node->size()) {
+                        boost::property_tree::ptree::iterator iter(node->begin());
+                        std::advance(iter, index);
+                        next.push_back(&iter->second);
+                    }
+                }
+                break;
+
+            case query_step::FILTER:
+                if (threads > 1) {
+                    std::vector<boost::property_tree::ptree*> children;
+                    std::vector<char> matches;
+
+                    for (boost::property_tree::ptree *node : current) {
+                        for (boost::property_tree::ptree::iterator iter = node->begin(); iter != node->end(); ++iter)
+                            children.push_back(&iter->second);
+                    }
+
+                    matches.resize(children.size());
+
+                    ptree_parallel_for(children.size(), threads, [&](std::size_t begin, std::size_t end) {
+                        for (std::size_t i = begin; i < end; i++)
+                            matches[i] = step.filter->eval(*children[i]);
+                    });
+
+                    for (std::size_t i = 0; i < children.size(); i++) {
+                        if (matches[i])
+                            next.push_back(children[i]);
+                    }
+                    break;
+                }
+
+                for (boost::property_tree::ptree *node : current) {
+                    for (boost::property_tree::ptree::iterator iter = node->begin(); iter != node->end(); ++iter) {
+                        if (step.filter->eval(iter->second))
+                            next.push_back(&iter->second);
+                    }
+                }
+                break;
+
+            case query_step::DESCEND: {
+                // nested nodes would otherwise be visited once per selected ancestor
+                std::unordered_set<const boost::property_tree::ptree*> seen;
+
+                for (boost::property_tree::ptree *node : current)
+                    query_descend(node, next, current.size() > 1 ? &seen : NULL);
+                break;
+            }
+        }
 
+        current.swap(next);
 
-static PyObject*
-PyPropertyTree_sorted(PyPropertyTree *self)
-{
-    PyPropertyTree_AssocIter *iter;
+        if (current.empty())
+            break;
+    }
 
-    iter = PyObject_GC_New(PyPropertyTree_AssocIter, &PyPropertyTree_AssocIterType);
-    Py_INCREF(self);
-    iter->container = self;
-    iter->iterator = {self->obj->ordered_begin(), self->obj->not_found()};
-    
-    return (PyObject*)iter;
+    result.swap(current);
 }
 
 
-PyDoc_STRVAR(PyPropertyTree_values__doc__,
-"values()\n\n"
-"    Get a list of the children values.\n");
+/* Evaluate the plan as records and a field: the steps up to the last one
+ * that isn't a plain key select the records, the keys after it are looked
+ * up in each record. Records without the field give a NULL. The records
+ * themselves are added to owners if given. */
+void
+query_plan::eval_field(boost::property_tree::ptree &root, std::vector<const boost::property_tree::ptree*> &result,
+                       std::vector<boost::property_tree::ptree*> *owners) const
+{
+    std::size_t split = steps.size();
+    query_plan records;
+    std::vector<std::string> field;
+    std::vector<boost::property_tree::ptree*> nodes;
 
+    while (split > 0 && steps[split - 1].type == query_step::CHILD)
+        --split;
 
-static PyObject*
-PyPropertyTree_values(PyPropertyTree *self)
-{
-    PyObject *list = PyList_New(self->obj->size());
-    boost::property_tree::ptree::iterator iter = self->obj->begin();
+    records.steps.assign(steps.begin(), steps.begin() + split);
 
-    for (Py_ssize_t i = 0; iter != self->obj->end(); iter++, i++) {
-        PyList_SET_ITEM(list, i, (PyObject*)PyPropertyTree_New(&iter->second, PTREE_FLAG_OBJECT_NOT_OWNED));
-    }
+    for (std::size_t i = split; i < steps.size(); i++)
+        field.push_back(steps[i].key);
 
-    return list;
-}
+    records.eval(root, nodes);
 
+    result.reserve(result.size() + nodes.size());
 
-static PyObject*
-PyPropertyTree__copy__(PyPropertyTree *self)
-{
-    return (PyObject*)PyPropertyTree_New(new boost::property_tree::ptree(*self->obj), PTREE_FLAG_NONE);
+    for (boost::property_tree::ptree *node : nodes)
+        result.push_back(query_resolve_field(*node, field));
+
+    if (owners)
+        owners->insert(owners->end(), nodes.begin(), nodes.end());
 }
 
 
-static PyObject *
-PyPropertyTree__reduce__(PyPropertyTree *self)
+class query_parser
 {
-    PyObject *args, *py_iter;
+public:
+    query_parser(const std::string &expr) : expr(expr), pos(0), depth(0) {}
 
-    if (self->obj->data() == "") {
-        args = PyTuple_New(0);
-    } else {
-        args = PyTuple_New(1);
-        PyTuple_SET_ITEM(args, 0, PyUnicode_DecodeUTF8(self->obj->data().c_str(), self->obj->data().size(), NULL));
-    }
+    void parse(query_plan &plan)
+    {
+        bool first = true;
+
+        // optional JSONPath style root marker
+        if (pos < expr.size() && expr[pos] == '$')
+            ++pos;
+        else
+            skip_space();
+
+        while (pos < expr.size()) {
+            if (expr.compare(pos, 2, "..") == 0) {
+                pos += 2;
+                plan.steps.push_back({query_step::DESCEND, "", 0, nullptr});
+
+                if (pos < expr.size() && expr[pos] == '[')
+                    parse_bracket(plan);
+                else
+                    parse_key(plan);
+            } else if (expr[pos] == '.') {
+                ++pos;
+                parse_key(plan);
+            } else if (expr[pos] == '[') {
+                parse_bracket(plan);
+            } else if (first) {
+                parse_key(plan);
+            } else {
+                error("unexpected character");
+            }
 
-    if (self->obj->begin() == self->obj->end()) {
-        Py_INCREF(Py_None);
-        py_iter = Py_None;
-    } else {
-        PyPropertyTree_Iter *iter = PyObject_GC_New(PyPropertyTree_Iter, &PyPropertyTree_IterType);
-        Py_INCREF(self);
-        iter->container = self;
-        iter->iterator = new boost::property_tree::ptree::iterator(self->obj->begin());
-        iter->callable = NULL;
-        py_iter = (PyObject*)iter;
+            first = false;
+        }
     }
 
-    return Py_BuildValue("ONOON", (PyObject*)&PyPropertyTree_Type, args, Py_None, Py_None, py_iter);
-}
+private:
+    typedef std::shared_ptr<const query_filter> filter_ptr;
 
+    struct operand
+    {
+        bool is_field;
+        std::vector<std::string> field;
+        query_literal literal;
+    };
 
-static PyMethodDef PyPropertyTree_methods[] = {
-    {(char *) "add",
-     (PyCFunction) PyPropertyTree_add,
-     METH_KEYWORDS|METH_VARARGS,
-     PyPropertyTree_add__doc__},
-    {(char *) "append",
-     (PyCFunction) PyPropertyTree_append,
-     METH_KEYWORDS|METH_VARARGS,
-     PyPropertyTree_append__doc__},
-    {(char *) "clear",
-     (PyCFunction) PyPropertyTree_clear,
-     METH_NOARGS,
-     PyPropertyTree_clear__doc__},
-    {(char *) "count",
-     (PyCFunction) PyPropertyTree_count,
-     METH_KEYWORDS|METH_VARARGS,
-     PyPropertyTree_count__doc__},
-    {(char *) "empty",
-     (PyCFunction) PyPropertyTree_empty,
-     METH_NOARGS,
-     PyPropertyTree_empty__doc__},
-    {(char *) "erase",
-     (PyCFunction) PyPropertyTree_erase,
-     METH_KEYWORDS|METH_VARARGS,
-     PyPropertyTree_erase__doc__},
-    {(char *) "extend",
-     (PyCFunction) PyPropertyTree_extend,
-     METH_O,
-     PyPropertyTree_extend__doc__},
-    {(char *) "find",
-     (PyCFunction) PyPropertyTree_find,
-     METH_KEYWORDS|METH_VARARGS,
-     PyPropertyTree_find__doc__},
-    {(char *) "get",
-     (PyCFunction) PyPropertyTree_get,
-     METH_KEYWORDS|METH_VARARGS,
-     PyPropertyTree_get__doc__},
-    {(char *) "index",
-     (PyCFunction) PyPropertyTree_index,
-     METH_KEYWORDS|METH_VARARGS,
-     PyPropertyTree_index__doc__},
-    {(char *) "insert",
-     (PyCFunction) PyPropertyTree_insert,
-     METH_KEYWORDS|METH_VARARGS,
-     PyPropertyTree_insert__doc__},
-    {(char *) "items",
-     (PyCFunction) PyPropertyTree_items,
-     METH_NOARGS,
-     PyPropertyTree_items__doc__},
-    {(char *) "keys",
-     (PyCFunction) PyPropertyTree_keys,
-     METH_NOARGS,
-     PyPropertyTree_keys__doc__},
-    {(char *) "pop",
-     (PyCFunction) PyPropertyTree_pop,
-     METH_KEYWORDS|METH_VARARGS,
-     PyPropertyTree_pop__doc__},
-    {(char *) "popitem",
-     (PyCFunction) PyPropertyTree_popitem,
-     METH_KEYWORDS|METH_VARARGS,
-     PyPropertyTree_popitem__doc__},
-    {(char *) "put",
-     (PyCFunction) PyPropertyTree_put,
-     METH_KEYWORDS|METH_VARARGS,
-     PyPropertyTree_put__doc__},
-    {(char *) "remove",
-     (PyCFunction) PyPropertyTree_remove,
-     METH_KEYWORDS|METH_VARARGS,
-     PyPropertyTree_remove__doc__},
-    {(char *) "reverse",
-     (PyCFunction) PyPropertyTree_reverse,
-     METH_NOARGS,
-     PyPropertyTree_reverse__doc__},
-    {(char *) "search",
-     (PyCFunction) PyPropertyTree_search,
-     METH_O,
-     PyPropertyTree_search__doc__},
-    {(char *) "setdefault",
-     (PyCFunction) PyPropertyTree_setdefault,
-     METH_KEYWORDS|METH_VARARGS,
-     PyPropertyTree_setdefault__doc__},
-    {(char *) "sort",
-     (PyCFunction) PyPropertyTree_sort,
-     METH_KEYWORDS|METH_VARARGS,
-     PyPropertyTree_sort__doc__},
-    {(char *) "sorted",
-     (PyCFunction) PyPropertyTree_sorted,
-     METH_NOARGS,
-     PyPropertyTree_sorted__doc__},
-    {(char *) "values",
-     (PyCFunction) PyPropertyTree_values,
-     METH_NOARGS,
-     PyPropertyTree_values__doc__},
-    {(char *) "__copy__",
-     (PyCFunction) PyPropertyTree__copy__,
-     METH_NOARGS,
-     NULL},
-    {(char *) "__reduce__",
-     (PyCFunction) PyPropertyTree__reduce__,
-     METH_NOARGS,
-     NULL},
-    {NULL, NULL, 0, NULL}
-};
+    const std::string &expr;
+    std::size_t pos;
+    std::size_t depth;      // '!' and '(' being parsed
 
+    [[noreturn]] void error(const char *msg)
+    {
+        throw query_error(std::string(msg) + " at position " + std::to_string(pos) + " in '" + expr + "'");
+    }
 
-static PyObject*
-PyPropertyTree__tp_richcompare(PyPropertyTree *self, PyObject *other, int op)
-{
-    try {
-        if (PyObject_IsInstance(other, (PyObject*)&PyPropertyTree_Type)) {
-            switch (op) {
-                case Py_EQ:
-                    if (*self->obj == *((PyPropertyTree *)other)->obj)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_NE:
-                    if (*self->obj != *((PyPropertyTree *)other)->obj)
-                        Py_RETURN_TRUE;
-                    break;
-                default:
-                    Py_RETURN_NOTIMPLEMENTED;
+    void skip_space()
+    {
+        while (pos < expr.size() && isspace((unsigned char)expr[pos]))
+            ++pos;
+    }
+
+    bool accept(const char *token)
+    {
+        std::size_t len = strlen(token);
+
+        skip_space();
+
+        if (expr.compare(pos, len, token) == 0) {
+            pos += len;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(const char *token)
+    {
+        if (!accept(token))
+            error((std::string("expected '") + token + "'").c_str());
+    }
+
+    void parse_key(query_plan &plan)
+    {
+        std::size_t start = pos;
+
+        while (pos < expr.size() && expr[pos] != '.' && expr[pos] != '[')
+            ++pos;
+
+        if (pos == start)
+            error("expected a key");
+
+        std::string key = expr.substr(start, pos - start);
+
+        if (key == "*")
+            plan.steps.push_back({query_step::WILDCARD, "", 0, nullptr});
+        else
+            plan.steps.push_back({query_step::CHILD, key, 0, nullptr});
+    }
+
+    void parse_bracket(query_plan &plan)
+    {
+        ++pos; // '['
+        skip_space();
+
+        if (pos >= expr.size()) {
+            error("unterminated '['");
+        } else if (expr[pos] == '*') {
+            ++pos;
+            plan.steps.push_back({query_step::WILDCARD, "", 0, nullptr});
+        } else if (expr[pos] == '?') {
+            ++pos;
+            plan.steps.push_back({query_step::FILTER, "", 0, parse_or()});
+        } else if (expr[pos] == '\'' || expr[pos] == '"') {
+            plan.steps.push_back({query_step::CHILD, parse_string(), 0, nullptr});
+        } else {
+            const char *first = expr.c_str() + pos;
+            long index;
+            std::from_chars_result result = std::from_chars(first, expr.c_str() + expr.size(), index);
+
+            if (result.ec != std::errc())
+                error("expected '*', '?', a string or an index");
+
+            pos += result.ptr - first;
+            plan.steps.push_back({query_step::INDEX, "", index, nullptr});
+        }
+
+        expect("]");
+    }
+
+    std::string parse_string()
+    {
+        char quote = expr[pos++];
+        std::string retval;
+
+        while (pos < expr.size() && expr[pos] != quote) {
+            if (expr[pos] == '\\' && pos + 1 < expr.size())
+                ++pos;
+            retval += expr[pos++];
+        }
+
+        if (pos >= expr.size())
+            error("unterminated string");
+
+        ++pos;
+        return retval;
+    }
+
+    std::string parse_name()
+    {
+        static const char *delimiters = ".[]()!=<>&|'\"";
+        std::size_t start = pos;
+
+        while (pos < expr.size() && !isspace((unsigned char)expr[pos]) && !strchr(delimiters, expr[pos]))
+            ++pos;
+
+        if (pos == start)
+            error("expected a field name");
+
+        return expr.substr(start, pos - start);
+    }
+
+    filter_ptr make_filter(query_filter::filter_op op, filter_ptr lhs, filter_ptr rhs)
+    {
+        std::shared_ptr<query_filter> retval = std::make_shared<query_filter>();
+
+        retval->op = op;
+        retval->lhs = lhs;
+        retval->rhs = rhs;
+        retval->depth = 1 + std::max(lhs->depth, rhs ? rhs->depth : 0);
+
+        if (retval->depth > QUERY_MAX_DEPTH)
+            error("filter nested too deeply");
+
+        return retval;
+    }
+
+    filter_ptr parse_or()
+    {
+        filter_ptr retval = parse_and();
+
+        while (accept("||"))
+            retval = make_filter(query_filter::OR, retval, parse_and());
+
+        return retval;
+    }
+
+    filter_ptr parse_and()
+    {
+        filter_ptr retval = parse_unary();
+
+        while (accept("&&"))
+            retval = make_filter(query_filter::AND, retval, parse_unary());
+
+        return retval;
+    }
+
+    filter_ptr parse_unary()
+    {
+        filter_ptr retval;
+
+        skip_space();
+
+        if (expr.compare(pos, 1, "!") == 0 && expr.compare(pos, 2, "!=") != 0) {
+            ++pos;
+            enter();
+            retval = make_filter(query_filter::NOT, parse_unary(), nullptr);
+        } else if (accept("(")) {
+            enter();
+            retval = parse_or();
+            expect(")");
+        } else {
+            return parse_comparison();
+        }
+
+        depth--;
+        return retval;
+    }
+
+    void enter()
+    {
+        if (++depth > QUERY_MAX_DEPTH)
+            error("filter nested too deeply");
+    }
+
+    filter_ptr parse_comparison()
+    {
+        static const struct {
+            const char *token;
+            query_filter::filter_op op;
+            query_filter::filter_op flipped;
+        } operators[] = {
+            {"==", query_filter::EQ, query_filter::EQ},
+            {"!=", query_filter::NE, query_filter::NE},
+            {"<=", query_filter::LE, query_filter::GE},
+            {">=", query_filter::GE, query_filter::LE},
+            {"<",  query_filter::LT, query_filter::GT},
+            {">",  query_filter::GT, query_filter::LT},
+        };
+
+        std::shared_ptr<query_filter> retval = std::make_shared<query_filter>();
+        operand lhs = parse_operand();
+
+        for (const auto &oper : operators) {
+            if (!accept(oper.token))
+                continue;
+
+            operand rhs = parse_operand();
+
+            if (lhs.is_field && !rhs.is_field) {
+                retval->op = oper.op;
+                retval->field = lhs.field;
+                retval->literal = rhs.literal;
+            } else if (!lhs.is_field && rhs.is_field) {
+                retval->op = oper.flipped;
+                retval->field = rhs.field;
+                retval->literal = lhs.literal;
+            } else {
+                error("comparison needs one field and one literal");
             }
-        } else if (other == Py_None) {
-            switch (op) {
-                case Py_EQ:
-                    if (self->obj->data() == "none")
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_NE:
-                    if (self->obj->data() != "none")
-                        Py_RETURN_TRUE;
-                    break;
-                default:
-                    Py_RETURN_NOTIMPLEMENTED;
+            return retval;
+        }
+
+        if (!lhs.is_field)
+            error("expected a comparison");
+
+        retval->op = query_filter::EXISTS;
+        retval->field = lhs.field;
+        return retval;
+    }
+
+    operand parse_operand()
+    {
+        operand retval = {false, {}, {query_literal::NONE, "", 0.0, false}};
+
+        skip_space();
+
+        if (pos >= expr.size())
+            error("unexpected end of query");
+
+        char c = expr[pos];
+
+        if (c == '\'' || c == '"') {
+            retval.literal.type = query_literal::STRING;
+            retval.literal.str = parse_string();
+        } else if (isdigit((unsigned char)c) || ((c == '-' || c == '+' || c == '.') &&
+                   pos + 1 < expr.size() && isdigit((unsigned char)expr[pos + 1]))) {
+            std::size_t start = pos;
+
+            while (pos < expr.size() && (isalnum((unsigned char)expr[pos]) || strchr("+-.", expr[pos])))
+                ++pos;
+
+            retval.literal.type = query_literal::NUMBER;
+
+            if (!ptree_parse_number(expr.substr(start, pos - start), retval.literal.number))
+                error("invalid number");
+        } else if (c == '@') {
+            ++pos;
+            retval.is_field = true;
+
+            while (pos < expr.size() && expr[pos] == '.') {
+                ++pos;
+                retval.field.push_back(parse_name());
             }
-        } else if (PyBool_Check(other)) {
-            bool value = (other == Py_True ? true : false);
-            switch (op) {
-                case Py_LT:
-                    if (self->obj->get_value<bool>() < value)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_LE:
-                    if (self->obj->get_value<bool>() <= value)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_EQ:
-                    if (self->obj->get_value<bool>() == value)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_NE:
-                    if (self->obj->get_value<bool>() != value)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_GE:
-                    if (self->obj->get_value<bool>() >= value)
-                        Py_RETURN_TRUE;
+        } else {
+            std::string name = parse_name();
+
+            if (pos < expr.size() && expr[pos] == '.') {
+                retval.is_field = true;
+                retval.field.push_back(name);
+
+                while (pos < expr.size() && expr[pos] == '.') {
+                    ++pos;
+                    retval.field.push_back(parse_name());
+                }
+            } else if (name == "true" || name == "false") {
+                retval.literal.type = query_literal::BOOLEAN;
+                retval.literal.boolean = (name == "true");
+            } else if (name != "null") {
+                retval.is_field = true;
+                retval.field.push_back(name);
+            }
+        }
+
+        return retval;
+    }
+};
+
+/* --- tree walker --- */
+
+
+/* The index a path segment stands for if it is a number written the way
+ * indexes are, without leading zeros, SIZE_MAX otherwise */
+static std::size_t
+ptree_segment_index(std::string_view segment)
+{
+    std::size_t index = 0;
+    std::from_chars_result result = std::from_chars(segment.data(), segment.data() + segment.size(), index);
+
+    if (segment.empty() || (segment[0] == '0' && segment.size() > 1) ||
+        result.ec != std::errc() || result.ptr != segment.data() + segment.size())
+        return SIZE_MAX;
+
+    return index;
+}
+
+
+/* Whether the keys of the children of node are the numbers 0 to n - 1, which
+ * flattened with arrays="index" would read back as array indexes */
+static bool
+ptree_keys_are_indexes(const boost::property_tree::ptree &node)
+{
+    std::vector<bool> seen(node.size(), false);
+    std::size_t count = 0;
+
+    for (const boost::property_tree::ptree::value_type &child : node) {
+        std::size_t index = child.first.empty() ? SIZE_MAX : ptree_segment_index(child.first);
+
+        if (index >= node.size())
+            return false;
+
+        if (!seen[index]) {
+            seen[index] = true;
+            count++;
+        }
+    }
+
+    return count && std::find(seen.begin(), seen.begin() + count, false) == seen.begin() + count;
+}
+
+
+/* Append a key in quotes, doubling the quotes in it */
+static void
+ptree_path_append_quoted(std::string &path, const std::string &key, const std::string &separator)
+{
+    if (!path.empty())
+        path += separator;
+
+    path += '\'';
+    for (char c : key) {
+        if (c == '\'')
+            path += '\'';
+        path += c;
+    }
+    path += '\'';
+}
+
+
+/* Append the segment of a child to a path, keys are joined with separator and
+ * children with an empty key (json array items) are either [index] or the
+ * index as a key of its own */
+static void
+ptree_path_append(std::string &path, const std::string &key, std::size_t index,
+                  const std::string &separator, bool brackets)
+{
+    if (key.empty() && brackets) {
+        path += '[';
+        path += std::to_string(index);
+        path += ']';
+        return;
+    }
+
+    if (!path.empty())
+        path += separator;
+
+    if (key.empty())
+        path += std::to_string(index);
+    else
+        path += key;
+}
+
+
+/* Depth first traversal with an explicit stack. The path of the current
+ * node is kept in a buffer that is reused between nodes, children with an
+ * empty key (json array items) appear in it as [index]. In post order a
+ * node is returned after all of its descendants. */
+class ptree_walker
+{
+public:
+    ptree_walker(boost::property_tree::ptree &root, std::size_t max_depth = 0, bool post_order = false)
+        : tree(&root), current(NULL), max_depth(max_depth ? max_depth : SIZE_MAX), post_order(post_order),
+          separator("."), brackets(true)
+    {
+        stack.push_back({root.begin(), root.end(), 0, 0, NULL});
+    }
+
+    /* advance to the next node, false when there are no more */
+    bool next()
+    {
+        if (!post_order && current && descend(current))
+            stack.push_back({current->second.begin(), current->second.end(), path_buf.size(), 0, current});
+
+        while (!stack.empty()) {
+            frame &top = stack.back();
+
+            if (top.iter == top.end) {
+                boost::property_tree::ptree::value_type *owner = top.owner;
+
+                path_buf.resize(top.path_len);
+                stack.pop_back();
+
+                if (post_order && owner) {
+                    current = owner;
+                    return true;
+                }
+                continue;
+            }
+
+            current = &*top.iter++;
+            path_buf.resize(top.path_len);
+            append_segment(top, current->first, top.index++);
+
+            if (post_order && descend(current)) {
+                stack.push_back({current->second.begin(), current->second.end(), path_buf.size(), 0, current});
+                continue;
+            }
+            return true;
+        }
+
+        current = NULL;
+        return false;
+    }
+
+    const std::string &path() const { return path_buf; }
+    boost::property_tree::ptree::value_type &item() const { return *current; }
+
+    /* keys are joined with separator, array items are either [index] or
+     * the index as a key of its own */
+    void path_format(const std::string &separator, bool brackets)
+    {
+        this->separator = separator;
+        this->brackets = brackets;
+    }
+
+    /* move to the same place in a copy of the tree, its nodes mapped by nodes.
+     * The node a frame goes through is the one before the place of the frame
+     * below it, as is the current node in the top frame */
+    void remap(std::unordered_map<const boost::property_tree::ptree*, boost::property_tree::ptree*> &nodes)
+    {
+        boost::property_tree::ptree *node = tree, *copy = tree = nodes[tree];
+
+        for (std::size_t i = 0; i < stack.size(); i++) {
+            frame &top = stack[i];
+
+            if (i) {
+                node = &top.owner->second;
+                top.owner = &*std::prev(stack[i - 1].iter);
+                copy = &top.owner->second;
+            }
+
+            top.iter = std::next(copy->begin(), std::distance(node->begin(), top.iter));
+            top.end = copy->end();
+        }
+
+        if (current)
+            current = &*std::prev(stack.back().iter);
+    }
+
+    /* the children of the tree walked were swapped into root */
+    void rebase(boost::property_tree::ptree &root)
+    {
+        tree = &root;
+    }
+
+private:
+    struct frame
+    {
+        boost::property_tree::ptree::iterator iter;
+        boost::property_tree::ptree::iterator end;
+        std::size_t path_len;
+        std::size_t index;
+        boost::property_tree::ptree::value_type *owner;
+        signed char quoted = -1;    // whether numbers as keys are quoted, -1 until known
+    };
+
+    bool descend(const boost::property_tree::ptree::value_type *item) const
+    {
+        return !item->second.empty() && stack.size() < max_depth;
+    }
+
+    /* without brackets the keys that would read back as something else are
+     * quoted: numbers when all the keys of the node are 0 to n - 1, and keys
+     * starting with a quote */
+    void append_segment(frame &top, const std::string &key, std::size_t index)
+    {
+        if (!brackets && !key.empty()) {
+            if (top.quoted < 0 && ptree_segment_index(key) != SIZE_MAX)
+                top.quoted = ptree_keys_are_indexes(top.owner ? top.owner->second : *tree);
+
+            if (key[0] == '\'' || (top.quoted > 0 && ptree_segment_index(key) != SIZE_MAX)) {
+                ptree_path_append_quoted(path_buf, key, separator);
+                return;
+            }
+        }
+
+        ptree_path_append(path_buf, key, index, separator, brackets);
+    }
+
+    boost::property_tree::ptree *tree;
+    std::vector<frame> stack;
+    std::string path_buf;
+    boost::property_tree::ptree::value_type *current;
+    std::size_t max_depth;
+    bool post_order;
+    std::string separator;
+    bool brackets;
+};
+
+
+static void
+ptree_walker_remap(ptree_walker *walker,
+                   std::unordered_map<const boost::property_tree::ptree*, boost::property_tree::ptree*> &nodes)
+{
+    walker->remap(nodes);
+}
+
+
+static void
+ptree_walker_rebase(ptree_walker *walker, boost::property_tree::ptree &root)
+{
+    walker->rebase(root);
+}
+
+
+/* decides which of the walked nodes are returned */
+struct ptree_walk_filter
+{
+    virtual ~ptree_walk_filter() {}
+    virtual bool operator()(const boost::property_tree::ptree::value_type &item) const = 0;
+};
+
+
+struct ptree_leaf_filter : public ptree_walk_filter
+{
+    bool operator()(const boost::property_tree::ptree::value_type &item) const override
+    {
+        return item.second.empty();
+    }
+};
+
+
+struct ptree_regex_filter : public ptree_walk_filter
+{
+    bool match_key;
+    bool match_value;
+    boost::xpressive::sregex key;
+    boost::xpressive::sregex value;
+
+    bool operator()(const boost::property_tree::ptree::value_type &item) const override
+    {
+        return (!match_key || boost::xpressive::regex_search(item.first, key)) &&
+               (!match_value || boost::xpressive::regex_search(item.second.data(), value));
+    }
+};
+
+struct ptree_substring_filter : public ptree_walk_filter
+{
+    bool match_key;
+    std::string needle;
+
+    bool operator()(const boost::property_tree::ptree::value_type &item) const override
+    {
+        const std::string &data = item.second.data();
+
+        return ptree_memmem(data.data(), data.size(), needle.data(), needle.size()) ||
+               (match_key && ptree_memmem(item.first.data(), item.first.size(), needle.data(), needle.size()));
+    }
+};
+
+
+/* --- classes --- */
+
+
+/* A new reference to a compiled query, given a string or Query object */
+static PyPropertyTree_Query*
+PyPropertyTree_Query_FromObject(PyObject *py_query)
+{
+    if (PyObject_IsInstance(py_query, (PyObject *) &PyPropertyTree_QueryType)) {
+        // Query.__new__() without __init__()
+        if (!((PyPropertyTree_Query *)py_query)->plan) {
+            PyErr_SetString(PyExc_ValueError, "Query has no expression");
+            return NULL;
+        }
+        Py_INCREF(py_query);
+        return (PyPropertyTree_Query *)py_query;
+    } else if (PyUnicode_Check(py_query)) {
+        return (PyPropertyTree_Query *)PyObject_CallFunctionObjArgs((PyObject *) &PyPropertyTree_QueryType, py_query, NULL);
+    }
+
+    PyErr_SetString(PyExc_TypeError, "query must be a string or Query object");
+    return NULL;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_value__doc__,
+"string value of this node\n");
+
+
+static PyObject*
+PyPropertyTree__get_value(PyPropertyTree *self, void *Py_UNUSED(closure))
+{
+    const std::string &value = self->obj->data();
+    return PyUnicode_DecodeUTF8(value.c_str(), value.size(), NULL);
+}
+
+
+static int
+PyPropertyTree__set_value(PyPropertyTree *self, PyObject *py_val, void *Py_UNUSED(closure))
+{
+    try {
+        if (PyUnicode_Check(py_val)) {
+            Py_ssize_t value_len;
+            const char *value = PyUnicode_AsUTF8AndSize(py_val, &value_len);
+            if (PyPropertyTree_Modified(self) < 0)
+                return -1;
+
+            PyPropertyTree_SaveValue(self, *self->obj);
+            self->obj->put_value<std::string>(std::string(value, value_len));
+        } else {
+            PyErr_SetObject(PyExc_ValueError, py_val);
+            return -1;
+        }
+    } catch (boost::property_tree::ptree_bad_data const &exc) {
+        PyErr_SetString((PyObject *) PyPropertyTreeBadDataError_Type, exc.what());
+        return -1;
+    }
+    return 0;
+}
+
+
+static PyGetSetDef PyPropertyTree__getsets[] = {
+    {
+        (char*) "value",                                         /* attribute name */
+        (getter) PyPropertyTree__get_value,                      /* C function to get the attribute */
+        (setter) PyPropertyTree__set_value,                      /* C function to set the attribute */
+        PyPropertyTree_value__doc__,                             /* optional doc string */
+        NULL                                                     /* optional additional data for getter and setter */
+    },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+
+PyDoc_STRVAR(PyPropertyTree_add__doc__,
+"add(path, value, move=False) -> Tree\n\n"
+"    Add a node at the given path with the given value.\n"
+"    If the node identified by the path does not exist, create it\n"
+"    and all its missing parents.\n"
+"    If the node already exists, add a sibling with the same key.\n"
+"    If move is true a Tree value is moved instead of copied, see append().\n");
+
+
+static PyObject*
+PyPropertyTree_add(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *path;
+    Py_ssize_t path_len;
+    PyObject *value;
+    int move = 0;
+    boost::property_tree::ptree tree, *retval;
+    const char *keywords[] = {"path", "value", "move", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#O|p:add", (char **) keywords, &path, &path_len, &value, &move)) {
+        return NULL;
+    }
+
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    std::string path_std(path, path_len);
+
+    if (py_value_to_ptree(self, value, move, tree) < 0)
+        return NULL;
+
+    PyPropertyTree_SavePath(self, path_std, true);
+    retval = &self->obj->add_child(path_std, boost::property_tree::ptree());
+    retval->swap(tree);
+
+    return (PyObject*)PyPropertyTree_New(retval, PTREE_FLAG_OBJECT_NOT_OWNED, self);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_aggregate__doc__,
+"aggregate(query, ops=(\"count\", \"sum\", \"min\", \"max\", \"mean\")) -> dict\n\n"
+"    Summarize the numeric values at the given query in one pass.\n"
+"    * The query selects values as in column(), missing and non-numeric\n"
+"      values are skipped.\n"
+"    * Returns a dict of the requested ops, min, max and mean are None if\n"
+"      there are no values.\n");
+
+
+static PyObject*
+PyPropertyTree_aggregate(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *py_query, *py_ops = NULL, *ops, *dict;
+    PyPropertyTree_Query *query;
+    std::vector<const boost::property_tree::ptree*> values;
+    std::size_t count = 0;
+    double sum = 0, min = 0, max = 0;
+    const char *keywords[] = {"query", "ops", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O|O:aggregate", (char **) keywords,
+                                     &py_query, &py_ops)) {
+        return NULL;
+    }
+
+    if (py_ops)
+        ops = PySequence_Fast(py_ops, "ops must be a sequence");
+    else
+        ops = Py_BuildValue((char *) "(sssss)", "count", "sum", "min", "max", "mean");
+
+    if (!ops)
+        return NULL;
+
+    if (!(query = PyPropertyTree_Query_FromObject(py_query))) {
+        Py_DECREF(ops);
+        return NULL;
+    }
+
+    query->plan->eval_field(*self->obj, values);
+    Py_DECREF(query);
+
+    for (const boost::property_tree::ptree *node : values) {
+        double value;
+
+        if (!node || !ptree_parse_number(node->data(), value) || value != value)
+            continue;
+
+        if (count == 0 || value < min)
+            min = value;
+        if (count == 0 || value > max)
+            max = value;
+        sum += value;
+        count++;
+    }
+
+    if (!(dict = PyDict_New())) {
+        Py_DECREF(ops);
+        return NULL;
+    }
+
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(ops); i++) {
+        PyObject *op = PySequence_Fast_GET_ITEM(ops, i);
+        const char *name = PyUnicode_Check(op) ? PyUnicode_AsUTF8(op) : NULL;
+        PyObject *result;
+
+        if (name && strcmp(name, "count") == 0) {
+            result = PyLong_FromSize_t(count);
+        } else if (name && strcmp(name, "sum") == 0) {
+            result = PyFloat_FromDouble(sum);
+        } else if (name && (strcmp(name, "min") == 0 || strcmp(name, "max") == 0 || strcmp(name, "mean") == 0)) {
+            if (count == 0) {
+                Py_INCREF(Py_None);
+                result = Py_None;
+            } else if (strcmp(name, "min") == 0) {
+                result = PyFloat_FromDouble(min);
+            } else if (strcmp(name, "max") == 0) {
+                result = PyFloat_FromDouble(max);
+            } else {
+                result = PyFloat_FromDouble(sum / count);
+            }
+        } else {
+            PyErr_Format(PyExc_ValueError, "unknown aggregate op %R", op);
+            result = NULL;
+        }
+
+        if (!result || PyDict_SetItem(dict, op, result) < 0) {
+            Py_XDECREF(result);
+            Py_DECREF(dict);
+            Py_DECREF(ops);
+            return NULL;
+        }
+        Py_DECREF(result);
+    }
+
+    Py_DECREF(ops);
+    return dict;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_append__doc__,
+"append(key, value, move=False) -> Tree\n\n"
+"    Add the value to the end of the child list with the given key.\n"
+"    * A Tree value is copied, if move is true its children and data are\n"
+"      moved instead without copying them and it is left empty where it is.\n"
+"      Views of its children see them in their new place, and their changes\n"
+"      are changes to this tree.\n");
+
+
+static PyObject*
+PyPropertyTree_append(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *key;
+    Py_ssize_t key_len;
+    PyObject *value;
+    int move = 0;
+    boost::property_tree::ptree tree;
+    boost::property_tree::ptree::iterator retval;
+    const char *keywords[] = {"key", "value", "move", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#O|p:append", (char **) keywords, &key, &key_len, &value, &move)) {
+        return NULL;
+    }
+
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    if (py_value_to_ptree(self, value, move, tree) < 0)
+        return NULL;
+
+    PyPropertyTree_SaveChildren(self, *self->obj);
+    retval = self->obj->push_back({std::string(key, key_len), boost::property_tree::ptree()});
+    retval->second.swap(tree);
+
+    return (PyObject*)PyPropertyTree_New(&retval->second, PTREE_FLAG_OBJECT_NOT_OWNED, self);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_build_index__doc__,
+"build_index(query) -> Index\n\n"
+"    Index the records selected by the query by the value of their field,\n"
+"    for lookups by value without scanning the tree.\n"
+"    * The query selects records and a field as in column(), e.g. *.externals.imdb\n"
+"    * The index is rebuilt when it is used after the tree has changed.\n");
+
+
+static PyObject*
+PyPropertyTree_build_index(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *py_query;
+    PyPropertyTree_Query *query;
+    PyPropertyTree_Index *index;
+    const char *keywords[] = {"query", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O:build_index", (char **) keywords, &py_query)) {
+        return NULL;
+    }
+
+    if (!(query = PyPropertyTree_Query_FromObject(py_query)))
+        return NULL;
+
+    index = PyObject_GC_New(PyPropertyTree_Index, &PyPropertyTree_IndexType);
+    Py_INCREF(self);
+    index->container = self;
+    index->query = query;
+    index->table = new ptree_value_index();
+    index->table->build(*self->obj, *query->plan);
+    index->generation = PyPropertyTree_Generation(self);
+
+    return (PyObject*)index;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_clear__doc__,
+"clear()\n\n"
+"    Clear this Tree completely of both data and children.\n");
+
+
+static PyObject*
+PyPropertyTree_clear(PyPropertyTree *self)
+{
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    PyPropertyTree_SaveContent(self, *self->obj);
+    self->obj->clear();
+    Py_RETURN_NONE;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_column__doc__,
+"column(query, dtype=\"f8\", default=None) -> array.array\n\n"
+"    Parse the values at the given query into a typed array, e.g. for numpy.frombuffer().\n"
+"    * The query selects the records up to its last wildcard or filter,\n"
+"      the keys after it are the field of each record, e.g. shows.*.rating.average\n"
+"    * dtype is one of f8, f4, i8, i4, u8 or u4.\n"
+"    * Missing or invalid values are default, NaN for floating point columns\n"
+"      if it is not given, otherwise a ValueError is raised.\n");
+
+
+template <typename T>
+static bool
+ptree_parse_typed(const std::string &data, T &value)
+{
+    if constexpr (std::is_floating_point<T>::value) {
+        double number;
+
+        if (!ptree_parse_number(data, number))
+            return false;
+        value = (T) number;
+        return true;
+    } else {
+        const char *first = data.c_str();
+        const char *last = first + data.size();
+
+        if (first != last && *first == '+')
+            ++first;
+
+        std::from_chars_result result = std::from_chars(first, last, value);
+
+        return first != last && result.ec == std::errc() && result.ptr == last;
+    }
+}
+
+
+/* Parse the values into a raw buffer, returns the index of the first value
+ * that is missing or invalid when there is no default, or -1 */
+template <typename T>
+static Py_ssize_t
+ptree_parse_column(const std::vector<const boost::property_tree::ptree*> &values, const T *default_value, std::string &raw)
+{
+    raw.resize(values.size() * sizeof(T));
+
+    T *column = (T *) &raw[0];
+
+    for (std::size_t i = 0; i < values.size(); i++) {
+        if (!values[i] || !ptree_parse_typed(values[i]->data(), column[i])) {
+            if (!default_value)
+                return i;
+            column[i] = *default_value;
+        }
+    }
+
+    return -1;
+}
+
+
+template <typename T>
+static Py_ssize_t
+PyPropertyTree_column_typed(const std::vector<const boost::property_tree::ptree*> &values, PyObject *py_default,
+                            std::string &raw)
+{
+    T default_value;
+    bool has_default = true;
+
+    if (py_default == Py_None) {
+        has_default = std::is_floating_point<T>::value;
+        default_value = std::numeric_limits<T>::quiet_NaN();
+    } else if (std::is_floating_point<T>::value) {
+        default_value = (T) PyFloat_AsDouble(py_default);
+    } else if (std::is_signed<T>::value) {
+        long long value = PyLong_AsLongLong(py_default);
+
+        default_value = (T) value;
+        if (!PyErr_Occurred() && (long long) default_value != value)
+            PyErr_SetString(PyExc_OverflowError, "default is out of range for dtype");
+    } else {
+        unsigned long long value = PyLong_AsUnsignedLongLong(py_default);
+
+        default_value = (T) value;
+        if (!PyErr_Occurred() && (unsigned long long) default_value != value)
+            PyErr_SetString(PyExc_OverflowError, "default is out of range for dtype");
+    }
+
+    if (PyErr_Occurred())
+        return -2;
+
+    return ptree_parse_column<T>(values, has_default ? &default_value : NULL, raw);
+}
+
+
+static PyObject*
+PyPropertyTree_column(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *py_query, *py_default = Py_None, *array_module, *retval;
+    PyPropertyTree_Query *query;
+    const char *dtype = "f8", *typecode;
+    Py_ssize_t failed;
+    std::vector<const boost::property_tree::ptree*> values;
+    std::string raw;
+    const char *keywords[] = {"query", "dtype", "default", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O|sO:column", (char **) keywords,
+                                     &py_query, &dtype, &py_default)) {
+        return NULL;
+    }
+
+    if (!(query = PyPropertyTree_Query_FromObject(py_query)))
+        return NULL;
+
+    query->plan->eval_field(*self->obj, values);
+    Py_DECREF(query);
+
+    if (strcmp(dtype, "f8") == 0) {
+        typecode = "d";
+        failed = PyPropertyTree_column_typed<double>(values, py_default, raw);
+    } else if (strcmp(dtype, "f4") == 0) {
+        typecode = "f";
+        failed = PyPropertyTree_column_typed<float>(values, py_default, raw);
+    } else if (strcmp(dtype, "i8") == 0) {
+        typecode = "q";
+        failed = PyPropertyTree_column_typed<int64_t>(values, py_default, raw);
+    } else if (strcmp(dtype, "i4") == 0) {
+        typecode = "i";
+        failed = PyPropertyTree_column_typed<int32_t>(values, py_default, raw);
+    } else if (strcmp(dtype, "u8") == 0) {
+        typecode = "Q";
+        failed = PyPropertyTree_column_typed<uint64_t>(values, py_default, raw);
+    } else if (strcmp(dtype, "u4") == 0) {
+        typecode = "I";
+        failed = PyPropertyTree_column_typed<uint32_t>(values, py_default, raw);
+    } else {
+        PyErr_Format(PyExc_ValueError, "unsupported dtype \"%s\"", dtype);
+        return NULL;
+    }
+
+    if (failed == -2)
+        return NULL;
+
+    if (failed >= 0) {
+        if (values[failed])
+            PyErr_Format(PyExc_ValueError, "invalid value '%s' for dtype %s at record %zd",
+                         values[failed]->data().c_str(), dtype, failed);
+        else
+            PyErr_Format(PyExc_ValueError, "missing value at record %zd", failed);
+        return NULL;
+    }
+
+    if (!(array_module = PyImport_ImportModule("array")))
+        return NULL;
+
+    retval = PyObject_CallMethod(array_module, "array", "sy#", typecode, raw.data(), (Py_ssize_t) raw.size());
+    Py_DECREF(array_module);
+
+    return retval;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_count__doc__,
+"count(key) -> int\n\n"
+"    Count the number of direct children with the given key.\n");
+
+
+static PyObject*
+PyPropertyTree_count(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *key = NULL;
+    Py_ssize_t key_len;
+    const char *keywords[] = {"key", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#:count", (char **) keywords, &key, &key_len)) {
+        return NULL;
+    }
+
+    return PyLong_FromLong(self->obj->count(std::string(key, key_len)));
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_empty__doc__,
+"empty() -> bool\n\n"
+"    Check whether this tree contains any children.\n");
+
+
+static PyObject*
+PyPropertyTree_empty(PyPropertyTree *self)
+{
+    return PyBool_FromLong(self->obj->empty());
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_erase__doc__,
+"erase(key) -> int\n\n"
+"    Erase all the children with the given key and return the count.\n");
+
+
+static PyObject*
+PyPropertyTree_erase(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *key = NULL;
+    Py_ssize_t key_len;
+    const char *keywords[] = {"key", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#:erase", (char **) keywords, &key, &key_len)) {
+        return NULL;
+    }
+
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    std::string key_std(key, key_len);
+
+    if (PyPropertyTree_Undo(self)) {
+        std::pair<boost::property_tree::ptree::assoc_iterator, boost::property_tree::ptree::assoc_iterator>
+            range = self->obj->equal_range(key_std);
+
+        for (; range.first != range.second; ++range.first)
+            PyPropertyTree_SaveRemoved(self, *self->obj, *range.first);
+    }
+
+    return PyLong_FromLong(self->obj->erase(key_std));
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_erase_if__doc__,
+"erase_if(predicate) -> int\n\n"
+"    Erase all the children that match and return the count.\n"
+"    The predicate can be one built with property_tree.where(), which is\n"
+"    checked natively, or a function of the type: func(key, value) -> Bool\n"
+"    * The matches are unlinked in a single pass over the children.\n"
+"    * A function must not change the tree.\n");
+
+
+static PyObject*
+PyPropertyTree_erase_if(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *arg;
+    std::vector<char> matches;
+    std::size_t count = 0, i = 0;
+    const char *keywords[] = {"predicate", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O:erase_if", (char **) keywords, &arg)) {
+        return NULL;
+    }
+
+    if (PyObject_IsInstance(arg, (PyObject *) &PyPropertyTree_PredicateType)) {
+        const query_filter &filter = **((PyPropertyTree_Predicate *)arg)->filter;
+
+        matches.reserve(self->obj->size());
+        for (const boost::property_tree::ptree::value_type &child : *self->obj)
+            matches.push_back(filter.eval(child.second));
+
+    } else if (PyCallable_Check(arg)) {
+        unsigned long generation = PyPropertyTree_Generation(self);
+
+        matches.reserve(self->obj->size());
+        for (boost::property_tree::ptree::value_type &child : *self->obj) {
+            PyPropertyTree *py_ptree = PyPropertyTree_New(&child.second, PTREE_FLAG_OBJECT_NOT_OWNED, self);
+            PyObject *retval = PyObject_CallFunction(arg, (char *) "s#N", child.first.c_str(), child.first.size(), py_ptree);
+            int match = retval ? PyObject_IsTrue(retval) : -1;
+
+            Py_XDECREF(retval);
+
+            if (match < 0)
+                return NULL;
+
+            if (PyPropertyTree_Generation(self) != generation) {
+                PyErr_SetString(PyExc_RuntimeError, "tree changed during erase_if");
+                return NULL;
+            }
+
+            matches.push_back(match);
+        }
+
+    } else {
+        PyErr_SetString(PyExc_TypeError, "argument not a predicate or callable object");
+        return NULL;
+    }
+
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    for (boost::property_tree::ptree::iterator iter = self->obj->begin(); iter != self->obj->end(); i++) {
+        if (matches[i]) {
+            PyPropertyTree_SaveRemoved(self, *self->obj, *iter);
+            iter = self->obj->erase(iter);
+            count++;
+        } else {
+            ++iter;
+        }
+    }
+
+    return PyLong_FromSize_t(count);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_erase_paths__doc__,
+"erase_paths(paths) -> int\n\n"
+"    Erase the nodes at the given dotted paths and return the count.\n"
+"    * As with erase() all the children with the last key of a path are\n"
+"      erased, paths that aren't in the tree are skipped.\n"
+"    * The children of each parent are unlinked in a single pass.\n");
+
+
+static PyObject*
+PyPropertyTree_erase_paths(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *paths, *item, *iter;
+    std::unordered_map<boost::property_tree::ptree*, std::size_t> index;
+    std::vector<std::pair<std::size_t, boost::property_tree::ptree*> > parents;
+    std::vector<std::unordered_set<std::string> > keys;
+    std::size_t count = 0;
+    const char *keywords[] = {"paths", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O:erase_paths", (char **) keywords, &paths)) {
+        return NULL;
+    }
+
+    if ((iter = PyObject_GetIter(paths)) == NULL)
+        return NULL;
+
+    PyPropertyTree_Detach(self);
+
+    while ((item = PyIter_Next(iter)) != NULL) {
+        Py_ssize_t path_len;
+        const char *path = PyUnicode_Check(item) ? PyUnicode_AsUTF8AndSize(item, &path_len) : NULL;
+
+        if (!path) {
+            if (!PyErr_Occurred())
+                PyErr_Format(PyExc_TypeError, "path must be a str, not %s", Py_TYPE(item)->tp_name);
+            Py_DECREF(item);
+            Py_DECREF(iter);
+            return NULL;
+        }
+
+        std::vector<std::string> field = ptree_split_path(std::string(path, path_len));
+        Py_DECREF(item);
+
+        if (field.empty())
+            continue;
+
+        std::string key = field.back();
+        field.pop_back();
+
+        boost::property_tree::ptree *parent = (boost::property_tree::ptree *) query_resolve_field(*self->obj, field);
+
+        if (!parent)
+            continue;
+
+        std::pair<std::unordered_map<boost::property_tree::ptree*, std::size_t>::iterator, bool> found =
+            index.insert(std::make_pair(parent, parents.size()));
+
+        if (found.second) {
+            parents.push_back(std::make_pair(field.size(), parent));
+            keys.push_back(std::unordered_set<std::string>());
+        }
+        keys[found.first->second].insert(key);
+    }
+
+    Py_DECREF(iter);
+
+    if (PyErr_Occurred())
+        return NULL;
+
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    // the deepest parents go first so that no parent is erased before its turn
+    std::vector<std::size_t> order(parents.size());
+
+    for (std::size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t lhs, std::size_t rhs) {
+        return parents[lhs].first > parents[rhs].first;
+    });
+
+    for (std::size_t i : order) {
+        boost::property_tree::ptree &parent = *parents[i].second;
+
+        for (boost::property_tree::ptree::iterator child = parent.begin(); child != parent.end();) {
+            if (keys[i].count(child->first)) {
+                PyPropertyTree_SaveRemoved(self, parent, *child);
+                child = parent.erase(child);
+                count++;
+            } else {
+                ++child;
+            }
+        }
+    }
+
+    return PyLong_FromSize_t(count);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_extend__doc__,
+"extend(iterator, move=False)\n\n"
+"    Extend the tree by appending all the items from iterator.\n"
+"    If move is true Tree values are moved instead of copied, see append().\n");
+
+
+static PyObject*
+PyPropertyTree_extend(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *obj, *item, *iter;
+    int move = 0;
+    const char *keywords[] = {"iterator", "move", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O|p:extend", (char **) keywords, &obj, &move)) {
+        return NULL;
+    }
+
+    if ((iter = PyObject_GetIter(obj)) == NULL) {
+        return NULL;
+    }
+
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    while ((item = PyIter_Next(iter)) != NULL) {
+        const char *key;
+        Py_ssize_t key_len;
+        PyObject *value;
+        boost::property_tree::ptree tree;
+
+        if (!PyArg_ParseTuple(item, (char *) "s#O", &key, &key_len, &value) ||
+            py_value_to_ptree(self, value, move, tree) < 0) {
+            Py_DECREF(item);
+            Py_DECREF(iter);
+            return NULL;
+        }
+
+        PyPropertyTree_SaveChildren(self, *self->obj);
+        self->obj->push_back({std::string(key, key_len), boost::property_tree::ptree()})->second.swap(tree);
+
+        Py_DECREF(item);
+    }
+
+    Py_DECREF(iter);
+    Py_RETURN_NONE;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_find__doc__,
+"find(key) -> Tree\n\n"
+"    Find a child with the given key or None.\n"
+"    * There is no guarantee about which child is returned if multiple have\n"
+"      the same key.\n");
+
+
+static PyObject*
+PyPropertyTree_find(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *key;
+    Py_ssize_t key_len;
+    const char *keywords[] = {"key", NULL};
+
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#:find", (char **) keywords, &key, &key_len)) {
+        return NULL;
+    }
+
+    boost::property_tree::ptree::assoc_iterator retval = self->obj->find(std::string(key, key_len));
+
+    if (retval == self->obj->not_found())
+        Py_RETURN_NONE;
+
+    return (PyObject*)PyPropertyTree_New(&retval->second, PTREE_FLAG_OBJECT_NOT_OWNED, self);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_flatten__doc__,
+"flatten(sep=\".\", arrays=\"index\") -> dict\n\n"
+"    Return a dict mapping the path of every leaf to its value.\n"
+"    * Keys are joined with sep.\n"
+"    * arrays is \"index\" to key array items by their index, as in a.0.b,\n"
+"      or \"brackets\" to write them as a[0].b\n"
+"    * With \"index\" the keys of a node that are all the numbers 0 to n - 1\n"
+"      are quoted, as in a.'0'.b, so that they don't read back as an array,\n"
+"      as are keys starting with a quote, whose quotes are doubled.\n"
+"    * Nodes with both children and a value are kept as well.\n"
+"    * If several paths are the same the last value is kept.\n");
+
+
+static int
+py_arrays_format(const char *arrays, bool &brackets)
+{
+    if (strcmp(arrays, "index") == 0) {
+        brackets = false;
+    } else if (strcmp(arrays, "brackets") == 0) {
+        brackets = true;
+    } else {
+        PyErr_Format(PyExc_ValueError, "arrays must be \"index\" or \"brackets\", not \"%s\"", arrays);
+        return -1;
+    }
+    return 0;
+}
+
+
+static PyObject*
+PyPropertyTree_flatten(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *sep = ".";
+    Py_ssize_t sep_len = 1;
+    const char *arrays = "index";
+    bool brackets;
+    PyObject *dict;
+    const char *keywords[] = {"sep", "arrays", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "|s#s:flatten", (char **) keywords,
+                                     &sep, &sep_len, &arrays)) {
+        return NULL;
+    }
+
+    if (py_arrays_format(arrays, brackets) < 0)
+        return NULL;
+
+    if (!(dict = PyDict_New()))
+        return NULL;
+
+    ptree_walker walker(*self->obj);
+    walker.path_format(std::string(sep, sep_len), brackets);
+
+    while (walker.next()) {
+        const boost::property_tree::ptree &node = walker.item().second;
+
+        if (!node.empty() && node.data().empty())
+            continue;
+
+        const std::string &path = walker.path();
+        PyObject *key = PyUnicode_FromStringAndSize(path.c_str(), path.size());
+        PyObject *value = PyUnicode_FromStringAndSize(node.data().c_str(), node.data().size());
+
+        if (!key || !value || PyDict_SetItem(dict, key, value) < 0) {
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            Py_DECREF(dict);
+            return NULL;
+        }
+
+        Py_DECREF(key);
+        Py_DECREF(value);
+    }
+
+    return dict;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_get__doc__,
+"get(path, default=None) -> Tree\n\n"
+"    Get the child node at the given path, else default.\n"
+"    If default is not provided a BadPathError is raised.\n");
+
+
+static PyObject*
+PyPropertyTree_get(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    boost::property_tree::ptree *retval;
+    const char *path;
+    Py_ssize_t path_len;
+    PyObject *py_default = NULL;
+    const char *keywords[] = {"path", "default", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#|O:get", (char **) keywords, &path, &path_len, &py_default)) {
+        return NULL;
+    }
+
+    try {
+        retval = &self->obj->get_child(std::string(path, path_len));
+    } catch (boost::property_tree::ptree_bad_path const &exc) {
+        if (py_default == NULL) {
+            PyErr_SetString((PyObject *) PyPropertyTreeBadPathError_Type, exc.what());
+            return NULL;
+        } else {
+            Py_INCREF(py_default);
+            return py_default;
+        }
+    }
+
+    return (PyObject*)PyPropertyTree_New(retval, PTREE_FLAG_OBJECT_NOT_OWNED, self);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_grep__doc__,
+"grep(needle, keys=False, recursive=True) -> iterator\n\n"
+"    Return an iterator to the paths of the nodes whose value contains the given string.\n"
+"    * If keys is true the keys are searched as well.\n"
+"    * If recursive is false only the direct children are searched.\n");
+
+
+static PyObject*
+PyPropertyTree_grep(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *needle;
+    Py_ssize_t needle_len;
+    int keys = 0, recursive = 1;
+    PyPropertyTree_WalkIter *iter;
+    ptree_substring_filter *filter;
+    const char *keywords[] = {"needle", "keys", "recursive", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#|pp:grep", (char **) keywords,
+                                     &needle, &needle_len, &keys, &recursive)) {
+        return NULL;
+    }
+
+    filter = new ptree_substring_filter();
+    filter->match_key = keys;
+    filter->needle = std::string(needle, needle_len);
+
+    iter = PyObject_GC_New(PyPropertyTree_WalkIter, &PyPropertyTree_WalkIterType);
+    Py_INCREF(self);
+    iter->container = self;
+    iter->walker = new ptree_walker(*self->obj, recursive ? 0 : 1);
+    iter->filter = filter;
+    iter->paths_only = true;
+    PyPropertyTree_Track(self, (PyObject*)iter);
+
+    return (PyObject*)iter;
+}
+
+
+void
+ptree_groups::build(boost::property_tree::ptree &tree)
+{
+    keys.clear();
+    members.clear();
+    index.clear();
+
+    for (boost::property_tree::ptree::value_type &child : tree) {
+        const boost::property_tree::ptree *value = query_resolve_field(child.second, field);
+
+        if (!value)
+            continue;
+
+        std::pair<std::unordered_map<std::string, std::size_t>::iterator, bool> inserted =
+            index.emplace(value->data(), keys.size());
+
+        if (inserted.second) {
+            keys.push_back(value->data());
+            members.emplace_back();
+        }
+
+        members[inserted.first->second].push_back(&child);
+    }
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_group_by__doc__,
+"group_by(path) -> GroupBy\n\n"
+"    Group the children by the value at the given path of each child.\n"
+"    * Returns a mapping of each distinct value to the list of children with\n"
+"      that value, in the order they were first seen, without copying them.\n"
+"    * Children without the path are left out.\n"
+"    * The groups are rebuilt when they are used after the tree has changed.\n");
+
+
+static PyObject*
+PyPropertyTree_group_by(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *path;
+    Py_ssize_t path_len;
+    PyPropertyTree_GroupBy *group_by;
+    const char *keywords[] = {"path", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#:group_by", (char **) keywords, &path, &path_len)) {
+        return NULL;
+    }
+
+    ptree_groups *groups = new ptree_groups();
+    groups->field = ptree_split_path(std::string(path, path_len));
+    groups->build(*self->obj);
+
+    group_by = PyObject_GC_New(PyPropertyTree_GroupBy, &PyPropertyTree_GroupByType);
+    Py_INCREF(self);
+    group_by->container = self;
+    group_by->groups = groups;
+    group_by->generation = PyPropertyTree_Generation(self);
+
+    return (PyObject*)group_by;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_index__doc__,
+"index(key, start=0, end=-1)\n\n"
+"    Return zero-based index in the tree of the first item\n"
+"    whose value is equal to key\n");
+
+
+static PyObject*
+PyPropertyTree_index(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    int start = 0;
+    int end = self->obj->size();
+    int index = 0;
+    const char *key;
+    Py_ssize_t key_len;
+    const char *keywords[] = {"key", "start", "end", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#|ii:index", (char **) keywords,
+                                     &key, &key_len, &start, &end)) {
+        return NULL;
+    }
+
+    std::string key_std(key, key_len);
+    boost::property_tree::ptree::iterator iter(self->obj->begin());
+
+    while (index < start) {
+        if (iter == self->obj->end())
+            goto error;
+        ++index;
+        ++iter;
+    }
+
+    while (index < end) {
+        if (iter == self->obj->end())
+            goto error;
+        else if (iter->first == key_std)
+            return PyLong_FromLong(index);
+        ++index;
+        ++iter;
+    }
+
+error:
+    PyErr_Format(PyExc_ValueError, "%s is not in tree", key);
+    return NULL;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_insert__doc__,
+"insert(index, key, value, move=False) -> Tree\n\n"
+"    Insert a copy of the given tree with its key\n"
+"    just before the given position in this node.\n"
+"    If move is true a Tree value is moved instead of copied, see append().\n");
+
+
+static PyObject*
+PyPropertyTree_insert(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    int index;
+    const char *key;
+    Py_ssize_t key_len;
+    PyObject *value;
+    int move = 0;
+    boost::property_tree::ptree tree;
+    boost::property_tree::ptree::iterator retval, iter;
+    const char *keywords[] = {"index", "key", "value", "move", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "is#O|p:insert", (char **) keywords,
+                                     &index, &key, &key_len, &value, &move)) {
+        return NULL;
+    }
+
+    if (index < 0)
+        index += self->obj->size() + 1;
+
+    if (index < 0 || (std::size_t)index > self->obj->size()) {
+        PyErr_SetString(PyExc_IndexError, "insert index out of range");
+        return NULL;
+    }
+
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    if (py_value_to_ptree(self, value, move, tree) < 0)
+        return NULL;
+
+    iter = self->obj->begin();
+
+    for (int i = 0; i < index; i++)
+        ++iter;
+
+    PyPropertyTree_SaveChildren(self, *self->obj);
+    retval = self->obj->insert(iter, {std::string(key, key_len), boost::property_tree::ptree()});
+    retval->second.swap(tree);
+
+    return (PyObject*)PyPropertyTree_New(&retval->second, PTREE_FLAG_OBJECT_NOT_OWNED, self);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_items__doc__,
+"items() -> iterator\n\n"
+"    Return an iterator to the ((key, value) pairs) of children.\n");
+
+
+static PyObject*
+PyPropertyTree_items(PyPropertyTree *self)
+{
+    PyPropertyTree_Iter *iter;
+
+    iter = PyObject_GC_New(PyPropertyTree_Iter, &PyPropertyTree_IterType);
+    Py_INCREF(self);
+    iter->container = self;
+    iter->iterator = new boost::property_tree::ptree::iterator(self->obj->begin());
+    iter->callable = NULL;
+    iter->predicate = NULL;
+    PyPropertyTree_Track(self, (PyObject*)iter);
+
+    return (PyObject*)iter;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_keys__doc__,
+"keys()\n\n"
+"    Get a list of all the child keys.\n");
+
+
+static PyObject*
+PyPropertyTree_keys(PyPropertyTree *self)
+{
+    PyObject *list = PyList_New(self->obj->size());
+    boost::property_tree::ptree::iterator iter = self->obj->begin();
+
+    for (Py_ssize_t i = 0; iter != self->obj->end(); iter++, i++) {
+        const std::string &key = iter->first;
+
+        PyList_SET_ITEM(list, i, PyUnicode_DecodeUTF8(key.c_str(), key.size(), NULL));
+    }
+
+    return list;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_match__doc__,
+"match(key=None, value=None, recursive=True) -> iterator\n\n"
+"    Return an iterator to the (path, value) pairs of the nodes whose key\n"
+"    and/or value contain a match for the given regular expressions.\n"
+"    * Paths are dotted keys, array items appear as [index].\n"
+"    * If recursive is false only the direct children are searched.\n");
+
+
+static PyObject*
+PyPropertyTree_match(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *key = NULL, *value = NULL;
+    Py_ssize_t key_len, value_len;
+    int recursive = 1;
+    PyPropertyTree_WalkIter *iter;
+    ptree_regex_filter *filter;
+    const char *keywords[] = {"key", "value", "recursive", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "|z#z#p:match", (char **) keywords,
+                                     &key, &key_len, &value, &value_len, &recursive)) {
+        return NULL;
+    }
+
+    if (key == NULL && value == NULL) {
+        PyErr_SetString(PyExc_TypeError, "match() needs a key and/or value pattern");
+        return NULL;
+    }
+
+    filter = new ptree_regex_filter();
+    filter->match_key = (key != NULL);
+    filter->match_value = (value != NULL);
+
+    try {
+        if (key)
+            filter->key = boost::xpressive::sregex::compile(std::string(key, key_len));
+        if (value)
+            filter->value = boost::xpressive::sregex::compile(std::string(value, value_len));
+    } catch (boost::xpressive::regex_error const &exc) {
+        delete filter;
+        PyErr_SetString(PyExc_ValueError, exc.what());
+        return NULL;
+    }
+
+    iter = PyObject_GC_New(PyPropertyTree_WalkIter, &PyPropertyTree_WalkIterType);
+    Py_INCREF(self);
+    iter->container = self;
+    iter->walker = new ptree_walker(*self->obj, recursive ? 0 : 1);
+    iter->filter = filter;
+    iter->paths_only = false;
+    PyPropertyTree_Track(self, (PyObject*)iter);
+
+    return (PyObject*)iter;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_merge__doc__,
+"merge(other, strategy=\"replace\", arrays=\"replace\", copy=False) -> Tree\n\n"
+"    Deep merge other into this tree and return it, or a merged copy if copy is true.\n"
+"    * Objects are merged key by key, keys that are only in other are appended.\n"
+"    * arrays is \"replace\" to replace an array with the one in other or\n"
+"      \"concat\" to add its items at the end.\n"
+"    * strategy decides the other conflicts, values or a value and an object:\n"
+"      \"replace\" takes the one in other, \"keep\" keeps the one in this tree\n"
+"      and \"append\" adds the one in other as a child with the same key.\n"
+"    * e.g. config = defaults.merge(site, copy=True).merge(host)\n");
+
+
+static PyObject*
+PyPropertyTree_merge(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyPropertyTree *other, *retval = self;
+    const char *strategy_str = "replace", *arrays = "replace";
+    ptree_merge_strategy strategy;
+    int copy = 0;
+    const char *keywords[] = {"other", "strategy", "arrays", "copy", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O!|ssp:merge", (char **) keywords,
+                                     &PyPropertyTree_Type, &other, &strategy_str, &arrays, &copy)) {
+        return NULL;
+    }
+
+    if (strcmp(strategy_str, "replace") == 0) {
+        strategy = PTREE_MERGE_REPLACE;
+    } else if (strcmp(strategy_str, "append") == 0) {
+        strategy = PTREE_MERGE_APPEND;
+    } else if (strcmp(strategy_str, "keep") == 0) {
+        strategy = PTREE_MERGE_KEEP;
+    } else {
+        PyErr_Format(PyExc_ValueError, "strategy must be \"replace\", \"append\" or \"keep\", not \"%s\"", strategy_str);
+        return NULL;
+    }
+
+    if (strcmp(arrays, "replace") != 0 && strcmp(arrays, "concat") != 0) {
+        PyErr_Format(PyExc_ValueError, "arrays must be \"replace\" or \"concat\", not \"%s\"", arrays);
+        return NULL;
+    }
+
+    if (copy) {
+        retval = PyPropertyTree_New(new boost::property_tree::ptree(*self->obj), PTREE_FLAG_NONE);
+    } else {
+        if (PyPropertyTree_Modified(self) < 0)
+            return NULL;
+        Py_INCREF(self);
+    }
+
+    // copy other first when it shares its root with the tree being changed
+    boost::property_tree::ptree other_copy;
+    const boost::property_tree::ptree *src = other->obj;
+
+    if (!copy && (other->root ? other->root : other) == (self->root ? self->root : self)) {
+        other_copy = *other->obj;
+        src = &other_copy;
+    }
+
+    // the tree itself has no key to append a conflict next to, so it is replaced
+    if (!ptree_merge(*retval->obj, *src, strategy, arrays[0] == 'c', PyPropertyTree_Undo(retval))) {
+        PyPropertyTree_SaveContent(retval, *retval->obj);
+        *retval->obj = *src;
+    }
+
+    return (PyObject*)retval;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_nlargest__doc__,
+"nlargest(k, by, numeric=True) -> list\n\n"
+"    Return the k children with the largest value at the path by, largest first.\n"
+"    * The children are kept in a bounded heap, nothing is copied or fully sorted.\n"
+"    * If numeric is true the values are compared as numbers and children\n"
+"      whose value is not a number are left out, otherwise as strings.\n"
+"    * Children without the path are left out, equal values keep their order.\n");
+
+
+/* a child in the top k, index breaks ties so that equal values keep their order */
+struct ptree_ranked {
+    double number;
+    const std::string *text;
+    std::size_t index;
+    boost::property_tree::ptree *node;
+};
+
+
+/* Select the k children with the best value at field, best first */
+static void
+ptree_top_k(boost::property_tree::ptree &node, const std::vector<std::string> &field, std::size_t k,
+            bool largest, bool numeric, std::vector<ptree_ranked> &heap)
+{
+    // the heap is ordered by better so its front is the worst of the top k
+    auto better = [largest, numeric](const ptree_ranked &lhs, const ptree_ranked &rhs) {
+        int cmp = numeric ? (lhs.number < rhs.number ? -1 : lhs.number > rhs.number)
+                          : lhs.text->compare(*rhs.text);
+
+        if (cmp == 0)
+            return lhs.index < rhs.index;
+        return largest ? cmp > 0 : cmp < 0;
+    };
+    std::size_t index = 0;
+
+    heap.reserve(std::min(k, node.size()));
+
+    for (boost::property_tree::ptree::value_type &child : node) {
+        const boost::property_tree::ptree *value = query_resolve_field(child.second, field);
+        ptree_ranked ranked = {0.0, NULL, index++, &child.second};
+
+        if (!value || (numeric && (!ptree_parse_number(value->data(), ranked.number) || std::isnan(ranked.number))))
+            continue;
+        ranked.text = &value->data();
+
+        if (heap.size() < k) {
+            heap.push_back(ranked);
+            std::push_heap(heap.begin(), heap.end(), better);
+        } else if (k > 0 && better(ranked, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), better);
+            heap.back() = ranked;
+            std::push_heap(heap.begin(), heap.end(), better);
+        }
+    }
+
+    std::sort_heap(heap.begin(), heap.end(), better);
+}
+
+
+static PyObject*
+PyPropertyTree_top_k(PyPropertyTree *self, PyObject *args, PyObject *kwargs, bool largest, const char *format)
+{
+    Py_ssize_t k;
+    const char *by;
+    Py_ssize_t by_len;
+    int numeric = 1;
+    PyObject *list;
+    std::vector<ptree_ranked> heap;
+    const char *keywords[] = {"k", "by", "numeric", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) format, (char **) keywords, &k, &by, &by_len, &numeric)) {
+        return NULL;
+    }
+
+    std::vector<std::string> field = ptree_split_path(std::string(by, by_len));
+
+    ptree_top_k(*self->obj, field, k > 0 ? (std::size_t) k : 0, largest, numeric, heap);
+
+    if (!(list = PyList_New(heap.size())))
+        return NULL;
+
+    for (std::size_t i = 0; i < heap.size(); i++) {
+        PyObject *value = (PyObject*)PyPropertyTree_New(heap[i].node, PTREE_FLAG_OBJECT_NOT_OWNED, self);
+
+        if (!value) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, value);
+    }
+
+    return list;
+}
+
+
+static PyObject*
+PyPropertyTree_nlargest(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    return PyPropertyTree_top_k(self, args, kwargs, true, "ns#|p:nlargest");
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_nsmallest__doc__,
+"nsmallest(k, by, numeric=True) -> list\n\n"
+"    Return the k children with the smallest value at the path by, smallest first.\n"
+"    * Works as nlargest().\n");
+
+
+static PyObject*
+PyPropertyTree_nsmallest(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    return PyPropertyTree_top_k(self, args, kwargs, false, "ns#|p:nsmallest");
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_pop__doc__,
+"pop(key, default=None) -> Tree\n\n"
+"    Remove the child with the given key and return its value, else default.\n"
+"    If default is not given and key is not in the tree, a KeyError is raised.\n"
+"    * There is no guarantee about which child is returned if multiple have\n"
+"      the same key.\n");
+
+
+static PyObject*
+PyPropertyTree_pop(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *key = NULL;
+    Py_ssize_t key_len;
+    PyObject *py_default = NULL;
+    PyPropertyTree *py_ptree;
+    const char *keywords[] = {"index", "default", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#|O:pop", (char **) keywords, &key, &key_len, &py_default)) {
+        return NULL;
+    }
+
+    std::string key_std(key, key_len);
+
+    if (self->obj->find(key_std) == self->obj->not_found()) {
+        if (py_default == NULL) {
+            PyErr_SetString(PyExc_KeyError, key);
+            return NULL;
+        } else {
+            Py_INCREF(py_default);
+            return py_default;
+        }
+    }
+
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    boost::property_tree::ptree::assoc_iterator iter(self->obj->find(key_std));
+
+    // move the child out instead of copying it
+    PyPropertyTree_SaveRemoved(self, *self->obj, *iter);
+    py_ptree = PyPropertyTree_New(new boost::property_tree::ptree(), PTREE_FLAG_NONE);
+    py_ptree->obj->swap(iter->second);
+
+    self->obj->erase(self->obj->to_iterator(iter));
+
+    return (PyObject*) py_ptree;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_popitem__doc__,
+"popitem(index=-1) -> (key, value)\n\n"
+"    Remove and return the child at the given index.\n"
+"    If no index is specified remove and return the last child.\n");
+
+
+static PyObject*
+PyPropertyTree_popitem(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    int index = self->obj->size() - 1;
+    PyPropertyTree *py_ptree;
+    const char *keywords[] = {"index", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "|i:popitem", (char **) keywords, &index)) {
+        return NULL;
+    }
+
+    if (index < 0)
+        index += self->obj->size();
+
+    if (index < 0 || (std::size_t)index >= self->obj->size()) {
+        PyErr_SetString(PyExc_IndexError, "popitem index out of range");
+        return NULL;
+    }
+
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    boost::property_tree::ptree::iterator iter(self->obj->begin());
+
+    for (int i = 0; i < index; i++)
+        ++iter;
+
+    std::string key = iter->first;
+
+    PyPropertyTree_SaveRemoved(self, *self->obj, *iter);
+    py_ptree = PyPropertyTree_New(new boost::property_tree::ptree(), PTREE_FLAG_NONE);
+    py_ptree->obj->swap(iter->second);
+
+    self->obj->erase(iter);
+
+    return Py_BuildValue((char *) "s#N", key.c_str(), key.size(), py_ptree);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_put__doc__,
+"put(path, value, move=False) -> Tree\n\n"
+"    Set the node at the given path to the given value.\n"
+"    If the node identified by the path does not exist, create it and\n"
+"    all its missing parents.\n"
+"    If the node at the path already exists, replace its value.\n"
+"    If move is true a Tree value is moved instead of copied, see append().\n");
+
+
+static PyObject*
+PyPropertyTree_put(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *path;
+    Py_ssize_t path_len;
+    PyObject *value;
+    int move = 0;
+    boost::property_tree::ptree tree, *retval;
+    const char *keywords[] = {"path", "value", "move", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#O|p:put", (char **) keywords, &path, &path_len, &value, &move)) {
+        return NULL;
+    }
+
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    std::string path_std(path, path_len);
+
+    if (py_value_to_ptree(self, value, move, tree) < 0)
+        return NULL;
+
+    PyPropertyTree_SavePath(self, path_std, false);
+    retval = &self->obj->put_child(path_std, boost::property_tree::ptree());
+    retval->swap(tree);
+
+    return (PyObject*)PyPropertyTree_New(retval, PTREE_FLAG_OBJECT_NOT_OWNED, self);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_setdefault__doc__,
+"setdefault(path, default=None, move=False) -> Tree\n\n"
+"    If path is in the tree, return its value.\n"
+"    If the node identified by the path does not exist, create it and\n"
+"    all its missing parents.\n"
+"    If move is true a Tree default is moved instead of copied when it is\n"
+"    used, see append().\n");
+
+
+PyDoc_STRVAR(PyPropertyTree_remove__doc__,
+"remove(key)\n\n"
+"    Remove the first child whose value is equal to key.\n");
+
+
+static PyObject*
+PyPropertyTree_remove(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *key ;
+    Py_ssize_t key_len;
+    const char *keywords[] = {"key", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#:remove", (char **) keywords, &key, &key_len)) {
+        return NULL;
+    }
+
+    std::string key_std(key, key_len);
+    std::size_t index = 0;
+
+    for (boost::property_tree::ptree::iterator iter = self->obj->begin(); iter != self->obj->end(); iter++, index++) {
+        if (iter->first != key_std)
+            continue;
+
+        if (PyPropertyTree_Modified(self) < 0)
+            return NULL;
+
+        // a shared copy is in a tree of its own by now
+        iter = std::next(self->obj->begin(), index);
+        PyPropertyTree_SaveRemoved(self, *self->obj, *iter);
+        self->obj->erase(iter);
+        Py_RETURN_NONE;
+    }
+
+    PyErr_SetNone(PyExc_ValueError);
+    return NULL;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_reverse__doc__,
+"reverse()\n\n"
+"    Reverse the children in place.\n");
+
+
+static PyObject*
+PyPropertyTree_reverse(PyPropertyTree *self)
+{
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    PyPropertyTree_SaveChildren(self, *self->obj);
+    self->obj->reverse();
+    Py_RETURN_NONE;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_search__doc__,
+"search(arg, threads=1) -> iterator\n\n"
+"    Return an iterator to the children that match this key.\n"
+"    Argument can be a string, a predicate built with property_tree.where()\n"
+"    or function of the type: func(key, value) -> Bool\n"
+"    * With threads other than 1 a predicate is evaluated over all the\n"
+"      children up front, in parallel with the GIL released, 0 uses one\n"
+"      thread per core. Changes from other threads to the tree, or to the\n"
+"      tree a copy shares, wait for the scan to end.\n");
+
+
+static PyObject*
+PyPropertyTree_search_parallel(PyPropertyTree *self, const query_filter &filter, unsigned threads)
+{
+    std::vector<boost::property_tree::ptree::value_type*> children;
+    std::vector<char> matches;
+    std::vector<boost::property_tree::ptree*> found;
+    std::vector<std::string> keys;
+
+    PyPropertyTree_TrackScan(self, found);
+    PyPropertyTree_Pin(self);
+    children.reserve(self->obj->size());
+
+    for (boost::property_tree::ptree::iterator iter = self->obj->begin(); iter != self->obj->end(); ++iter)
+        children.push_back(&*iter);
+
+    matches.resize(children.size());
+
+    Py_BEGIN_ALLOW_THREADS
+    ptree_parallel_for(children.size(), threads, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++)
+            matches[i] = filter.eval(children[i]->second);
+    });
+
+    // the children may move once unpinned, their keys don't change
+    for (std::size_t i = 0; i < children.size(); i++) {
+        if (matches[i]) {
+            found.push_back(&children[i]->second);
+            keys.push_back(children[i]->first);
+        }
+    }
+    PyPropertyTree_Unpin(self);
+    Py_END_ALLOW_THREADS
+    PyPropertyTree_UntrackScan(self, found);
+
+    PyObject *list = PyList_New(0);
+
+    if (list == NULL)
+        return NULL;
+
+    for (std::size_t i = 0; i < found.size(); i++) {
+        const std::string &key = keys[i];
+        PyPropertyTree *py_ptree = PyPropertyTree_New(found[i], PTREE_FLAG_OBJECT_NOT_OWNED, self);
+        PyObject *item = py_ptree ? Py_BuildValue((char *) "s#N", key.c_str(), key.size(), py_ptree) : NULL;
+
+        if (item == NULL || PyList_Append(list, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return NULL;
+        }
+
+        Py_DECREF(item);
+    }
+
+    PyObject *iter = PyObject_GetIter(list);
+    Py_DECREF(list);
+
+    return iter;
+}
+
+
+static PyObject*
+PyPropertyTree_search(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *key;
+    Py_ssize_t key_len;
+    PyObject *arg;
+    int threads = 1;
+    const char *keywords[] = {"arg", "threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O|i:search", (char **) keywords, &arg, &threads)) {
+        return NULL;
+    }
+
+    if (threads != 1) {
+        if (!PyObject_IsInstance(arg, (PyObject *) &PyPropertyTree_PredicateType)) {
+            PyErr_SetString(PyExc_TypeError, "threads is only supported with a where() predicate");
+            return NULL;
+        }
+
+        return PyPropertyTree_search_parallel(self, **((PyPropertyTree_Predicate *)arg)->filter,
+                                              ptree_thread_count(threads));
+    }
+
+    if (PyUnicode_Check(arg)) {
+        PyPropertyTree_AssocIter *iter;
+
+        key = PyUnicode_AsUTF8AndSize(arg, &key_len);
+
+        iter = PyObject_GC_New(PyPropertyTree_AssocIter, &PyPropertyTree_AssocIterType);
+
+        Py_INCREF(self);
+
+        iter->container = self;
+        iter->iterator = self->obj->equal_range(std::string(key, key_len));
+        PyPropertyTree_Track(self, (PyObject*)iter);
+
+        return (PyObject*)iter;
+
+    } else if (PyObject_IsInstance(arg, (PyObject *) &PyPropertyTree_PredicateType)) {
+        PyPropertyTree_Iter *iter;
+        iter = PyObject_GC_New(PyPropertyTree_Iter, &PyPropertyTree_IterType);
+
+        Py_INCREF(self);
+        Py_INCREF(arg);
+
+        iter->container = self;
+        iter->iterator = new boost::property_tree::ptree::iterator(self->obj->begin());
+        iter->callable = NULL;
+        iter->predicate = arg;
+        PyPropertyTree_Track(self, (PyObject*)iter);
+
+        return (PyObject*)iter;
+
+    } else if (PyCallable_Check(arg)) {
+        PyPropertyTree_Iter *iter;
+        iter = PyObject_GC_New(PyPropertyTree_Iter, &PyPropertyTree_IterType);
+
+        Py_INCREF(self);
+        Py_XINCREF(arg);
+
+        iter->container = self;
+        iter->iterator = new boost::property_tree::ptree::iterator(self->obj->begin());
+        iter->callable = arg;
+        iter->predicate = NULL;
+        PyPropertyTree_Track(self, (PyObject*)iter);
+    
+        return (PyObject*)iter;
+    }
+
+    PyErr_SetString(PyExc_TypeError, "argument not a string or callable object");
+    return NULL;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_select__doc__,
+"select(query, threads=1) -> list\n\n"
+"    Return a list of the nodes matching the query.\n"
+"    The query can be a string or a compiled Query object.\n"
+"    e.g. tree.select(\"shows[?language=='English' && rating.average >= 8].name\")\n"
+"    * With threads other than 1 the filters are evaluated in parallel with\n"
+"      the GIL released, 0 uses one thread per core. Changes from other\n"
+"      threads to the tree, or to the tree a copy shares, wait for the scan\n"
+"      to end.\n");
+
+
+static PyObject*
+PyPropertyTree_select(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *py_query;
+    PyPropertyTree_Query *query;
+    int threads = 1;
+    std::vector<boost::property_tree::ptree*> result;
+    const char *keywords[] = {"query", "threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O|i:select", (char **) keywords, &py_query, &threads)) {
+        return NULL;
+    }
+
+    if (!(query = PyPropertyTree_Query_FromObject(py_query)))
+        return NULL;
+
+    if (threads == 1) {
+        query->plan->eval(*self->obj, result);
+    } else {
+        unsigned count = ptree_thread_count(threads);
+
+        PyPropertyTree_TrackScan(self, result);
+        PyPropertyTree_Pin(self);
+        Py_BEGIN_ALLOW_THREADS
+        query->plan->eval(*self->obj, result, count);
+        PyPropertyTree_Unpin(self);
+        Py_END_ALLOW_THREADS
+        PyPropertyTree_UntrackScan(self, result);
+    }
+
+    Py_DECREF(query);
+
+    PyObject *list = PyList_New(result.size());
+
+    if (list == NULL)
+        return NULL;
+
+    for (std::size_t i = 0; i < result.size(); i++) {
+        PyPropertyTree *py_ptree = PyPropertyTree_New(result[i], PTREE_FLAG_OBJECT_NOT_OWNED, self);
+
+        if (py_ptree == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+
+        PyList_SET_ITEM(list, i, (PyObject*)py_ptree);
+    }
+
+    return list;
+}
+
+
+static PyObject*
+PyPropertyTree_setdefault(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *path;
+    Py_ssize_t path_len;
+    PyObject *value = Py_None;
+    int move = 0;
+    boost::property_tree::ptree tree, *retval;
+    const char *keywords[] = {"path", "default", "move", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#|Op:setdefault", (char **) keywords,
+                                     &path, &path_len, &value, &move)) {
+        return NULL;
+    }
+
+    std::string path_std(path, path_len);
+
+    try {
+        retval = &self->obj->get_child(path_std);
+    } catch (boost::property_tree::ptree_bad_path const &exc) {
+        if (PyPropertyTree_Modified(self) < 0)
+            return NULL;
+
+        if (py_value_to_ptree(self, value, move, tree) < 0)
+            return NULL;
+
+        PyPropertyTree_SavePath(self, path_std, false);
+        retval = &self->obj->put_child(path_std, boost::property_tree::ptree());
+        retval->swap(tree);
+    }
+
+    return (PyObject*)PyPropertyTree_New(retval, PTREE_FLAG_OBJECT_NOT_OWNED, self);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_snapshot__doc__,
+"snapshot() -> Tree\n\n"
+"    Return a read-only copy of this tree as it is now.\n"
+"    The snapshot shares the nodes of this tree until this tree is next\n"
+"    changed, then it takes a copy, shared by all the snapshots and copies\n"
+"    taken since the last change, and its views and iterators are moved\n"
+"    along, so a reader of the snapshot never sees a later change.\n"
+"    Other threads can read it, with select() and search() in parallel too,\n"
+"    while this tree is changed.\n"
+"    Changing the snapshot, or a view of it, raises TypeError, copy.copy()\n"
+"    or Tree() of it gives a tree that can be changed.\n");
+
+
+static PyObject*
+PyPropertyTree_snapshot(PyPropertyTree *self)
+{
+    PyPropertyTree *snapshot = PyPropertyTree_Copy(self);
+
+    snapshot->flags = (PyPropertyTree_Flags)(snapshot->flags | PTREE_FLAG_READ_ONLY);
+
+    return (PyObject*)snapshot;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_sort__doc__,
+"sort(cmp=None, *, key=None, by=None, by_value=False, numeric=False, reverse=False, stable=True)\n\n"
+"    Sort the children in place, in key order by default.\n"
+"    * by sorts on the value at a path of each child and by_value on the value\n"
+"      of each child, the values are read and compared natively, as numbers\n"
+"      if numeric is true. Children without the path, or whose value isn't a\n"
+"      number for a numeric sort, go last.\n"
+"    * key is called as key(key, value) once for each child and the children\n"
+"      are sorted on the results, natively for ints, floats and strings.\n"
+"      It must not change the tree.\n"
+"    * cmp is called as cmp((key, value), (key, value)) for each comparison\n"
+"      and returns whether the first child goes before the second.\n"
+"    * reverse sorts in descending order keeping the order of equal children.\n"
+"      A native sort can be made faster with stable=False if that order\n"
+"      doesn't matter.\n");
+
+
+/* Order the indices of keys as list.sort() would */
+template <typename T, typename Less>
+static void
+ptree_sort_order(const std::vector<T> &keys, bool reverse, Less less, std::vector<std::size_t> &order, bool stable = true)
+{
+    order.resize(keys.size());
+
+    for (std::size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+
+    auto forward = [&](std::size_t lhs, std::size_t rhs) { return less(keys[lhs], keys[rhs]); };
+    auto backward = [&](std::size_t lhs, std::size_t rhs) { return less(keys[rhs], keys[lhs]); };
+
+    if (stable && reverse)
+        std::stable_sort(order.begin(), order.end(), backward);
+    else if (stable)
+        std::stable_sort(order.begin(), order.end(), forward);
+    else if (reverse)
+        std::sort(order.begin(), order.end(), backward);
+    else
+        std::sort(order.begin(), order.end(), forward);
+}
+
+
+/* Order the children by the value at field, the children without it or,
+ * for a numeric sort, whose value isn't a number go last in their order */
+static void
+ptree_sort_by(const boost::property_tree::ptree &node, const std::vector<std::string> &field,
+              bool numeric, bool reverse, bool stable, std::vector<std::size_t> &order)
+{
+    std::vector<double> numbers;
+    std::vector<const std::string*> strings;
+    std::vector<std::size_t> index, missing, sorted;
+    std::size_t i = 0;
+
+    for (const boost::property_tree::ptree::value_type &child : node) {
+        const boost::property_tree::ptree *value = query_resolve_field(child.second, field);
+        double number;
+
+        if (!value || (numeric && (!ptree_parse_number(value->data(), number) || std::isnan(number)))) {
+            missing.push_back(i++);
+            continue;
+        }
+
+        if (numeric)
+            numbers.push_back(number);
+        else
+            strings.push_back(&value->data());
+        index.push_back(i++);
+    }
+
+    if (numeric) {
+        ptree_sort_order(numbers, reverse, std::less<double>(), sorted, stable);
+    } else {
+        ptree_sort_order(strings, reverse, [](const std::string *lhs, const std::string *rhs) {
+            return *lhs < *rhs;
+        }, sorted, stable);
+    }
+
+    order.clear();
+    order.reserve(node.size());
+
+    for (std::size_t position : sorted)
+        order.push_back(index[position]);
+    order.insert(order.end(), missing.begin(), missing.end());
+}
+
+
+/* Order the python sort keys, natively when they are all ints, all floats
+ * or all strings, returns -1 if a python comparison failed */
+static int
+py_sort_order(PyObject *keys, bool reverse, std::vector<std::size_t> &order)
+{
+    Py_ssize_t size = PyList_GET_SIZE(keys);
+    bool ints = true, floats = true, strings = true;
+
+    for (Py_ssize_t i = 0; i < size; i++) {
+        PyObject *key = PyList_GET_ITEM(keys, i);
+
+        ints = ints && PyLong_CheckExact(key);
+        floats = floats && PyFloat_CheckExact(key) && !std::isnan(PyFloat_AS_DOUBLE(key));
+        strings = strings && PyUnicode_CheckExact(key);
+    }
+
+    if (ints) {
+        std::vector<long long> values(size);
+        int overflow = 0;
+
+        for (Py_ssize_t i = 0; i < size && !overflow; i++)
+            values[i] = PyLong_AsLongLongAndOverflow(PyList_GET_ITEM(keys, i), &overflow);
+
+        if (!overflow) {
+            ptree_sort_order(values, reverse, std::less<long long>(), order);
+            return 0;
+        }
+    } else if (floats) {
+        std::vector<double> values(size);
+
+        for (Py_ssize_t i = 0; i < size; i++)
+            values[i] = PyFloat_AS_DOUBLE(PyList_GET_ITEM(keys, i));
+
+        ptree_sort_order(values, reverse, std::less<double>(), order);
+        return 0;
+    } else if (strings) {
+        // utf-8 byte order is code point order
+        std::vector<std::string_view> values(size);
+
+        for (Py_ssize_t i = 0; i < size; i++) {
+            Py_ssize_t len;
+            const char *str = PyUnicode_AsUTF8AndSize(PyList_GET_ITEM(keys, i), &len);
+
+            if (!str)
+                return -1;
+            values[i] = std::string_view(str, len);
+        }
+
+        ptree_sort_order(values, reverse, std::less<std::string_view>(), order);
+        return 0;
+    }
+
+    std::vector<PyObject*> values(&PyList_GET_ITEM(keys, 0), &PyList_GET_ITEM(keys, 0) + size);
+
+    try {
+        ptree_sort_order(values, reverse, [](PyObject *lhs, PyObject *rhs) {
+            int result = PyObject_RichCompareBool(lhs, rhs, Py_LT);
+
+            if (result < 0)
+                throw boost::property_tree::ptree_error("sort key comparison failed");
+            return result == 1;
+        }, order);
+    } catch (boost::property_tree::ptree_error const &exc) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Relink the children in the given order of their positions. The nodes
+ * stay where they are so views of the children still see the same child,
+ * the final position of each node is found in an open addressing table
+ * keyed by its address */
+static void
+ptree_sort_relink(boost::property_tree::ptree &node, const std::vector<std::size_t> &order)
+{
+    std::vector<std::size_t> position(order.size());
+    bool sorted = true;
+
+    for (std::size_t i = 0; i < order.size(); i++) {
+        position[order[i]] = i;
+        sorted = sorted && order[i] == i;
+    }
+
+    if (sorted)
+        return;
+
+    std::size_t mask = 1;
+
+    while (mask < order.size() * 2)
+        mask <<= 1;
+    mask -= 1;
+
+    std::vector<std::pair<const void*, std::size_t> > table(mask + 1, std::make_pair((const void*) NULL, (std::size_t) 0));
+    auto slot = [&](const void *address) {
+        std::size_t i = (std::size_t) (((std::uintptr_t) address >> 4) * 0x9E3779B97F4A7C15ull) & mask;
+
+        while (table[i].first && table[i].first != address)
+            i = (i + 1) & mask;
+        return i;
+    };
+    std::size_t i = 0;
+
+    for (const boost::property_tree::ptree::value_type &child : node)
+        table[slot(&child)] = std::make_pair((const void*) &child, position[i++]);
+
+    node.sort([&](const boost::property_tree::ptree::value_type &lhs, const boost::property_tree::ptree::value_type &rhs) {
+        return table[slot(&lhs)].second < table[slot(&rhs)].second;
+    });
+}
+
+
+static PyObject*
+PyPropertyTree_sort(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *cmp = NULL, *key = NULL, *keys;
+    const char *by = NULL;
+    Py_ssize_t by_len = 0;
+    int by_value = 0, numeric = 0, reverse = 0, stable = 1;
+    std::vector<std::size_t> order;
+    const char *keywords[] = {"cmp", "key", "by", "by_value", "numeric", "reverse", "stable", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "|O$Oz#pppp:sort", (char **) keywords,
+                                     &cmp, &key, &by, &by_len, &by_value, &numeric, &reverse, &stable)) {
+        return NULL;
+    }
+
+    if (cmp == Py_None)
+        cmp = NULL;
+    if (key == Py_None)
+        key = NULL;
+
+    if ((cmp && !PyCallable_Check(cmp)) || (key && !PyCallable_Check(key))) {
+        PyErr_SetString(PyExc_TypeError, "object not callable");
+        return NULL;
+    }
+
+    if ((cmp != NULL) + (key != NULL) + (by != NULL) + (by_value != 0) > 1) {
+        PyErr_SetString(PyExc_TypeError, "sort() takes only one of cmp, key, by or by_value");
+        return NULL;
+    }
+
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    PyPropertyTree_SaveChildren(self, *self->obj);
+
+    if (by || by_value) {
+        std::vector<std::string> field;
+
+        if (by)
+            field = ptree_split_path(std::string(by, by_len));
+
+        ptree_sort_by(*self->obj, field, numeric, reverse, stable, order);
+        ptree_sort_relink(*self->obj, order);
+
+        Py_RETURN_NONE;
+    }
+
+    if (!cmp && !key) {
+        if (reverse) {
+            self->obj->sort([](const boost::property_tree::ptree::value_type &lhs,
+                               const boost::property_tree::ptree::value_type &rhs) { return rhs.first < lhs.first; });
+        } else {
+            self->obj->sort();
+        }
+        Py_RETURN_NONE;
+    }
+
+    if (cmp) {
+        try {
+            ptree_sort_helper helper(cmp);
+
+            if (reverse) {
+                self->obj->sort([&](boost::property_tree::ptree::value_type &lhs,
+                                    boost::property_tree::ptree::value_type &rhs) { return helper(rhs, lhs); });
+            } else {
+                self->obj->sort(helper);
+            }
+
+            Py_RETURN_NONE;
+
+        } catch (boost::property_tree::ptree_error const &exc) {
+            /* if python threw an error use that */
+            if (!PyErr_Occurred())
+                PyErr_SetString((PyObject *) PyExc_RuntimeError, exc.what());
+
+            return NULL;
+        }
+    }
+
+    // call key once per child, the children are left alone if anything fails
+    unsigned long generation = PyPropertyTree_Generation(self);
+
+    if (!(keys = PyList_New(0)))
+        return NULL;
+
+    for (boost::property_tree::ptree::value_type &child : *self->obj) {
+        PyObject *value = (PyObject*)PyPropertyTree_New(&child.second, PTREE_FLAG_OBJECT_NOT_OWNED, self);
+        PyObject *result = value ? PyObject_CallFunction(key, (char *) "s#O", child.first.data(),
+                                                         (Py_ssize_t) child.first.size(), value) : NULL;
+
+        Py_XDECREF(value);
+
+        if (!result || PyList_Append(keys, result) < 0) {
+            Py_XDECREF(result);
+            Py_DECREF(keys);
+            return NULL;
+        }
+        Py_DECREF(result);
+
+        if (PyPropertyTree_Generation(self) != generation) {
+            Py_DECREF(keys);
+            PyErr_SetString(PyExc_RuntimeError, "tree changed during sort");
+            return NULL;
+        }
+    }
+
+    if (py_sort_order(keys, reverse, order) < 0) {
+        Py_DECREF(keys);
+        return NULL;
+    }
+    Py_DECREF(keys);
+
+    // the comparisons of python keys can run code too
+    if (PyPropertyTree_Generation(self) != generation) {
+        PyErr_SetString(PyExc_RuntimeError, "tree changed during sort");
+        return NULL;
+    }
+
+    ptree_sort_relink(*self->obj, order);
+
+    Py_RETURN_NONE;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_sorted__doc__,
+"sorted() -> iterator\n\n"
+"    Get an iterator to the sorted children of this node, in key order.\n");
+
+
+static PyObject*
+PyPropertyTree_sorted(PyPropertyTree *self)
+{
+    PyPropertyTree_AssocIter *iter;
+
+    iter = PyObject_GC_New(PyPropertyTree_AssocIter, &PyPropertyTree_AssocIterType);
+    Py_INCREF(self);
+    iter->container = self;
+    iter->iterator = {self->obj->ordered_begin(), self->obj->not_found()};
+    PyPropertyTree_Track(self, (PyObject*)iter);
+    
+    return (PyObject*)iter;
+}
+
+
+/* the child at the given position of an array node, padded with empty items
+ * up to it if it is past the end. NULL with the reason in error if the index
+ * doesn't fit in limit or the child there has a key */
+static boost::property_tree::ptree*
+ptree_array_item(boost::property_tree::ptree &node, const std::string &segment, std::size_t limit,
+                 const char *&error)
+{
+    std::size_t index;
+    std::from_chars_result result = std::from_chars(segment.data(), segment.data() + segment.size(), index);
+
+    if (result.ec != std::errc() || result.ptr != segment.data() + segment.size() || index >= limit) {
+        error = "array index out of range";
+        return NULL;
+    }
+
+    while (node.size() <= index)
+        node.push_back(boost::property_tree::ptree::value_type("", boost::property_tree::ptree()));
+
+    // items usually arrive in order, so check the last one first
+    boost::property_tree::ptree::value_type &item = index + 1 == node.size() ? node.back() : *std::next(node.begin(), index);
+
+    if (!item.first.empty()) {
+        error = "array index collides with a child with a key";
+        return NULL;
+    }
+
+    return &item.second;
+}
+
+
+static boost::property_tree::ptree*
+ptree_named_child(boost::property_tree::ptree &node, const std::string &key)
+{
+    boost::property_tree::ptree::assoc_iterator found = node.find(key);
+
+    if (found != node.not_found())
+        return &found->second;
+
+    return &node.push_back(boost::property_tree::ptree::value_type(key, boost::property_tree::ptree()))->second;
+}
+
+
+/* The segments below a node with arrays="index", by the path up to them */
+struct ptree_unflatten_node
+{
+    std::vector<std::size_t> indexes;
+    bool keyed = false;
+    signed char array = -1;
+
+    /* the segments are array indexes if they are the numbers 0 to n - 1 */
+    bool is_array()
+    {
+        if (array < 0) {
+            std::sort(indexes.begin(), indexes.end());
+            indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+            array = !keyed && !indexes.empty() && indexes.back() + 1 == indexes.size();
+        }
+        return array;
+    }
+};
+
+typedef std::unordered_map<std::string_view, ptree_unflatten_node> ptree_unflatten_nodes;
+
+
+/* Record the segments of a path with arrays="index", numbers that don't fit
+ * in limit are keys. The path must outlive nodes */
+static void
+ptree_unflatten_scan(ptree_unflatten_nodes &nodes, std::string_view path, const std::string &sep,
+                     std::size_t limit)
+{
+    std::size_t begin = 0;
+
+    if (path.empty())
+        return;
+
+    while (true) {
+        std::size_t end = path.find(sep, begin);
+        ptree_unflatten_node &parent = nodes[path.substr(0, begin)];
+        std::size_t index = ptree_segment_index(path.substr(begin, end == std::string::npos ? std::string::npos : end - begin));
+
+        if (index < limit)
+            parent.indexes.push_back(index);
+        else
+            parent.keyed = true;
+
+        if (end == std::string::npos)
+            return;
+        begin = end + sep.size();
+    }
+}
+
+
+/* A key in quotes written by flatten(), with its quotes doubled */
+static std::string
+ptree_unquote_segment(const std::string &segment)
+{
+    std::string retval;
+
+    if (segment.size() < 2 || segment.front() != '\'' || segment.back() != '\'')
+        return segment;
+
+    for (std::size_t i = 1; i + 1 < segment.size(); i++) {
+        retval += segment[i];
+        if (segment[i] == '\'' && segment[i + 1] == '\'')
+            i++;
+    }
+
+    return retval;
+}
+
+
+/* Find or create the node at a path produced by flatten(), NULL with the
+ * reason in error if the path is malformed. With arrays="index" nodes, as
+ * scanned by ptree_unflatten_scan(), tells the segments that are indexes.
+ * Array indexes are below limit, the number of paths, as every item of a
+ * flattened array has a path of its own */
+static boost::property_tree::ptree*
+ptree_unflatten_path(boost::property_tree::ptree &root, const std::string &path,
+                     const std::string &sep, bool brackets, std::size_t limit,
+                     ptree_unflatten_nodes &nodes, const char *&error)
+{
+    boost::property_tree::ptree *node = &root;
+    std::size_t begin = 0;
+
+    if (path.empty())
+        return node;
+
+    while (true) {
+        std::size_t end = path.find(sep, begin);
+        std::string segment = path.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+
+        if (!brackets) {
+            ptree_unflatten_nodes::iterator parent = nodes.find(std::string_view(path).substr(0, begin));
+
+            if (parent != nodes.end() && parent->second.is_array())
+                node = ptree_array_item(*node, segment, limit, error);
+            else
+                node = ptree_named_child(*node, ptree_unquote_segment(segment));
+        } else {
+            std::size_t bracket = segment.find('[');
+
+            if (bracket != 0)
+                node = ptree_named_child(*node, segment.substr(0, bracket));
+
+            while (bracket != std::string::npos) {
+                std::size_t close = segment.find(']', bracket);
+
+                if (close == std::string::npos || close == bracket + 1 ||
+                    segment.find_first_not_of("0123456789", bracket + 1) != close)
+                    return NULL;
+
+                node = ptree_array_item(*node, segment.substr(bracket + 1, close - bracket - 1), limit, error);
+
+                if (!node || (close + 1 != segment.size() && segment[close + 1] != '['))
+                    return NULL;
+                bracket = (close + 1 == segment.size()) ? std::string::npos : close + 1;
+            }
+        }
+
+        if (end == std::string::npos || !node)
+            return node;
+        begin = end + sep.size();
+    }
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_splice__doc__,
+"splice(dst_index, src_tree, src_range=None)\n\n"
+"    Move children of src_tree to just before the given index in this node.\n"
+"    * src_range is the index of one child or a slice of them, all the children\n"
+"      if it is None.\n"
+"    * The children are relinked without copying their subtrees, views of\n"
+"      them and their descendants see them in their new place, and their\n"
+"      changes are changes to this tree.\n"
+"    * src_tree can be this node, the children are then reordered in place.\n");
+
+
+static PyObject*
+PyPropertyTree_splice(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    int index;
+    PyPropertyTree *source;
+    PyObject *range = Py_None;
+    Py_ssize_t start = 0, stop, step = 1, size;
+    const char *keywords[] = {"dst_index", "src_tree", "src_range", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "iO!|O:splice", (char **) keywords,
+                                     &index, &PyPropertyTree_Type, &source, &range)) {
+        return NULL;
+    }
+
+    size = stop = source->obj->size();
+
+    if (PySlice_Check(range)) {
+        if (PySlice_Unpack(range, &start, &stop, &step) < 0)
+            return NULL;
+
+        if (step != 1) {
+            PyErr_SetString(PyExc_ValueError, "splice range step must be 1");
+            return NULL;
+        }
+
+        PySlice_AdjustIndices(size, &start, &stop, step);
+    } else if (PyIndex_Check(range)) {
+        if ((start = PyNumber_AsSsize_t(range, PyExc_IndexError)) == -1 && PyErr_Occurred())
+            return NULL;
+
+        if (start < 0)
+            start += size;
+
+        if (start < 0 || start >= size) {
+            PyErr_SetString(PyExc_IndexError, "splice range index out of range");
+            return NULL;
+        }
+
+        stop = start + 1;
+    } else if (range != Py_None) {
+        PyErr_Format(PyExc_TypeError, "splice range must be an int or a slice, not %s", Py_TYPE(range)->tp_name);
+        return NULL;
+    }
+
+    if (index < 0)
+        index += self->obj->size() + 1;
+
+    if (index < 0 || (std::size_t)index > self->obj->size()) {
+        PyErr_SetString(PyExc_IndexError, "splice index out of range");
+        return NULL;
+    }
+
+    if (start >= stop)
+        Py_RETURN_NONE;
+
+    PyPropertyTree_Detach(self);
+    PyPropertyTree_Detach(source);
+
+    // within a node the children are only reordered
+    if (source->obj == self->obj) {
+        std::vector<std::size_t> order;
+
+        for (Py_ssize_t i = 0; i < std::min<Py_ssize_t>(index, start); i++)
+            order.push_back(i);
+        for (Py_ssize_t i = stop; i < index; i++)
+            order.push_back(i);
+        for (Py_ssize_t i = start; i < stop; i++)
+            order.push_back(i);
+        for (Py_ssize_t i = index; i < size; i++) {
+            if (i < start || i >= stop)
+                order.push_back(i);
+        }
+
+        if (PyPropertyTree_Modified(self) < 0)
+            return NULL;
+
+        PyPropertyTree_SaveChildren(self, *self->obj);
+        ptree_sort_relink(*self->obj, order);
+
+        Py_RETURN_NONE;
+    }
+
+    boost::property_tree::ptree::iterator first = source->obj->begin(), last, dst = self->obj->begin();
+
+    std::advance(first, start);
+    last = first;
+    std::advance(last, stop - start);
+    std::advance(dst, index);
+
+    if ((source->root ? source->root : source) == (self->root ? self->root : self)) {
+        for (boost::property_tree::ptree::iterator iter = first; iter != last; ++iter) {
+            if (ptree_contains_node(iter->second, self->obj)) {
+                PyErr_SetString(PyExc_ValueError, "can't move a tree into itself");
+                return NULL;
+            }
+        }
+    }
+
+    if (PyPropertyTree_AddHeir(source, self) < 0)
+        return NULL;
+
+    if (PyPropertyTree_Modified(source) < 0 || PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    PyPropertyTree_SaveChildren(self, *self->obj);
+
+    std::vector<boost::property_tree::ptree*> parents;
+    std::unordered_map<const boost::property_tree::ptree*, boost::property_tree::ptree*> moved;
+
+    // the children moved are new nodes, their own children are the same
+    while (first != last) {
+        PyPropertyTree_SaveRemoved(source, *source->obj, *first);
+        boost::property_tree::ptree &child = self->obj->insert(dst, {first->first, boost::property_tree::ptree()})->second;
+        child.swap(first->second);
+        parents.push_back(moved[&first->second] = &child);
+        first = source->obj->erase(first);
+    }
+
+    PyPropertyTree_Reroot(source, self, parents, moved);
+
+    Py_RETURN_NONE;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_transaction__doc__,
+"transaction() -> Transaction\n\n"
+"    Return a context manager that undoes the changes made to this tree, its\n"
+"    views and the tree owning them if an exception escapes the with block.\n"
+"    * Only what changes is saved, the first time it does: the value or the\n"
+"      list of children of a node, and a copy of a child that is erased or\n"
+"      moved out.\n"
+"    * Nodes that are still there after a rollback keep their views.\n"
+"    * Trees that children were moved into or out of aren't rolled back.\n");
+
+
+static PyObject*
+PyPropertyTree_transaction(PyPropertyTree *self)
+{
+    PyPropertyTree_Transaction *transaction;
+    PyPropertyTree *root = self->root ? self->root : self;
+
+    transaction = PyObject_New(PyPropertyTree_Transaction, &PyPropertyTree_TransactionType);
+    Py_INCREF(root);
+    transaction->container = root;
+    transaction->active = false;
+
+    return (PyObject*)transaction;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_unflatten__doc__,
+"unflatten(mapping, sep=\".\", arrays=\"index\") -> Tree\n\n"
+"    Class method, build a tree from a mapping of paths to values as returned by flatten().\n"
+"    * With arrays=\"index\" the segments below a node are array items if\n"
+"      they are the numbers 0 to n - 1, otherwise they are keys, as is a\n"
+"      segment in quotes. With arrays=\"brackets\" the items are written as\n"
+"      a[0].b\n"
+"    * Arrays are padded with empty items up to the index, in any order.\n"
+"      An index that isn't below the number of paths, or is the position\n"
+"      of a child with a key, raises ValueError.\n"
+"    * Values can be trees, strings, numbers, booleans or None.\n");
+
+
+static PyObject*
+PyPropertyTree_unflatten(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    PyObject *mapping, *items;
+    const char *sep = ".";
+    Py_ssize_t sep_len = 1;
+    const char *arrays = "index";
+    bool brackets;
+    PyPropertyTree *result;
+    const char *keywords[] = {"mapping", "sep", "arrays", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O|s#s:unflatten", (char **) keywords,
+                                     &mapping, &sep, &sep_len, &arrays)) {
+        return NULL;
+    }
+
+    if (py_arrays_format(arrays, brackets) < 0)
+        return NULL;
+
+    if (sep_len == 0) {
+        PyErr_SetString(PyExc_ValueError, "sep must not be empty");
+        return NULL;
+    }
+
+    if (!(items = PyMapping_Items(mapping)))
+        return NULL;
+
+    if (!(result = (PyPropertyTree *) PyObject_CallFunctionObjArgs((PyObject *) type, NULL))) {
+        Py_DECREF(items);
+        return NULL;
+    }
+
+    std::string sep_std(sep, sep_len);
+    ptree_unflatten_nodes nodes;
+
+    // with arrays="index" all the paths are needed to tell an array from keys that are numbers
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(items) && !brackets; i++) {
+        const char *path;
+        Py_ssize_t path_len;
+
+        if (!(path = PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(PyList_GET_ITEM(items, i), 0), &path_len)))
+            goto error;
+
+        ptree_unflatten_scan(nodes, std::string_view(path, path_len), sep_std, PyList_GET_SIZE(items));
+    }
+
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(items); i++) {
+        PyObject *item = PyList_GET_ITEM(items, i);
+        PyObject *value = PyTuple_GET_ITEM(item, 1);
+        const char *path;
+        Py_ssize_t path_len;
+        std::string value_std;
+        const char *reason = NULL;
+
+        if (!(path = PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(item, 0), &path_len)))
+            goto error;
+
+        boost::property_tree::ptree *node = ptree_unflatten_path(*result->obj, std::string(path, path_len),
+                                                                 sep_std, brackets, PyList_GET_SIZE(items),
+                                                                 nodes, reason);
+
+        if (!node) {
+            if (reason)
+                PyErr_Format(PyExc_ValueError, "invalid path '%s': %s", path, reason);
+            else
+                PyErr_Format(PyExc_ValueError, "invalid path '%s'", path);
+            goto error;
+        }
+
+        if (PyObject_IsInstance(value, (PyObject *) &PyPropertyTree_Type)) {
+            *node = *((PyPropertyTree *) value)->obj;
+        } else if (py_value_to_string(value, value_std) == 0) {
+            node->data() = value_std;
+        } else {
+            PyErr_SetObject(PyExc_ValueError, value);
+            goto error;
+        }
+    }
+
+    Py_DECREF(items);
+    return (PyObject *) result;
+
+error:
+    Py_DECREF(items);
+    Py_DECREF(result);
+    return NULL;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_upsert_from__doc__,
+"upsert_from(source, key_path=\"id\", mode=\"insert\") -> (inserted, updated)\n\n"
+"    Add the children of source to this tree keyed by the value at key_path.\n"
+"    * mode decides what happens to a child whose key is already in the tree:\n"
+"      \"insert\" leaves it alone, \"replace\" replaces it with the new one and\n"
+"      \"merge\" deep merges the new one into it. New keys are appended.\n"
+"    * Objects are merged key by key, arrays and values are replaced.\n"
+"    * Every child of source must have the key path, a KeyError is raised\n"
+"      before anything is changed otherwise.\n");
+
+
+static PyObject*
+PyPropertyTree_upsert_from(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    enum { INSERT, REPLACE, MERGE } mode;
+    PyPropertyTree *source;
+    const char *key_path = "id", *mode_str = "insert";
+    std::size_t inserted = 0, updated = 0;
+    std::vector<std::string> keys;
+    const char *keywords[] = {"source", "key_path", "mode", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O!|ss:upsert_from", (char **) keywords,
+                                     &PyPropertyTree_Type, &source, &key_path, &mode_str)) {
+        return NULL;
+    }
+
+    if (strcmp(mode_str, "insert") == 0) {
+        mode = INSERT;
+    } else if (strcmp(mode_str, "replace") == 0) {
+        mode = REPLACE;
+    } else if (strcmp(mode_str, "merge") == 0) {
+        mode = MERGE;
+    } else {
+        PyErr_Format(PyExc_ValueError, "mode must be \"insert\", \"replace\" or \"merge\", not \"%s\"", mode_str);
+        return NULL;
+    }
+
+    std::vector<std::string> field = ptree_split_path(key_path);
+
+    for (const boost::property_tree::ptree::value_type &child : *source->obj) {
+        const boost::property_tree::ptree *key = query_resolve_field(child.second, field);
+
+        if (!key) {
+            PyErr_Format(PyExc_KeyError, "child %zd of source has no '%s'", keys.size(), key_path);
+            return NULL;
+        }
+        keys.push_back(key->data());
+    }
+
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    // copy the source first when it shares its root with this tree
+    boost::property_tree::ptree copy;
+    const boost::property_tree::ptree *records = source->obj;
+
+    if ((source->root ? source->root : source) == (self->root ? self->root : self)) {
+        copy = *source->obj;
+        records = &copy;
+    }
+
+    std::vector<std::string>::const_iterator key = keys.begin();
+
+    for (const boost::property_tree::ptree::value_type &child : *records) {
+        boost::property_tree::ptree::assoc_iterator found = self->obj->find(*key);
+
+        if (found == self->obj->not_found()) {
+            PyPropertyTree_SaveChildren(self, *self->obj);
+            self->obj->push_back(boost::property_tree::ptree::value_type(*key, child.second));
+            inserted++;
+        } else if (mode == REPLACE) {
+            PyPropertyTree_SaveContent(self, found->second);
+            found->second = child.second;
+            updated++;
+        } else if (mode == MERGE) {
+            ptree_merge(found->second, child.second, PTREE_MERGE_REPLACE, false, PyPropertyTree_Undo(self));
+            updated++;
+        }
+        ++key;
+    }
+
+    return Py_BuildValue((char *) "(nn)", (Py_ssize_t) inserted, (Py_ssize_t) updated);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_value_counts__doc__,
+"value_counts(query) -> dict\n\n"
+"    Count the distinct values at the given query, most common first.\n"
+"    * The query selects values as in column(), missing values are skipped.\n"
+"    * Values with the same count are in the order they were first seen.\n");
+
+
+static PyObject*
+PyPropertyTree_value_counts(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *py_query, *dict;
+    PyPropertyTree_Query *query;
+    std::vector<const boost::property_tree::ptree*> values;
+    std::unordered_map<std::string, std::size_t> index;
+    std::vector<std::pair<const std::string*, std::size_t> > counts;
+    const char *keywords[] = {"query", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O:value_counts", (char **) keywords, &py_query)) {
+        return NULL;
+    }
+
+    if (!(query = PyPropertyTree_Query_FromObject(py_query)))
+        return NULL;
+
+    query->plan->eval_field(*self->obj, values);
+    Py_DECREF(query);
+
+    for (const boost::property_tree::ptree *node : values) {
+        if (!node)
+            continue;
+
+        std::pair<std::unordered_map<std::string, std::size_t>::iterator, bool> inserted =
+            index.emplace(node->data(), counts.size());
+
+        if (inserted.second)
+            counts.emplace_back(&inserted.first->first, 1);
+        else
+            counts[inserted.first->second].second++;
+    }
+
+    /* The counts only point into index, the tree isn't read anymore */
+    Py_BEGIN_ALLOW_THREADS
+    std::stable_sort(counts.begin(), counts.end(),
+                     [](const std::pair<const std::string*, std::size_t> &lhs,
+                        const std::pair<const std::string*, std::size_t> &rhs) {
+                         return lhs.second > rhs.second;
+                     });
+    Py_END_ALLOW_THREADS
+
+    if (!(dict = PyDict_New()))
+        return NULL;
+
+    for (const std::pair<const std::string*, std::size_t> &count : counts) {
+        PyObject *key = PyUnicode_FromStringAndSize(count.first->c_str(), count.first->size());
+        PyObject *value = PyLong_FromSize_t(count.second);
+
+        if (!key || !value || PyDict_SetItem(dict, key, value) < 0) {
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            Py_DECREF(dict);
+            return NULL;
+        }
+
+        Py_DECREF(key);
+        Py_DECREF(value);
+    }
+
+    return dict;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_values__doc__,
+"values()\n\n"
+"    Get a list of the children values.\n");
+
+
+static PyObject*
+PyPropertyTree_values(PyPropertyTree *self)
+{
+    PyObject *list = PyList_New(self->obj->size());
+    boost::property_tree::ptree::iterator iter = self->obj->begin();
+
+    for (Py_ssize_t i = 0; iter != self->obj->end(); iter++, i++) {
+        PyList_SET_ITEM(list, i, (PyObject*)PyPropertyTree_New(&iter->second, PTREE_FLAG_OBJECT_NOT_OWNED, self));
+    }
+
+    return list;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_walk__doc__,
+"walk(order=\"pre\", max_depth=None, leaves_only=False) -> iterator\n\n"
+"    Return an iterator to the (path, value) pairs of all the descendants, depth first.\n"
+"    * Paths are dotted keys, array items appear as [index].\n"
+"    * order is \"pre\" to return a node before its children or \"post\" to return it after them.\n"
+"    * max_depth limits how deep the walk goes, 1 only returns the direct children.\n"
+"    * If leaves_only is true only the nodes without children are returned.\n");
+
+
+static PyObject*
+PyPropertyTree_walk(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    const char *order = "pre";
+    PyObject *py_max_depth = Py_None;
+    int leaves_only = 0;
+    long max_depth = 0;
+    bool post_order;
+    PyPropertyTree_WalkIter *iter;
+    const char *keywords[] = {"order", "max_depth", "leaves_only", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "|sOp:walk", (char **) keywords,
+                                     &order, &py_max_depth, &leaves_only)) {
+        return NULL;
+    }
+
+    if (strcmp(order, "pre") == 0) {
+        post_order = false;
+    } else if (strcmp(order, "post") == 0) {
+        post_order = true;
+    } else {
+        PyErr_Format(PyExc_ValueError, "order must be \"pre\" or \"post\", not \"%s\"", order);
+        return NULL;
+    }
+
+    if (py_max_depth != Py_None) {
+        max_depth = PyLong_AsLong(py_max_depth);
+
+        if (max_depth == -1 && PyErr_Occurred())
+            return NULL;
+
+        if (max_depth < 1) {
+            PyErr_SetString(PyExc_ValueError, "max_depth must be at least 1");
+            return NULL;
+        }
+    }
+
+    iter = PyObject_GC_New(PyPropertyTree_WalkIter, &PyPropertyTree_WalkIterType);
+    Py_INCREF(self);
+    iter->container = self;
+    iter->walker = new ptree_walker(*self->obj, max_depth, post_order);
+    iter->filter = leaves_only ? new ptree_leaf_filter() : NULL;
+    iter->paths_only = false;
+    PyPropertyTree_Track(self, (PyObject*)iter);
+
+    return (PyObject*)iter;
+}
+
+
+static PyObject*
+PyPropertyTree__copy__(PyPropertyTree *self)
+{
+    return (PyObject*)PyPropertyTree_Copy(self);
+}
+
+
+static PyObject *
+PyPropertyTree__reduce__(PyPropertyTree *self)
+{
+    PyObject *args, *py_iter;
+
+    if (self->obj->data() == "") {
+        args = PyTuple_New(0);
+    } else {
+        args = PyTuple_New(1);
+        PyTuple_SET_ITEM(args, 0, PyUnicode_DecodeUTF8(self->obj->data().c_str(), self->obj->data().size(), NULL));
+    }
+
+    if (self->obj->begin() == self->obj->end()) {
+        Py_INCREF(Py_None);
+        py_iter = Py_None;
+    } else {
+        PyPropertyTree_Iter *iter = PyObject_GC_New(PyPropertyTree_Iter, &PyPropertyTree_IterType);
+        Py_INCREF(self);
+        iter->container = self;
+        iter->iterator = new boost::property_tree::ptree::iterator(self->obj->begin());
+        iter->callable = NULL;
+        iter->predicate = NULL;
+        PyPropertyTree_Track(self, (PyObject*)iter);
+        py_iter = (PyObject*)iter;
+    }
+
+    return Py_BuildValue("ONOON", (PyObject*)&PyPropertyTree_Type, args, Py_None, Py_None, py_iter);
+}
+
+
+static PyMethodDef PyPropertyTree_methods[] = {
+    {(char *) "add",
+     (PyCFunction) PyPropertyTree_add,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_add__doc__},
+    {(char *) "aggregate",
+     (PyCFunction) PyPropertyTree_aggregate,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_aggregate__doc__},
+    {(char *) "append",
+     (PyCFunction) PyPropertyTree_append,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_append__doc__},
+    {(char *) "build_index",
+     (PyCFunction) PyPropertyTree_build_index,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_build_index__doc__},
+    {(char *) "clear",
+     (PyCFunction) PyPropertyTree_clear,
+     METH_NOARGS,
+     PyPropertyTree_clear__doc__},
+    {(char *) "column",
+     (PyCFunction) PyPropertyTree_column,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_column__doc__},
+    {(char *) "count",
+     (PyCFunction) PyPropertyTree_count,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_count__doc__},
+    {(char *) "empty",
+     (PyCFunction) PyPropertyTree_empty,
+     METH_NOARGS,
+     PyPropertyTree_empty__doc__},
+    {(char *) "erase",
+     (PyCFunction) PyPropertyTree_erase,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_erase__doc__},
+    {(char *) "erase_if",
+     (PyCFunction) PyPropertyTree_erase_if,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_erase_if__doc__},
+    {(char *) "erase_paths",
+     (PyCFunction) PyPropertyTree_erase_paths,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_erase_paths__doc__},
+    {(char *) "extend",
+     (PyCFunction) PyPropertyTree_extend,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_extend__doc__},
+    {(char *) "find",
+     (PyCFunction) PyPropertyTree_find,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_find__doc__},
+    {(char *) "flatten",
+     (PyCFunction) PyPropertyTree_flatten,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_flatten__doc__},
+    {(char *) "get",
+     (PyCFunction) PyPropertyTree_get,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_get__doc__},
+    {(char *) "grep",
+     (PyCFunction) PyPropertyTree_grep,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_grep__doc__},
+    {(char *) "group_by",
+     (PyCFunction) PyPropertyTree_group_by,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_group_by__doc__},
+    {(char *) "index",
+     (PyCFunction) PyPropertyTree_index,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_index__doc__},
+    {(char *) "insert",
+     (PyCFunction) PyPropertyTree_insert,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_insert__doc__},
+    {(char *) "items",
+     (PyCFunction) PyPropertyTree_items,
+     METH_NOARGS,
+     PyPropertyTree_items__doc__},
+    {(char *) "keys",
+     (PyCFunction) PyPropertyTree_keys,
+     METH_NOARGS,
+     PyPropertyTree_keys__doc__},
+    {(char *) "match",
+     (PyCFunction) PyPropertyTree_match,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_match__doc__},
+    {(char *) "merge",
+     (PyCFunction) PyPropertyTree_merge,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_merge__doc__},
+    {(char *) "nlargest",
+     (PyCFunction) PyPropertyTree_nlargest,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_nlargest__doc__},
+    {(char *) "nsmallest",
+     (PyCFunction) PyPropertyTree_nsmallest,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_nsmallest__doc__},
+    {(char *) "pop",
+     (PyCFunction) PyPropertyTree_pop,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_pop__doc__},
+    {(char *) "popitem",
+     (PyCFunction) PyPropertyTree_popitem,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_popitem__doc__},
+    {(char *) "put",
+     (PyCFunction) PyPropertyTree_put,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_put__doc__},
+    {(char *) "remove",
+     (PyCFunction) PyPropertyTree_remove,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_remove__doc__},
+    {(char *) "reverse",
+     (PyCFunction) PyPropertyTree_reverse,
+     METH_NOARGS,
+     PyPropertyTree_reverse__doc__},
+    {(char *) "search",
+     (PyCFunction) PyPropertyTree_search,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_search__doc__},
+    {(char *) "select",
+     (PyCFunction) PyPropertyTree_select,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_select__doc__},
+    {(char *) "setdefault",
+     (PyCFunction) PyPropertyTree_setdefault,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_setdefault__doc__},
+    {(char *) "snapshot",
+     (PyCFunction) PyPropertyTree_snapshot,
+     METH_NOARGS,
+     PyPropertyTree_snapshot__doc__},
+    {(char *) "sort",
+     (PyCFunction) PyPropertyTree_sort,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_sort__doc__},
+    {(char *) "sorted",
+     (PyCFunction) PyPropertyTree_sorted,
+     METH_NOARGS,
+     PyPropertyTree_sorted__doc__},
+    {(char *) "splice",
+     (PyCFunction) PyPropertyTree_splice,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_splice__doc__},
+    {(char *) "transaction",
+     (PyCFunction) PyPropertyTree_transaction,
+     METH_NOARGS,
+     PyPropertyTree_transaction__doc__},
+    {(char *) "unflatten",
+     (PyCFunction) PyPropertyTree_unflatten,
+     METH_CLASS|METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_unflatten__doc__},
+    {(char *) "upsert_from",
+     (PyCFunction) PyPropertyTree_upsert_from,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_upsert_from__doc__},
+    {(char *) "value_counts",
+     (PyCFunction) PyPropertyTree_value_counts,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_value_counts__doc__},
+    {(char *) "values",
+     (PyCFunction) PyPropertyTree_values,
+     METH_NOARGS,
+     PyPropertyTree_values__doc__},
+    {(char *) "walk",
+     (PyCFunction) PyPropertyTree_walk,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_walk__doc__},
+    {(char *) "__copy__",
+     (PyCFunction) PyPropertyTree__copy__,
+     METH_NOARGS,
+     NULL},
+    {(char *) "__reduce__",
+     (PyCFunction) PyPropertyTree__reduce__,
+     METH_NOARGS,
+     NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+
+static PyObject*
+PyPropertyTree__tp_richcompare(PyPropertyTree *self, PyObject *other, int op)
+{
+    try {
+        if (PyObject_IsInstance(other, (PyObject*)&PyPropertyTree_Type)) {
+            switch (op) {
+                case Py_EQ:
+                    if (*self->obj == *((PyPropertyTree *)other)->obj)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_NE:
+                    if (*self->obj != *((PyPropertyTree *)other)->obj)
+                        Py_RETURN_TRUE;
+                    break;
+                default:
+                    Py_RETURN_NOTIMPLEMENTED;
+            }
+        } else if (other == Py_None) {
+            switch (op) {
+                case Py_EQ:
+                    if (self->obj->data() == "none")
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_NE:
+                    if (self->obj->data() != "none")
+                        Py_RETURN_TRUE;
+                    break;
+                default:
+                    Py_RETURN_NOTIMPLEMENTED;
+            }
+        } else if (PyBool_Check(other)) {
+            bool value = (other == Py_True ? true : false);
+            switch (op) {
+                case Py_LT:
+                    if (self->obj->get_value<bool>() < value)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_LE:
+                    if (self->obj->get_value<bool>() <= value)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_EQ:
+                    if (self->obj->get_value<bool>() == value)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_NE:
+                    if (self->obj->get_value<bool>() != value)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_GE:
+                    if (self->obj->get_value<bool>() >= value)
+                        Py_RETURN_TRUE;
                     break;
                 case Py_GT:
                     if (self->obj->get_value<bool>() > value)
                         Py_RETURN_TRUE;
                     break;
             }
-        } else if (PyLong_Check(other)) {
-            long value = PyLong_AsLong(other);
-            switch (op) {
-                case Py_LT:
-                    if (self->obj->get_value<long>() < value)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_LE:
-                    if (self->obj->get_value<long>() <= value)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_EQ:
-                    if (self->obj->get_value<long>() == value)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_NE:
-                    if (self->obj->get_value<long>() != value)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_GE:
-                    if (self->obj->get_value<long>() >= value)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_GT:
-                    if (self->obj->get_value<long>() > value)
-                        Py_RETURN_TRUE;
-                    break;
+        } else if (PyLong_Check(other)) {
+            long value = PyLong_AsLong(other);
+            switch (op) {
+                case Py_LT:
+                    if (self->obj->get_value<long>() < value)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_LE:
+                    if (self->obj->get_value<long>() <= value)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_EQ:
+                    if (self->obj->get_value<long>() == value)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_NE:
+                    if (self->obj->get_value<long>() != value)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_GE:
+                    if (self->obj->get_value<long>() >= value)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_GT:
+                    if (self->obj->get_value<long>() > value)
+                        Py_RETURN_TRUE;
+                    break;
+            }
+        } else if (PyFloat_Check(other)) {
+            double value = PyFloat_AsDouble(other);
+            switch (op) {
+                case Py_LT:
+                    if (self->obj->get_value<double>() < value)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_LE:
+                    if (self->obj->get_value<double>() <= value)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_EQ:
+                    if (self->obj->get_value<double>() == value)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_NE:
+                    if (self->obj->get_value<double>() != value)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_GE:
+                    if (self->obj->get_value<double>() >= value)
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_GT:
+                    if (self->obj->get_value<double>() > value)
+                        Py_RETURN_TRUE;
+                    break;
+            }
+        } else if (PyUnicode_Check(other)) {
+            Py_ssize_t value_len;
+            const char *value = PyUnicode_AsUTF8AndSize(other, &value_len);
+            switch (op) {
+                case Py_LT:
+                    if (self->obj->data() < std::string(value, value_len))
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_LE:
+                    if (self->obj->data() <= std::string(value, value_len))
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_EQ:
+                    if (self->obj->data() == std::string(value, value_len))
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_NE:
+                    if (self->obj->data() != std::string(value, value_len))
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_GE:
+                    if (self->obj->data() >= std::string(value, value_len))
+                        Py_RETURN_TRUE;
+                    break;
+                case Py_GT:
+                    if (self->obj->data() > std::string(value, value_len))
+                        Py_RETURN_TRUE;
+                    break;
+            }
+        }
+    } catch (boost::property_tree::ptree_bad_data const &exc) {
+        PyErr_SetString((PyObject *) PyPropertyTreeBadDataError_Type, exc.what());
+        return NULL;
+    }
+
+    Py_RETURN_FALSE;
+}
+
+
+static int
+PyPropertyTree__nb_bool(PyPropertyTree *self)
+{
+    try {
+        return self->obj->get_value<bool>();
+    } catch (boost::property_tree::ptree_bad_data const &exc) {
+        PyErr_SetString((PyObject *) PyPropertyTreeBadDataError_Type, exc.what());
+        return -1;
+    }
+}
+
+
+static PyObject*
+PyPropertyTree__nb_int(PyPropertyTree *self)
+{
+    try {
+        return PyLong_FromLong(self->obj->get_value<int>());
+    } catch (boost::property_tree::ptree_bad_data const &exc) {
+        PyErr_SetString((PyObject *) PyPropertyTreeBadDataError_Type, exc.what());
+        return NULL;
+    }
+}
+
+
+static PyObject*
+PyPropertyTree__nb_float(PyPropertyTree *self)
+{
+    try {
+        return PyFloat_FromDouble(self->obj->get_value<double>());
+    } catch (boost::property_tree::ptree_bad_data const &exc) {
+        PyErr_SetString((PyObject *) PyPropertyTreeBadDataError_Type, exc.what());
+        return NULL;
+    }
+}
+
+
+static PyObject*
+PyPropertyTree__nb_or(PyObject *py_left, PyObject *py_right)
+{
+    PyPropertyTree *left;
+    PyPropertyTree *right;
+    PyPropertyTree *retval;
+
+    if (!PyObject_IsInstance(py_left, (PyObject*) &PyPropertyTree_Type) ||
+        !PyObject_IsInstance(py_right, (PyObject*) &PyPropertyTree_Type)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+
+    left = (PyPropertyTree*) py_left;
+    right = (PyPropertyTree*) py_right;
+
+    retval = PyPropertyTree_New(new boost::property_tree::ptree(*left->obj), PTREE_FLAG_NONE);
+
+    for (boost::property_tree::ptree::iterator iter = right->obj->begin(); iter != right->obj->end(); iter++) {
+        retval->obj->put_child(iter->first, iter->second);
+    }
+
+    return (PyObject*)retval;
+}
+
+
+static PyObject*
+PyPropertyTree__nb_inplace_or(PyPropertyTree *self, PyObject *py_right)
+{
+    PyPropertyTree *right;
+
+    if (!PyObject_IsInstance(py_right, (PyObject*) &PyPropertyTree_Type)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+
+    right = (PyPropertyTree*) py_right;
+
+    if (PyPropertyTree_Modified(self) < 0)
+        return NULL;
+
+    for (boost::property_tree::ptree::iterator iter = right->obj->begin(); iter != right->obj->end(); iter++) {
+        PyPropertyTree_SavePath(self, iter->first, false);
+        self->obj->put_child(iter->first, iter->second);
+    }
+
+    Py_INCREF((PyObject*)self);
+    return (PyObject*)self;
+}
+
+
+static PyNumberMethods PyPropertyTree__tp_as_number = {
+    (binaryfunc)  NULL,                                         /* nb_add */
+    (binaryfunc)  NULL,                                         /* nb_subtract */
+    (binaryfunc)  NULL,                                         /* nb_multiply */
+    (binaryfunc)  NULL,                                         /* nb_remainder */
+    (binaryfunc)  NULL,                                         /* nb_divmod */
+    (ternaryfunc) NULL,                                         /* nb_power */
+    (unaryfunc)   NULL,                                         /* nb_negative */
+    (unaryfunc)   NULL,                                         /* nb_positive */
+    (unaryfunc)   NULL,                                         /* nb_absolute */
+    (inquiry)     PyPropertyTree__nb_bool,                      /* nb_bool */
+    (unaryfunc)   NULL,                                         /* nb_invert */
+    (binaryfunc)  NULL,                                         /* nb_lshift */
+    (binaryfunc)  NULL,                                         /* nb_rshift */
+    (binaryfunc)  NULL,                                         /* nb_and */
+    (binaryfunc)  NULL,                                         /* nb_xor */
+    (binaryfunc)  PyPropertyTree__nb_or,                        /* nb_or */
+    (unaryfunc)   PyPropertyTree__nb_int,                       /* nb_int */
+    (void *)      NULL,                                         /* nb_reserved */
+    (unaryfunc)   PyPropertyTree__nb_float,                     /* nb_float */
+    (binaryfunc)  NULL,                                         /* nb_inplace_add */
+    (binaryfunc)  NULL,                                         /* nb_inplace_subtract */
+    (binaryfunc)  NULL,                                         /* nb_inplace_multiply */
+    (binaryfunc)  NULL,                                         /* nb_inplace_remainder */
+    (ternaryfunc) NULL,                                         /* nb_inplace_power */
+    (binaryfunc)  NULL,                                         /* nb_inplace_lshift */
+    (binaryfunc)  NULL,                                         /* nb_inplace_rshift */
+    (binaryfunc)  NULL,                                         /* nb_inplace_and */
+    (binaryfunc)  NULL,                                         /* nb_inplace_xor */
+    (binaryfunc)  PyPropertyTree__nb_inplace_or,                /* nb_inplace_or */
+    (binaryfunc)  NULL,                                         /* nb_floor_divide */
+    (binaryfunc)  NULL,                                         /* nb_true_divide */
+    (binaryfunc)  NULL,                                         /* nb_inplace_floor_divide */
+    (binaryfunc)  NULL,                                         /* nb_inplace_true_divide */
+    (unaryfunc)   NULL,                                         /* nb_index */
+    (binaryfunc)  NULL,                                         /* nb_matrix_multiply */
+    (binaryfunc)  NULL,                                         /* nb_inplace_matrix_multiply */
+};
+
+
+static Py_ssize_t
+PyPropertyTree_mp_length(PyObject *self)
+{
+    return ((PyPropertyTree*)self)->obj->size();
+}
+
+
+static PyObject *
+PyPropertyTree_mp_subscript(PyObject *self, PyObject *key)
+{
+    const char *path;
+    Py_ssize_t path_len;
+    boost::property_tree::ptree *retval;
+    boost::property_tree::ptree *tree = ((PyPropertyTree*)self)->obj;
+
+    if (PyIndex_Check(key)) {
+        int index = PyLong_AsSsize_t(key);
+
+        if (index < 0)
+            index += (Py_ssize_t)tree->size();
+
+        if (index >= 0 && index < (Py_ssize_t)tree->size()) {
+            boost::property_tree::ptree::iterator iter(tree->begin());
+
+            for (Py_ssize_t i = 0; i < index; i++)
+                ++iter;
+
+            return (PyObject*)PyPropertyTree_New(&iter->second, PTREE_FLAG_OBJECT_NOT_OWNED, (PyPropertyTree *) self);
+        }
+
+        PyErr_Format(PyExc_IndexError, "%s index out of range", Py_TYPE(self)->tp_name);
+        return NULL;
+
+    } else if (!PyUnicode_Check(key)) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+
+    path = PyUnicode_AsUTF8AndSize(key, &path_len);
+
+    try {
+        retval = &tree->get_child(std::string(path, path_len));
+    } catch (boost::property_tree::ptree_bad_path const &exc) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+
+    return (PyObject*)PyPropertyTree_New(retval, PTREE_FLAG_OBJECT_NOT_OWNED, (PyPropertyTree *) self);
+}
+
+
+static int
+PyPropertyTree_mp_ass_subscript(PyObject *self, PyObject *key, PyObject *value)
+{
+    std::string path_std;
+    std::string value_std;
+
+    if (PyPropertyTree_Modified((PyPropertyTree*)self) < 0)
+        return -1;
+
+    boost::property_tree::ptree *tree = ((PyPropertyTree*)self)->obj;
+
+    if (PyIndex_Check(key)) {
+        int index = PyLong_AsSsize_t(key);
+
+        if (index < 0)
+            index += (Py_ssize_t)tree->size();
+
+        if (index >= 0 && index < (Py_ssize_t)tree->size()) {
+            boost::property_tree::ptree::iterator iter(tree->begin());
+
+            for (Py_ssize_t i = 0; i < index; i++)
+                ++iter;
+
+            path_std = iter->first;
+        } else {
+            PyErr_Format(PyExc_IndexError, "%s index out of range", Py_TYPE(self)->tp_name);
+            return -1;
+        }
+
+    } else if (PyUnicode_Check(key)) {
+        Py_ssize_t path_len;
+        const char *path = PyUnicode_AsUTF8AndSize(key, &path_len);
+        path_std = std::string(path, path_len);
+    } else {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return -1;
+    }
+
+    if (value == NULL) {
+        for (boost::property_tree::ptree::iterator iter = tree->begin(); iter != tree->end(); iter++) {
+            if (iter->first == path_std) {
+                PyPropertyTree_SaveRemoved((PyPropertyTree*)self, *tree, *iter);
+                tree->erase(iter);
+                return 0;
+            }
+        }
+        PyErr_SetObject(PyExc_KeyError, key);
+        return -1;
+    } else {
+        if (PyObject_IsInstance(value, (PyObject *) &PyPropertyTree_Type)) {
+            PyPropertyTree_SavePath((PyPropertyTree*)self, path_std, false);
+            tree->put_child(path_std, *(((PyPropertyTree*)value)->obj));
+        } else if (py_value_to_string(value, value_std) == 0) {
+            boost::property_tree::ptree value_tree(value_std);
+            PyPropertyTree_SavePath((PyPropertyTree*)self, path_std, false);
+            tree->put_child(path_std, value_tree);
+        } else {
+            PyErr_SetObject(PyExc_ValueError, value);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static PyMappingMethods PyPropertyTree_as_mapping = {
+    PyPropertyTree_mp_length,
+    PyPropertyTree_mp_subscript,
+    PyPropertyTree_mp_ass_subscript,
+};
+
+
+static int
+PyPropertyTree__sq_contains(PyPropertyTree *self, PyObject *py_value)
+{
+    if (PyUnicode_Check(py_value)) {
+        Py_ssize_t value_len;
+        const char *value = PyUnicode_AsUTF8AndSize(py_value, &value_len);
+
+        if (value == NULL || PyErr_Occurred()) {
+            PyErr_Clear();
+            return 0;
+        }
+
+        std::string str(value, value_len);
+
+        // check the keys first then check the data string
+        const std::string &data = self->obj->data();
+
+        return (self->obj->find(str) != self->obj->not_found()) ||
+               (ptree_memmem(data.data(), data.size(), value, value_len) != NULL);
+
+    } else if (PyObject_IsInstance(py_value, (PyObject*)&PyPropertyTree_Type)) {
+        const std::string &value = ((PyPropertyTree*)py_value)->obj->data();
+
+        return (self->obj->find(value) != self->obj->not_found());
+    }
+
+    return 0;
+}
+
+
+PyObject*
+PyPropertyTree__sq_inplace_concat(PyPropertyTree *self, PyObject *py_value)
+{
+    if (PyObject_IsInstance(py_value, (PyObject*)&PyPropertyTree_Type)) {
+        PyPropertyTree *value = (PyPropertyTree*)py_value;
+
+        if (PyPropertyTree_Modified(self) < 0)
+            return NULL;
+
+        PyPropertyTree_SaveChildren(self, *self->obj);
+        self->obj->insert(self->obj->end(), value->obj->begin(), value->obj->end());
+
+        Py_INCREF(self);
+
+        return (PyObject*)self;
+    }
+
+    PyErr_Format(PyExc_TypeError, "unsupported operand type(s) for +=: '%s' and '%s'",
+                                  Py_TYPE(self)->tp_name, Py_TYPE(py_value)->tp_name);
+    return NULL;
+}
+
+
+static PySequenceMethods PyPropertyTree__tp_as_sequence = {
+    (lenfunc) NULL,                                             /* sq_length */
+    (binaryfunc) NULL,                                          /* sq_concat */
+    (ssizeargfunc) NULL,                                        /* sq_repeat */
+    (ssizeargfunc) NULL,                                        /* sq_item */
+    NULL,
+    (ssizeobjargproc) NULL,                                     /* sq_ass_item */
+    NULL,
+    (objobjproc) PyPropertyTree__sq_contains,                   /* sq_contains */
+    (binaryfunc) PyPropertyTree__sq_inplace_concat,             /* sq_inplace_concat */
+    (ssizeargfunc) NULL,                                        /* sq_inplace_repeat */
+};
+
+
+static PyObject*
+PyPropertyTree__tp_iter(PyPropertyTree *self)
+{
+    PyPropertyTree_Iter *iter;
+
+    iter = PyObject_GC_New(PyPropertyTree_Iter, &PyPropertyTree_IterType);
+    Py_INCREF(self);
+    iter->container = self;
+    iter->iterator = new boost::property_tree::ptree::iterator(self->obj->begin());
+    iter->callable = NULL;
+    iter->predicate = NULL;
+    PyPropertyTree_Track(self, (PyObject*)iter);
+
+    return (PyObject*)iter;
+}
+
+
+static PyObject*
+PyPropertyTree__tp_str(PyPropertyTree *self)
+{
+    return PyUnicode_DecodeUTF8(self->obj->data().c_str(), self->obj->data().size(), NULL);
+}
+
+
+static int
+PyPropertyTree__tp_init(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *key, *value = NULL;
+    std::string value_std;
+
+    // dict style keyword constructor
+    // t = Tree(a=1, b=2, c=3)
+    // len(t)                        -> 3
+    // t.keys()                      -> ['a', 'b', 'c']
+    // [v.value for v in t.values()] -> ['1', '2', '3']
+    if (kwargs != NULL && PyTuple_GET_SIZE(args) == 0 && PyArg_ValidateKeywordArguments(kwargs)) {
+        Py_ssize_t pos = 0;
+        self->obj = new boost::property_tree::ptree();
+
+        while (PyDict_Next(kwargs, &pos, &key, &value)) {
+            Py_ssize_t key_len;
+            const char *c_key = PyUnicode_AsUTF8AndSize(key, &key_len);
+
+            if (PyObject_IsInstance(value, (PyObject *) &PyPropertyTree_Type)) {
+                self->obj->push_back({std::string(c_key, key_len), *((PyPropertyTree *)value)->obj});
+            } else if (py_value_to_string(value, value_std) == 0) {
+                boost::property_tree::ptree tree(value_std);
+                self->obj->push_back({std::string(c_key, key_len), tree});
+            } else {
+                PyErr_SetObject(PyExc_ValueError, value);
+                return -1;
+            }
+        }
+    // regular t = Tree("foo") value constructor
+    } else if (PyArg_ParseTuple(args, (char *) "|O", &value)) {
+        if (kwargs != NULL) {
+            PyErr_Format(PyExc_TypeError, "Tree() doesn't support mixed keyword/value args");
+            return -1;
+        }
+        if (value) {
+            if (PyObject_IsInstance(value, (PyObject*)&PyPropertyTree_Type)) {
+                PyPropertyTree_Share((PyPropertyTree*)value, self);
+                return 0;
+            } else if (py_value_to_string(value, value_std) == 0) {
+                self->obj = new boost::property_tree::ptree(value_std);
+            } else {
+                PyErr_Format(PyExc_TypeError, "unsupported argument type: '%s'", Py_TYPE(value)->tp_name);
+                return -1;
+            }
+        } else {
+            self->obj = new boost::property_tree::ptree();
+        }
+    } else {
+        return -1;
+    }
+
+    self->flags = PTREE_FLAG_NONE;
+    return 0;
+}
+
+
+static void
+PyPropertyTree__tp_dealloc(PyPropertyTree *self)
+{
+    boost::property_tree::ptree *tmp = self->obj;
+    self->obj = NULL;
+    if (!(self->flags & PTREE_FLAG_OBJECT_NOT_OWNED)) {
+        delete tmp;
+    }
+    PyPropertyTree_Untrack(self, (PyObject*)self);
+    if (self->cow_source) {
+        std::vector<PyPropertyTree*> *copies = self->cow_source->cow_copies;
+        copies->erase(std::find(copies->begin(), copies->end(), self));
+    }
+    delete self->cow_copies;
+    delete self->views;
+    delete self->cow_scans;
+    delete self->undo;
+    Py_CLEAR(self->root);
+    Py_CLEAR(self->heirs);
+    Py_CLEAR(self->cow_source);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+static PyObject*
+PyPropertyTree__tp_getattro(PyPropertyTree *self, PyObject *name)
+{
+    // do normal lookup first so we don't break stuff like function calls
+    PyObject *attr = PyObject_GenericGetAttr((PyObject*)self, name);
+
+    if (attr)
+        return attr;
+
+    // PyObject_GenericGetAttr() didn't find anything look, in the children
+    if (PyErr_Occurred() && PyErr_ExceptionMatches(PyExc_AttributeError)) {
+
+        boost::property_tree::ptree *retval;
+        Py_ssize_t key_len;
+        const char *key = PyUnicode_AsUTF8AndSize(name, &key_len); // assume python already checked the type
+
+        try {
+            retval = &self->obj->get_child(std::string(key, key_len));
+        } catch (boost::property_tree::ptree_bad_path const &exc) {
+            /* rethrow AttributeError */
+            return NULL;
+        }
+
+        PyErr_Clear(); // found a child, clear the exception
+
+        return (PyObject*)PyPropertyTree_New(retval, PTREE_FLAG_OBJECT_NOT_OWNED, self);
+    }
+
+    /* keep whatever exception python threw */
+    return NULL;
+}
+
+
+static int
+PyPropertyTree__tp_setattro(PyPropertyTree *self, PyObject *name, PyObject *value)
+{
+    // do normal lookup first -- might not even be needed...
+    if (PyObject_GenericSetAttr((PyObject*)self, name, value) == 0)
+        return 0;
+
+    if (PyErr_Occurred() && PyErr_ExceptionMatches(PyExc_AttributeError)) {
+        Py_ssize_t key_len;
+        const char *key = PyUnicode_AsUTF8AndSize(name, &key_len);
+        std::string value_std, key_std(key, key_len);
+
+        if (PyPropertyTree_Modified(self) < 0)
+            return -1;
+
+        if (PyObject_IsInstance(value, (PyObject *) &PyPropertyTree_Type)) {
+            PyPropertyTree_SavePath(self, key_std, false);
+            self->obj->put_child(key_std, *(((PyPropertyTree *)value)->obj));
+        } else if (py_value_to_string(value, value_std) == 0) {
+            boost::property_tree::ptree tree(value_std);
+            PyPropertyTree_SavePath(self, key_std, false);
+            self->obj->put_child(key_std, tree);
+        } else {
+            PyErr_Clear();
+            PyErr_SetObject(PyExc_ValueError, value);
+            return -1;
+        }
+        PyErr_Clear();
+        return 0;
+    }
+
+    /* keep whatever exception python threw */
+    return -1;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree__doc__,
+"    Property tree main structure.\n"
+"    A property tree is a hierarchical data structure which has one data element\n"
+"    in each node as well as an ordered sequence of sub-nodes which are\n"
+"    additionally identified by a non-unique key.\n");
+
+
+PyTypeObject PyPropertyTree_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    (char *) "property_tree.Tree",                              /* tp_name */
+    sizeof(PyPropertyTree),                                     /* tp_basicsize */
+    0,                                                          /* tp_itemsize */
+    (destructor)PyPropertyTree__tp_dealloc,                     /* tp_dealloc */
+    (printfunc)0,                                               /* tp_print */
+    (getattrfunc)NULL,                                          /* tp_getattr */
+    (setattrfunc)NULL,                                          /* tp_setattr */
+    (PyAsyncMethods*)NULL,                                      /* tp_compare */
+    (reprfunc)NULL,                                             /* tp_repr */
+    (PyNumberMethods*)&PyPropertyTree__tp_as_number,            /* tp_as_number */
+    (PySequenceMethods*)&PyPropertyTree__tp_as_sequence,        /* tp_as_sequence */
+    (PyMappingMethods*)&PyPropertyTree_as_mapping,              /* tp_as_mapping */
+    (hashfunc)NULL,                                             /* tp_hash */
+    (ternaryfunc)NULL,                                          /* tp_call */
+    (reprfunc)PyPropertyTree__tp_str,                           /* tp_str */
+    (getattrofunc)PyPropertyTree__tp_getattro,                  /* tp_getattro */
+    (setattrofunc)PyPropertyTree__tp_setattro,                  /* tp_setattro */
+    (PyBufferProcs*)NULL,                                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                                         /* tp_flags */
+    PyPropertyTree__doc__,                                      /* Documentation string */
+    (traverseproc)NULL,                                         /* tp_traverse */
+    (inquiry)NULL,                                              /* tp_clear */
+    (richcmpfunc)PyPropertyTree__tp_richcompare,                /* tp_richcompare */
+    0,                                                          /* tp_weaklistoffset */
+    (getiterfunc)PyPropertyTree__tp_iter,                       /* tp_iter */
+    (iternextfunc)NULL,                                         /* tp_iternext */
+    (struct PyMethodDef*)PyPropertyTree_methods,                /* tp_methods */
+    (struct PyMemberDef*)0,                                     /* tp_members */
+    PyPropertyTree__getsets,                                    /* tp_getset */
+    NULL,                                                       /* tp_base */
+    NULL,                                                       /* tp_dict */
+    (descrgetfunc)NULL,                                         /* tp_descr_get */
+    (descrsetfunc)NULL,                                         /* tp_descr_set */
+    0,                                                          /* tp_dictoffset */
+    (initproc)PyPropertyTree__tp_init,                          /* tp_init */
+    (allocfunc)PyType_GenericAlloc,                             /* tp_alloc */
+    (newfunc)PyType_GenericNew,                                 /* tp_new */
+    (freefunc)0,                                                /* tp_free */
+    (inquiry)NULL,                                              /* tp_is_gc */
+    NULL,                                                       /* tp_bases */
+    NULL,                                                       /* tp_mro */
+    NULL,                                                       /* tp_cache */
+    NULL,                                                       /* tp_subclasses */
+    NULL,                                                       /* tp_weaklist */
+    (destructor) NULL                                           /* tp_del */
+};
+
+
+static void
+PyPropertyTree_Iter__tp_clear(PyPropertyTree_Iter *self)
+{
+    if (self->container)
+        PyPropertyTree_Untrack(self->container, (PyObject*)self);
+    Py_CLEAR(self->container);
+    delete self->iterator;
+    self->iterator = NULL;
+}
+
+
+static int
+PyPropertyTree_Iter__tp_traverse(PyPropertyTree_Iter *self, visitproc visit, void *arg)
+{
+    Py_VISIT((PyObject *) self->container);
+    return 0;
+}
+
+
+static void
+PyPropertyTree_Iter__tp_dealloc(PyPropertyTree_Iter *self)
+{
+    if (self->container)
+        PyPropertyTree_Untrack(self->container, (PyObject*)self);
+    Py_CLEAR(self->container);
+    delete self->iterator;
+    self->iterator = NULL;
+    Py_XDECREF(self->callable);
+    Py_XDECREF(self->predicate);
+
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+static PyObject*
+PyPropertyTree_Iter__tp_iter(PyPropertyTree_Iter *self)
+{
+    Py_INCREF(self);
+    return (PyObject*) self;
+}
+
+
+static PyObject*
+PyPropertyTree_Iter__tp_iternext(PyPropertyTree_Iter *self)
+{
+    while (1) {
+        boost::property_tree::ptree::iterator iter = *self->iterator;
+
+        if (iter == self->container->obj->end()) {
+            PyErr_SetNone(PyExc_StopIteration);
+            return NULL;
+        }
+
+        ++(*self->iterator);
+
+        // native predicates are checked before creating any python objects
+        if (self->predicate && !(*((PyPropertyTree_Predicate *)self->predicate)->filter)->eval(iter->second))
+            continue;
+
+        std::string key = iter->first;
+
+        PyPropertyTree *py_ptree = PyPropertyTree_New(&iter->second, PTREE_FLAG_OBJECT_NOT_OWNED, self->container);
+
+        if (self->callable) {
+            PyObject *retval = PyObject_CallFunction(self->callable, (char *) "s#O", key.c_str(), key.size(), py_ptree);
+
+            if (!retval) {
+                Py_DECREF(py_ptree);
+                /* keep whatever exception PyObject_CallFunction threw */
+                return NULL;
+            } else if (PyObject_IsTrue(retval)) {
+                Py_DECREF(retval);
+            } else {
+                Py_DECREF(retval);
+                Py_DECREF(py_ptree);
+                continue;
+            }
+        }
+
+        return Py_BuildValue((char *) "s#N", key.c_str(), key.size(), py_ptree);
+    }
+}
+
+
+PyTypeObject PyPropertyTree_IterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    (char *) "property_tree.TreeIter",                          /* tp_name */
+    sizeof(PyPropertyTree_Iter),                                /* tp_basicsize */
+    0,                                                          /* tp_itemsize */
+    (destructor)PyPropertyTree_Iter__tp_dealloc,                /* tp_dealloc */
+    (printfunc)0,                                               /* tp_print */
+    (getattrfunc)NULL,                                          /* tp_getattr */
+    (setattrfunc)NULL,                                          /* tp_setattr */
+    (PyAsyncMethods*)NULL,                                      /* tp_compare */
+    (reprfunc)NULL,                                             /* tp_repr */
+    (PyNumberMethods*)NULL,                                     /* tp_as_number */
+    (PySequenceMethods*)NULL,                                   /* tp_as_sequence */
+    (PyMappingMethods*)NULL,                                    /* tp_as_mapping */
+    (hashfunc)NULL,                                             /* tp_hash */
+    (ternaryfunc)NULL,                                          /* tp_call */
+    (reprfunc)NULL,                                             /* tp_str */
+    (getattrofunc)NULL,                                         /* tp_getattro */
+    (setattrofunc)NULL,                                         /* tp_setattro */
+    (PyBufferProcs*)NULL,                                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_GC,                      /* tp_flags */
+    NULL,                                                       /* Documentation string */
+    (traverseproc)PyPropertyTree_Iter__tp_traverse,             /* tp_traverse */
+    (inquiry)PyPropertyTree_Iter__tp_clear,                     /* tp_clear */
+    (richcmpfunc)NULL,                                          /* tp_richcompare */
+    0,                                                          /* tp_weaklistoffset */
+    (getiterfunc)PyPropertyTree_Iter__tp_iter,                  /* tp_iter */
+    (iternextfunc)PyPropertyTree_Iter__tp_iternext,             /* tp_iternext */
+    (struct PyMethodDef*)NULL,                                  /* tp_methods */
+    (struct PyMemberDef*)0,                                     /* tp_members */
+    NULL,                                                       /* tp_getset */
+    NULL,                                                       /* tp_base */
+    NULL,                                                       /* tp_dict */
+    (descrgetfunc)NULL,                                         /* tp_descr_get */
+    (descrsetfunc)NULL,                                         /* tp_descr_set */
+    0,                                                          /* tp_dictoffset */
+    (initproc)NULL,                                             /* tp_init */
+    (allocfunc)PyType_GenericAlloc,                             /* tp_alloc */
+    (newfunc)PyType_GenericNew,                                 /* tp_new */
+    (freefunc)0,                                                /* tp_free */
+    (inquiry)NULL,                                              /* tp_is_gc */
+    NULL,                                                       /* tp_bases */
+    NULL,                                                       /* tp_mro */
+    NULL,                                                       /* tp_cache */
+    NULL,                                                       /* tp_subclasses */
+    NULL,                                                       /* tp_weaklist */
+    (destructor) NULL                                           /* tp_del */
+};
+
+
+static void
+PyPropertyTree_AssocIter__tp_clear(PyPropertyTree_AssocIter *self)
+{
+    if (self->container)
+        PyPropertyTree_Untrack(self->container, (PyObject*)self);
+    Py_CLEAR(self->container);
+}
+
+
+static int
+PyPropertyTree_AssocIter__tp_traverse(PyPropertyTree_AssocIter *self, visitproc visit, void *arg)
+{
+    Py_VISIT((PyObject *) self->container);
+    return 0;
+}
+
+
+static void
+PyPropertyTree_AssocIter__tp_dealloc(PyPropertyTree_AssocIter *self)
+{
+    if (self->container)
+        PyPropertyTree_Untrack(self->container, (PyObject*)self);
+    Py_CLEAR(self->container);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+static PyObject*
+PyPropertyTree_AssocIter__tp_iter(PyPropertyTree_AssocIter *self)
+{
+    Py_INCREF(self);
+    return (PyObject*) self;
+}
+
+
+static PyObject*
+PyPropertyTree_AssocIter__tp_iternext(PyPropertyTree_AssocIter *self)
+{
+    boost::property_tree::ptree::assoc_iterator iter = self->iterator.first;
+
+    if (iter == self->iterator.second) {
+        PyErr_SetNone(PyExc_StopIteration);
+        return NULL;
+    }
+
+    self->iterator.first++;
+
+    const std::string &key = iter->first;
+
+    PyPropertyTree *py_ptree = PyPropertyTree_New(&iter->second, PTREE_FLAG_OBJECT_NOT_OWNED, self->container);
+
+    return Py_BuildValue((char *) "s#N", key.c_str(), key.size(), py_ptree);
+}
+
+
+PyTypeObject PyPropertyTree_AssocIterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    (char *) "property_tree.AssocTreeIter",                     /* tp_name */
+    sizeof(PyPropertyTree_AssocIter),                           /* tp_basicsize */
+    0,                                                          /* tp_itemsize */
+    (destructor)PyPropertyTree_AssocIter__tp_dealloc,           /* tp_dealloc */
+    (printfunc)0,                                               /* tp_print */
+    (getattrfunc)NULL,                                          /* tp_getattr */
+    (setattrfunc)NULL,                                          /* tp_setattr */
+    (PyAsyncMethods*)NULL,                                      /* tp_compare */
+    (reprfunc)NULL,                                             /* tp_repr */
+    (PyNumberMethods*)NULL,                                     /* tp_as_number */
+    (PySequenceMethods*)NULL,                                   /* tp_as_sequence */
+    (PyMappingMethods*)NULL,                                    /* tp_as_mapping */
+    (hashfunc)NULL,                                             /* tp_hash */
+    (ternaryfunc)NULL,                                          /* tp_call */
+    (reprfunc)NULL,                                             /* tp_str */
+    (getattrofunc)NULL,                                         /* tp_getattro */
+    (setattrofunc)NULL,                                         /* tp_setattro */
+    (PyBufferProcs*)NULL,                                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_GC,                      /* tp_flags */
+    NULL,                                                       /* Documentation string */
+    (traverseproc)PyPropertyTree_AssocIter__tp_traverse,        /* tp_traverse */
+    (inquiry)PyPropertyTree_AssocIter__tp_clear,                /* tp_clear */
+    (richcmpfunc)NULL,                                          /* tp_richcompare */
+    0,                                                          /* tp_weaklistoffset */
+    (getiterfunc)PyPropertyTree_AssocIter__tp_iter,             /* tp_iter */
+    (iternextfunc)PyPropertyTree_AssocIter__tp_iternext,        /* tp_iternext */
+    (struct PyMethodDef*)NULL,                                  /* tp_methods */
+    (struct PyMemberDef*)0,                                     /* tp_members */
+    NULL,                                                       /* tp_getset */
+    NULL,                                                       /* tp_base */
+    NULL,                                                       /* tp_dict */
+    (descrgetfunc)NULL,                                         /* tp_descr_get */
+    (descrsetfunc)NULL,                                         /* tp_descr_set */
+    0,                                                          /* tp_dictoffset */
+    (initproc)NULL,                                             /* tp_init */
+    (allocfunc)PyType_GenericAlloc,                             /* tp_alloc */
+    (newfunc)PyType_GenericNew,                                 /* tp_new */
+    (freefunc)0,                                                /* tp_free */
+    (inquiry)NULL,                                              /* tp_is_gc */
+    NULL,                                                       /* tp_bases */
+    NULL,                                                       /* tp_mro */
+    NULL,                                                       /* tp_cache */
+    NULL,                                                       /* tp_subclasses */
+    NULL,                                                       /* tp_weaklist */
+    (destructor) NULL                                           /* tp_del */
+};
+
+
+static void
+PyPropertyTree_WalkIter__tp_clear(PyPropertyTree_WalkIter *self)
+{
+    if (self->container)
+        PyPropertyTree_Untrack(self->container, (PyObject*)self);
+    Py_CLEAR(self->container);
+    delete self->walker;
+    self->walker = NULL;
+}
+
+
+static int
+PyPropertyTree_WalkIter__tp_traverse(PyPropertyTree_WalkIter *self, visitproc visit, void *arg)
+{
+    Py_VISIT((PyObject *) self->container);
+    return 0;
+}
+
+
+static void
+PyPropertyTree_WalkIter__tp_dealloc(PyPropertyTree_WalkIter *self)
+{
+    if (self->container)
+        PyPropertyTree_Untrack(self->container, (PyObject*)self);
+    Py_CLEAR(self->container);
+    delete self->walker;
+    self->walker = NULL;
+    delete self->filter;
+    self->filter = NULL;
+
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+static PyObject*
+PyPropertyTree_WalkIter__tp_iter(PyPropertyTree_WalkIter *self)
+{
+    Py_INCREF(self);
+    return (PyObject*) self;
+}
+
+
+static PyObject*
+PyPropertyTree_WalkIter__tp_iternext(PyPropertyTree_WalkIter *self)
+{
+    if (self->walker == NULL) {
+        PyErr_SetNone(PyExc_StopIteration);
+        return NULL;
+    }
+
+    while (self->walker->next()) {
+        boost::property_tree::ptree::value_type &item = self->walker->item();
+
+        if (self->filter && !(*self->filter)(item))
+            continue;
+
+        const std::string &path = self->walker->path();
+
+        if (self->paths_only)
+            return PyUnicode_FromStringAndSize(path.c_str(), path.size());
+
+        PyPropertyTree *py_ptree = PyPropertyTree_New(&item.second, PTREE_FLAG_OBJECT_NOT_OWNED, self->container);
+
+        return Py_BuildValue((char *) "s#N", path.c_str(), path.size(), py_ptree);
+    }
+
+    PyErr_SetNone(PyExc_StopIteration);
+    return NULL;
+}
+
+
+PyTypeObject PyPropertyTree_WalkIterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    (char *) "property_tree.WalkTreeIter",                      /* tp_name */
+    sizeof(PyPropertyTree_WalkIter),                            /* tp_basicsize */
+    0,                                                          /* tp_itemsize */
+    (destructor)PyPropertyTree_WalkIter__tp_dealloc,            /* tp_dealloc */
+    (printfunc)0,                                               /* tp_print */
+    (getattrfunc)NULL,                                          /* tp_getattr */
+    (setattrfunc)NULL,                                          /* tp_setattr */
+    (PyAsyncMethods*)NULL,                                      /* tp_compare */
+    (reprfunc)NULL,                                             /* tp_repr */
+    (PyNumberMethods*)NULL,                                     /* tp_as_number */
+    (PySequenceMethods*)NULL,                                   /* tp_as_sequence */
+    (PyMappingMethods*)NULL,                                    /* tp_as_mapping */
+    (hashfunc)NULL,                                             /* tp_hash */
+    (ternaryfunc)NULL,                                          /* tp_call */
+    (reprfunc)NULL,                                             /* tp_str */
+    (getattrofunc)NULL,                                         /* tp_getattro */
+    (setattrofunc)NULL,                                         /* tp_setattro */
+    (PyBufferProcs*)NULL,                                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_GC,                      /* tp_flags */
+    NULL,                                                       /* Documentation string */
+    (traverseproc)PyPropertyTree_WalkIter__tp_traverse,         /* tp_traverse */
+    (inquiry)PyPropertyTree_WalkIter__tp_clear,                 /* tp_clear */
+    (richcmpfunc)NULL,                                          /* tp_richcompare */
+    0,                                                          /* tp_weaklistoffset */
+    (getiterfunc)PyPropertyTree_WalkIter__tp_iter,              /* tp_iter */
+    (iternextfunc)PyPropertyTree_WalkIter__tp_iternext,         /* tp_iternext */
+    (struct PyMethodDef*)NULL,                                  /* tp_methods */
+    (struct PyMemberDef*)0,                                     /* tp_members */
+    NULL,                                                       /* tp_getset */
+    NULL,                                                       /* tp_base */
+    NULL,                                                       /* tp_dict */
+    (descrgetfunc)NULL,                                         /* tp_descr_get */
+    (descrsetfunc)NULL,                                         /* tp_descr_set */
+    0,                                                          /* tp_dictoffset */
+    (initproc)NULL,                                             /* tp_init */
+    (allocfunc)PyType_GenericAlloc,                             /* tp_alloc */
+    (newfunc)PyType_GenericNew,                                 /* tp_new */
+    (freefunc)0,                                                /* tp_free */
+    (inquiry)NULL,                                              /* tp_is_gc */
+    NULL,                                                       /* tp_bases */
+    NULL,                                                       /* tp_mro */
+    NULL,                                                       /* tp_cache */
+    NULL,                                                       /* tp_subclasses */
+    NULL,                                                       /* tp_weaklist */
+    (destructor) NULL                                           /* tp_del */
+};
+
+
+PyDoc_STRVAR(PyPropertyTree_Query_expression__doc__,
+"the expression this query was compiled from\n");
+
+
+static PyObject*
+PyPropertyTree_Query__get_expression(PyPropertyTree_Query *self, void *Py_UNUSED(closure))
+{
+    PyObject *expression = self->expression ? self->expression : Py_None;
+
+    Py_INCREF(expression);
+    return expression;
+}
+
+
+static PyGetSetDef PyPropertyTree_Query__getsets[] = {
+    {
+        (char*) "expression",                                    /* attribute name */
+        (getter) PyPropertyTree_Query__get_expression,           /* C function to get the attribute */
+        (setter) NULL,                                           /* C function to set the attribute */
+        PyPropertyTree_Query_expression__doc__,                  /* optional doc string */
+        NULL                                                     /* optional additional data for getter and setter */
+    },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+
+static PyObject*
+PyPropertyTree_Query__tp_repr(PyPropertyTree_Query *self)
+{
+    return PyUnicode_FromFormat("Query(%R)", self->expression ? self->expression : Py_None);
+}
+
+
+static int
+PyPropertyTree_Query__tp_init(PyPropertyTree_Query *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *expression;
+    Py_ssize_t expr_len;
+    const char *keywords[] = {"expression", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "U:Query", (char **) keywords, &expression)) {
+        return -1;
+    }
+
+    const char *expr = PyUnicode_AsUTF8AndSize(expression, &expr_len);
+
+    if (expr == NULL)
+        return -1;
+
+    query_plan *plan = new query_plan();
+
+    try {
+        query_parser(std::string(expr, expr_len)).parse(*plan);
+    } catch (query_error const &exc) {
+        delete plan;
+        PyErr_SetString((PyObject *) PyPropertyTreeQueryError_Type, exc.what());
+        return -1;
+    }
+
+    delete self->plan;
+    self->plan = plan;
+
+    Py_INCREF(expression);
+    Py_XSETREF(self->expression, expression);
+
+    return 0;
+}
+
+
+static void
+PyPropertyTree_Query__tp_dealloc(PyPropertyTree_Query *self)
+{
+    delete self->plan;
+    self->plan = NULL;
+    Py_CLEAR(self->expression);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_Query__doc__,
+"Query(expression)\n\n"
+"    A query expression compiled for Tree.select().\n"
+"      key         -- the children with the given key\n"
+"      *           -- all the children\n"
+"      ..          -- this node and all its descendants\n"
+"      [n]         -- the child at index n, negative counts from the end\n"
+"      ['key']     -- the children with the given key, which may contain a '.'\n"
+"      [?filter]   -- the children for which the filter is true\n"
+"    * Filters compare a field path relative to the child (or @ for the\n"
+"      child itself) with a string, number, true, false or null using\n"
+"      == != < <= > >=, and combine them with && || ! and parentheses.\n"
+"    * A field on its own tests whether the field exists.\n"
+"    * Values are compared as numbers against numbers, otherwise as strings.\n"
+"    * Filters can be nested 1000 deep, deeper ones raise QueryError.\n");
+
+
+PyTypeObject PyPropertyTree_QueryType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    (char *) "property_tree.Query",                             /* tp_name */
+    sizeof(PyPropertyTree_Query),                               /* tp_basicsize */
+    0,                                                          /* tp_itemsize */
+    (destructor)PyPropertyTree_Query__tp_dealloc,               /* tp_dealloc */
+    (printfunc)0,                                               /* tp_print */
+    (getattrfunc)NULL,                                          /* tp_getattr */
+    (setattrfunc)NULL,                                          /* tp_setattr */
+    (PyAsyncMethods*)NULL,                                      /* tp_compare */
+    (reprfunc)PyPropertyTree_Query__tp_repr,                    /* tp_repr */
+    (PyNumberMethods*)NULL,                                     /* tp_as_number */
+    (PySequenceMethods*)NULL,                                   /* tp_as_sequence */
+    (PyMappingMethods*)NULL,                                    /* tp_as_mapping */
+    (hashfunc)NULL,                                             /* tp_hash */
+    (ternaryfunc)NULL,                                          /* tp_call */
+    (reprfunc)NULL,                                             /* tp_str */
+    (getattrofunc)NULL,                                         /* tp_getattro */
+    (setattrofunc)NULL,                                         /* tp_setattro */
+    (PyBufferProcs*)NULL,                                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                                         /* tp_flags */
+    PyPropertyTree_Query__doc__,                                /* Documentation string */
+    (traverseproc)NULL,                                         /* tp_traverse */
+    (inquiry)NULL,                                              /* tp_clear */
+    (richcmpfunc)NULL,                                          /* tp_richcompare */
+    0,                                                          /* tp_weaklistoffset */
+    (getiterfunc)NULL,                                          /* tp_iter */
+    (iternextfunc)NULL,                                         /* tp_iternext */
+    (struct PyMethodDef*)NULL,                                  /* tp_methods */
+    (struct PyMemberDef*)0,                                     /* tp_members */
+    PyPropertyTree_Query__getsets,                              /* tp_getset */
+    NULL,                                                       /* tp_base */
+    NULL,                                                       /* tp_dict */
+    (descrgetfunc)NULL,                                         /* tp_descr_get */
+    (descrsetfunc)NULL,                                         /* tp_descr_set */
+    0,                                                          /* tp_dictoffset */
+    (initproc)PyPropertyTree_Query__tp_init,                    /* tp_init */
+    (allocfunc)PyType_GenericAlloc,                             /* tp_alloc */
+    (newfunc)PyType_GenericNew,                                 /* tp_new */
+    (freefunc)0,                                                /* tp_free */
+    (inquiry)NULL,                                              /* tp_is_gc */
+    NULL,                                                       /* tp_bases */
+    NULL,                                                       /* tp_mro */
+    NULL,                                                       /* tp_cache */
+    NULL,                                                       /* tp_subclasses */
+    NULL,                                                       /* tp_weaklist */
+    (destructor) NULL                                           /* tp_del */
+};
+
+
+static PyObject*
+PyPropertyTree_Predicate_New(std::shared_ptr<const query_filter> filter)
+{
+    PyPropertyTree_Predicate *predicate;
+
+    predicate = PyObject_New(PyPropertyTree_Predicate, &PyPropertyTree_PredicateType);
+    predicate->filter = new std::shared_ptr<const query_filter>(filter);
+
+    return (PyObject*)predicate;
+}
+
+
+static int
+py_value_to_literal(PyObject *value, query_literal &literal)
+{
+    if (value == Py_None) {
+        literal.type = query_literal::NONE;
+    } else if (PyBool_Check(value)) {
+        literal.type = query_literal::BOOLEAN;
+        literal.boolean = (value == Py_True);
+    } else if (PyLong_Check(value) || PyFloat_Check(value)) {
+        literal.type = query_literal::NUMBER;
+        literal.number = PyFloat_AsDouble(value);
+        if (PyErr_Occurred())
+            return -1;
+    } else if (PyUnicode_Check(value)) {
+        Py_ssize_t value_len;
+        const char *value_str = PyUnicode_AsUTF8AndSize(value, &value_len);
+        literal.type = query_literal::STRING;
+        literal.str = std::string(value_str, value_len);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+
+/* only the plain field returned by where() can be compared */
+static const query_filter*
+PyPropertyTree_Predicate_Field(PyPropertyTree_Predicate *self)
+{
+    const query_filter *filter = self->filter->get();
+
+    if (filter->op != query_filter::EXISTS) {
+        PyErr_SetString(PyExc_TypeError, "only a where() field can be compared");
+        return NULL;
+    }
+
+    return filter;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_Predicate_contains__doc__,
+"contains(str) -> Predicate\n\n"
+"    Return a predicate that is true if the value of the field contains str.\n");
+
+
+static PyObject*
+PyPropertyTree_Predicate_contains(PyPropertyTree_Predicate *self, PyObject *arg)
+{
+    const query_filter *field;
+    std::shared_ptr<query_filter> filter;
+
+    if (!PyUnicode_Check(arg)) {
+        PyErr_SetString(PyExc_TypeError, "argument not a string");
+        return NULL;
+    }
+
+    if ((field = PyPropertyTree_Predicate_Field(self)) == NULL) {
+        return NULL;
+    }
+
+    filter = std::make_shared<query_filter>();
+    filter->op = query_filter::CONTAINS;
+    filter->field = field->field;
+    py_value_to_literal(arg, filter->literal);
+
+    return PyPropertyTree_Predicate_New(filter);
+}
+
+
+static PyMethodDef PyPropertyTree_Predicate_methods[] = {
+    {(char *) "contains",
+     (PyCFunction) PyPropertyTree_Predicate_contains,
+     METH_O,
+     PyPropertyTree_Predicate_contains__doc__},
+    {NULL, NULL, 0, NULL}
+};
+
+
+static PyObject*
+PyPropertyTree_Predicate__tp_richcompare(PyPropertyTree_Predicate *self, PyObject *other, int op)
+{
+    // indexed by Py_LT, Py_LE, Py_EQ, Py_NE, Py_GT, Py_GE
+    static const query_filter::filter_op operators[] = {
+        query_filter::LT, query_filter::LE, query_filter::EQ,
+        query_filter::NE, query_filter::GT, query_filter::GE,
+    };
+
+    const query_filter *field;
+    std::shared_ptr<query_filter> filter = std::make_shared<query_filter>();
+
+    if (py_value_to_literal(other, filter->literal) < 0) {
+        if (PyErr_Occurred())
+            return NULL;
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    if ((field = PyPropertyTree_Predicate_Field(self)) == NULL) {
+        return NULL;
+    }
+
+    filter->op = operators[op];
+    filter->field = field->field;
+
+    return PyPropertyTree_Predicate_New(filter);
+}
+
+
+static int
+PyPropertyTree_Predicate__nb_bool(PyPropertyTree_Predicate *Py_UNUSED(self))
+{
+    PyErr_SetString(PyExc_TypeError, "the truth value of a Predicate is ambiguous, combine them with & | ~");
+    return -1;
+}
+
+
+/* Fails with RecursionError for a filter nested too deeply to evaluate */
+static int
+PyPropertyTree_Predicate_CheckDepth(const query_filter &filter)
+{
+    if (filter.depth > QUERY_MAX_DEPTH) {
+        PyErr_SetString(PyExc_RecursionError, "predicate nested too deeply");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static PyObject*
+PyPropertyTree_Predicate__nb_invert(PyPropertyTree_Predicate *self)
+{
+    std::shared_ptr<query_filter> filter = std::make_shared<query_filter>();
+
+    filter->op = query_filter::NOT;
+    filter->lhs = *self->filter;
+    filter->depth = 1 + filter->lhs->depth;
+
+    if (PyPropertyTree_Predicate_CheckDepth(*filter) < 0)
+        return NULL;
+
+    return PyPropertyTree_Predicate_New(filter);
+}
+
+
+static PyObject*
+PyPropertyTree_Predicate_Combine(PyObject *py_left, PyObject *py_right, query_filter::filter_op op)
+{
+    std::shared_ptr<query_filter> filter;
+
+    if (!PyObject_IsInstance(py_left, (PyObject*) &PyPropertyTree_PredicateType) ||
+        !PyObject_IsInstance(py_right, (PyObject*) &PyPropertyTree_PredicateType)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    filter = std::make_shared<query_filter>();
+    filter->op = op;
+    filter->lhs = *((PyPropertyTree_Predicate *)py_left)->filter;
+    filter->rhs = *((PyPropertyTree_Predicate *)py_right)->filter;
+    filter->depth = 1 + std::max(filter->lhs->depth, filter->rhs->depth);
+
+    if (PyPropertyTree_Predicate_CheckDepth(*filter) < 0)
+        return NULL;
+
+    return PyPropertyTree_Predicate_New(filter);
+}
+
+
+static PyObject*
+PyPropertyTree_Predicate__nb_and(PyObject *py_left, PyObject *py_right)
+{
+    return PyPropertyTree_Predicate_Combine(py_left, py_right, query_filter::AND);
+}
+
+
+static PyObject*
+PyPropertyTree_Predicate__nb_or(PyObject *py_left, PyObject *py_right)
+{
+    return PyPropertyTree_Predicate_Combine(py_left, py_right, query_filter::OR);
+}
+
+
+static PyNumberMethods PyPropertyTree_Predicate__tp_as_number = {
+    (binaryfunc)  NULL,                                         /* nb_add */
+    (binaryfunc)  NULL,                                         /* nb_subtract */
+    (binaryfunc)  NULL,                                         /* nb_multiply */
+    (binaryfunc)  NULL,                                         /* nb_remainder */
+    (binaryfunc)  NULL,                                         /* nb_divmod */
+    (ternaryfunc) NULL,                                         /* nb_power */
+    (unaryfunc)   NULL,                                         /* nb_negative */
+    (unaryfunc)   NULL,                                         /* nb_positive */
+    (unaryfunc)   NULL,                                         /* nb_absolute */
+    (inquiry)     PyPropertyTree_Predicate__nb_bool,            /* nb_bool */
+    (unaryfunc)   PyPropertyTree_Predicate__nb_invert,          /* nb_invert */
+    (binaryfunc)  NULL,                                         /* nb_lshift */
+    (binaryfunc)  NULL,                                         /* nb_rshift */
+    (binaryfunc)  PyPropertyTree_Predicate__nb_and,             /* nb_and */
+    (binaryfunc)  NULL,                                         /* nb_xor */
+    (binaryfunc)  PyPropertyTree_Predicate__nb_or,              /* nb_or */
+    (unaryfunc)   NULL,                                         /* nb_int */
+    (void *)      NULL,                                         /* nb_reserved */
+    (unaryfunc)   NULL,                                         /* nb_float */
+    (binaryfunc)  NULL,                                         /* nb_inplace_add */
+    (binaryfunc)  NULL,                                         /* nb_inplace_subtract */
+    (binaryfunc)  NULL,                                         /* nb_inplace_multiply */
+    (binaryfunc)  NULL,                                         /* nb_inplace_remainder */
+    (ternaryfunc) NULL,                                         /* nb_inplace_power */
+    (binaryfunc)  NULL,                                         /* nb_inplace_lshift */
+    (binaryfunc)  NULL,                                         /* nb_inplace_rshift */
+    (binaryfunc)  NULL,                                         /* nb_inplace_and */
+    (binaryfunc)  NULL,                                         /* nb_inplace_xor */
+    (binaryfunc)  NULL,                                         /* nb_inplace_or */
+    (binaryfunc)  NULL,                                         /* nb_floor_divide */
+    (binaryfunc)  NULL,                                         /* nb_true_divide */
+    (binaryfunc)  NULL,                                         /* nb_inplace_floor_divide */
+    (binaryfunc)  NULL,                                         /* nb_inplace_true_divide */
+    (unaryfunc)   NULL,                                         /* nb_index */
+    (binaryfunc)  NULL,                                         /* nb_matrix_multiply */
+    (binaryfunc)  NULL,                                         /* nb_inplace_matrix_multiply */
+};
+
+
+static void
+PyPropertyTree_Predicate__tp_dealloc(PyPropertyTree_Predicate *self)
+{
+    delete self->filter;
+    self->filter = NULL;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_Predicate__doc__,
+"    A native filter for Tree.search(), created with property_tree.where().\n"
+"    Predicates are combined with & (and), | (or) and ~ (not), nesting them\n"
+"    deeper than 1000 raises RecursionError.\n");
+
+
+PyTypeObject PyPropertyTree_PredicateType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    (char *) "property_tree.Predicate",                         /* tp_name */
+    sizeof(PyPropertyTree_Predicate),                           /* tp_basicsize */
+    0,                                                          /* tp_itemsize */
+    (destructor)PyPropertyTree_Predicate__tp_dealloc,           /* tp_dealloc */
+    (printfunc)0,                                               /* tp_print */
+    (getattrfunc)NULL,                                          /* tp_getattr */
+    (setattrfunc)NULL,                                          /* tp_setattr */
+    (PyAsyncMethods*)NULL,                                      /* tp_compare */
+    (reprfunc)NULL,                                             /* tp_repr */
+    (PyNumberMethods*)&PyPropertyTree_Predicate__tp_as_number,  /* tp_as_number */
+    (PySequenceMethods*)NULL,                                   /* tp_as_sequence */
+    (PyMappingMethods*)NULL,                                    /* tp_as_mapping */
+    (hashfunc)NULL,                                             /* tp_hash */
+    (ternaryfunc)NULL,                                          /* tp_call */
+    (reprfunc)NULL,                                             /* tp_str */
+    (getattrofunc)NULL,                                         /* tp_getattro */
+    (setattrofunc)NULL,                                         /* tp_setattro */
+    (PyBufferProcs*)NULL,                                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                                         /* tp_flags */
+    PyPropertyTree_Predicate__doc__,                            /* Documentation string */
+    (traverseproc)NULL,                                         /* tp_traverse */
+    (inquiry)NULL,                                              /* tp_clear */
+    (richcmpfunc)PyPropertyTree_Predicate__tp_richcompare,      /* tp_richcompare */
+    0,                                                          /* tp_weaklistoffset */
+    (getiterfunc)NULL,                                          /* tp_iter */
+    (iternextfunc)NULL,                                         /* tp_iternext */
+    (struct PyMethodDef*)PyPropertyTree_Predicate_methods,      /* tp_methods */
+    (struct PyMemberDef*)0,                                     /* tp_members */
+    NULL,                                                       /* tp_getset */
+    NULL,                                                       /* tp_base */
+    NULL,                                                       /* tp_dict */
+    (descrgetfunc)NULL,                                         /* tp_descr_get */
+    (descrsetfunc)NULL,                                         /* tp_descr_set */
+    0,                                                          /* tp_dictoffset */
+    (initproc)NULL,                                             /* tp_init */
+    (allocfunc)PyType_GenericAlloc,                             /* tp_alloc */
+    (newfunc)NULL,                                              /* tp_new */
+    (freefunc)0,                                                /* tp_free */
+    (inquiry)NULL,                                              /* tp_is_gc */
+    NULL,                                                       /* tp_bases */
+    NULL,                                                       /* tp_mro */
+    NULL,                                                       /* tp_cache */
+    NULL,                                                       /* tp_subclasses */
+    NULL,                                                       /* tp_weaklist */
+    (destructor) NULL                                           /* tp_del */
+};
+
+
+/* --- extractor --- */
+
+
+struct extractor_field
+{
+    enum field_type {STR, INT, FLOAT, BOOL, TREE, CALL};
+
+    field_type type;
+    std::string path;
+    std::vector<std::string> keys;
+    PyObject *converter;        /* the type or callable given in the spec */
+    PyObject *default_value;    /* NULL if the field is required */
+};
+
+
+static PyObject*
+extractor_convert_error(const extractor_field &field, const std::string &data)
+{
+    PyErr_Format(PyExc_ValueError, "invalid value '%s' for %R at '%s'",
+                 data.c_str(), field.converter, field.path.c_str());
+    return NULL;
+}
+
+
+static PyObject*
+extractor_convert(const extractor_field &field, const boost::property_tree::ptree &node, PyPropertyTree *tree)
+{
+    const std::string &data = node.data();
+
+    switch (field.type) {
+        case extractor_field::STR:
+            return PyUnicode_FromStringAndSize(data.c_str(), data.size());
+
+        case extractor_field::INT: {
+            const char *first = data.c_str();
+            const char *last = first + data.size();
+            long long value;
+
+            if (first != last && *first == '+')
+                ++first;
+
+            std::from_chars_result result = std::from_chars(first, last, value);
+
+            if (first != last && result.ec == std::errc() && result.ptr == last)
+                return PyLong_FromLongLong(value);
+
+            // too large for a long long, or not a number at all
+            if (result.ec == std::errc::result_out_of_range) {
+                char *end;
+                PyObject *retval = PyLong_FromString(data.c_str(), &end, 10);
+
+                if (retval && end == data.c_str() + data.size())
+                    return retval;
+                Py_XDECREF(retval);
+                PyErr_Clear();
+            }
+            return extractor_convert_error(field, data);
+        }
+
+        case extractor_field::FLOAT: {
+            double value;
+
+            if (!ptree_parse_number(data, value))
+                return extractor_convert_error(field, data);
+            return PyFloat_FromDouble(value);
+        }
+
+        case extractor_field::BOOL:
+            if (data == "true" || data == "1")
+                Py_RETURN_TRUE;
+            if (data == "false" || data == "0")
+                Py_RETURN_FALSE;
+            return extractor_convert_error(field, data);
+
+        case extractor_field::TREE:
+            return (PyObject *) PyPropertyTree_New(const_cast<boost::property_tree::ptree *>(&node),
+                                                   PTREE_FLAG_OBJECT_NOT_OWNED, tree);
+
+        case extractor_field::CALL:
+            return PyObject_CallFunction(field.converter, (char *) "s#", data.c_str(), data.size());
+    }
+
+    return NULL;
+}
+
+
+/* Resolve and convert every field of one record, then build the result */
+static PyObject*
+PyPropertyTree_Extractor_extract(PyPropertyTree_Extractor *self, const boost::property_tree::ptree &node,
+                                 PyPropertyTree *tree)
+{
+    // Extractor.__new__() without __init__()
+    if (!self->fields) {
+        PyErr_SetString(PyExc_ValueError, "Extractor has no fields");
+        return NULL;
+    }
+
+    const std::vector<extractor_field> &fields = *self->fields;
+    std::vector<PyObject *> values(fields.size(), NULL);
+    PyObject *retval = NULL;
+    std::size_t i;
+
+    for (i = 0; i < fields.size(); i++) {
+        const boost::property_tree::ptree *target = query_resolve_field(node, fields[i].keys);
+
+        if (target) {
+            values[i] = extractor_convert(fields[i], *target, tree);
+        } else if (fields[i].default_value) {
+            values[i] = fields[i].default_value;
+            Py_INCREF(values[i]);
+        } else {
+            PyErr_SetString(PyExc_KeyError, fields[i].path.c_str());
+        }
+
+        if (!values[i])
+            goto done;
+    }
+
+    if (self->into == Py_None) {
+        if ((retval = PyTuple_New(fields.size()))) {
+            for (i = 0; i < fields.size(); i++) {
+                PyTuple_SET_ITEM(retval, i, values[i]);
+                values[i] = NULL;
             }
-        } else if (PyFloat_Check(other)) {
-            double value = PyFloat_AsDouble(other);
-            switch (op) {
-                case Py_LT:
-                    if (self->obj->get_value<double>() < value)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_LE:
-                    if (self->obj->get_value<double>() <= value)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_EQ:
-                    if (self->obj->get_value<double>() == value)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_NE:
-                    if (self->obj->get_value<double>() != value)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_GE:
-                    if (self->obj->get_value<double>() >= value)
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_GT:
-                    if (self->obj->get_value<double>() > value)
-                        Py_RETURN_TRUE;
+        }
+    } else if (self->into == (PyObject *) &PyDict_Type) {
+        if ((retval = PyDict_New())) {
+            for (i = 0; i < fields.size(); i++) {
+                if (PyDict_SetItem(retval, PyTuple_GET_ITEM(self->names, i), values[i]) < 0) {
+                    Py_CLEAR(retval);
                     break;
+                }
             }
-        } else if (PyUnicode_Check(other)) {
-            Py_ssize_t value_len;
-            const char *value = PyUnicode_AsUTF8AndSize(other, &value_len);
-            switch (op) {
-                case Py_LT:
-                    if (self->obj->data() < std::string(value, value_len))
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_LE:
-                    if (self->obj->data() <= std::string(value, value_len))
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_EQ:
-                    if (self->obj->data() == std::string(value, value_len))
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_NE:
-                    if (self->obj->data() != std::string(value, value_len))
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_GE:
-                    if (self->obj->data() >= std::string(value, value_len))
-                        Py_RETURN_TRUE;
-                    break;
-                case Py_GT:
-                    if (self->obj->data() > std::string(value, value_len))
-                        Py_RETURN_TRUE;
-                    break;
+        }
+    } else {
+        // the field names are passed as keyword arguments
+        retval = PyObject_Vectorcall(self->into, values.data(), 0, self->names);
+    }
+
+done:
+    for (PyObject *value : values)
+        Py_XDECREF(value);
+
+    return retval;
+}
+
+
+static PyObject*
+PyPropertyTree_Extractor__tp_call(PyPropertyTree_Extractor *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *tree;
+    const char *keywords[] = {"tree", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O!:Extractor", (char **) keywords,
+                                     &PyPropertyTree_Type, &tree)) {
+        return NULL;
+    }
+
+    return PyPropertyTree_Extractor_extract(self, *((PyPropertyTree *) tree)->obj, (PyPropertyTree *) tree);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_Extractor_many__doc__,
+"many(trees) -> list\n\n"
+"    Extract every record of an iterable of trees or (key, tree) pairs.\n"
+"    * Given a Tree the records are its children.\n");
+
+
+static PyObject*
+PyPropertyTree_Extractor_many(PyPropertyTree_Extractor *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *trees, *iter, *item, *list;
+    const char *keywords[] = {"trees", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O:many", (char **) keywords, &trees)) {
+        return NULL;
+    }
+
+    if (!(list = PyList_New(0)))
+        return NULL;
+
+    if (PyObject_IsInstance(trees, (PyObject *) &PyPropertyTree_Type)) {
+        for (const boost::property_tree::ptree::value_type &child : *((PyPropertyTree *) trees)->obj) {
+            PyObject *record = PyPropertyTree_Extractor_extract(self, child.second, (PyPropertyTree *) trees);
+
+            if (!record || PyList_Append(list, record) < 0) {
+                Py_XDECREF(record);
+                Py_DECREF(list);
+                return NULL;
+            }
+            Py_DECREF(record);
+        }
+        return list;
+    }
+
+    if (!(iter = PyObject_GetIter(trees))) {
+        Py_DECREF(list);
+        return NULL;
+    }
+
+    while ((item = PyIter_Next(iter))) {
+        PyObject *tree = item, *record = NULL;
+
+        if (PyTuple_Check(item) && PyTuple_GET_SIZE(item) == 2)
+            tree = PyTuple_GET_ITEM(item, 1);
+
+        if (!PyObject_IsInstance(tree, (PyObject *) &PyPropertyTree_Type)) {
+            PyErr_Format(PyExc_TypeError, "expected a Tree, got %R", item);
+        } else {
+            record = PyPropertyTree_Extractor_extract(self, *((PyPropertyTree *) tree)->obj, (PyPropertyTree *) tree);
+        }
+
+        Py_DECREF(item);
+
+        if (!record || PyList_Append(list, record) < 0) {
+            Py_XDECREF(record);
+            Py_DECREF(iter);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(record);
+    }
+
+    Py_DECREF(iter);
+
+    if (PyErr_Occurred()) {
+        Py_DECREF(list);
+        return NULL;
+    }
+
+    return list;
+}
+
+
+static PyMethodDef PyPropertyTree_Extractor_methods[] = {
+    {(char *) "many",
+     (PyCFunction) PyPropertyTree_Extractor_many,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_Extractor_many__doc__},
+    {NULL, NULL, 0, NULL}
+};
+
+
+PyDoc_STRVAR(PyPropertyTree_Extractor_fields__doc__,
+"the names of the extracted fields\n");
+
+
+static PyObject*
+PyPropertyTree_Extractor__get_fields(PyPropertyTree_Extractor *self, void *Py_UNUSED(closure))
+{
+    Py_INCREF(self->names);
+    return self->names;
+}
+
+
+static PyGetSetDef PyPropertyTree_Extractor__getsets[] = {
+    {
+        (char*) "fields",                                        /* attribute name */
+        (getter) PyPropertyTree_Extractor__get_fields,           /* C function to get the attribute */
+        (setter) NULL,                                           /* C function to set the attribute */
+        PyPropertyTree_Extractor_fields__doc__,                  /* optional doc string */
+        NULL                                                     /* optional additional data for getter and setter */
+    },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+
+static int
+PyPropertyTree_Extractor_parse_field(PyObject *name, PyObject *desc, extractor_field &field)
+{
+    PyObject *path = name;
+
+    field.converter = desc;
+    field.default_value = NULL;
+
+    if (!PyUnicode_Check(name)) {
+        PyErr_Format(PyExc_TypeError, "field names must be strings, not %R", name);
+        return -1;
+    }
+
+    if (PyTuple_Check(desc)) {
+        if (PyTuple_GET_SIZE(desc) != 2 && PyTuple_GET_SIZE(desc) != 3) {
+            PyErr_Format(PyExc_TypeError, "field '%U' must be a type, (path, type) or (path, type, default)", name);
+            return -1;
+        }
+
+        path = PyTuple_GET_ITEM(desc, 0);
+        field.converter = PyTuple_GET_ITEM(desc, 1);
+
+        if (PyTuple_GET_SIZE(desc) == 3)
+            field.default_value = PyTuple_GET_ITEM(desc, 2);
+
+        if (!PyUnicode_Check(path)) {
+            PyErr_Format(PyExc_TypeError, "the path of field '%U' must be a string", name);
+            return -1;
+        }
+    }
+
+    if (field.converter == (PyObject *) &PyUnicode_Type) {
+        field.type = extractor_field::STR;
+    } else if (field.converter == (PyObject *) &PyLong_Type) {
+        field.type = extractor_field::INT;
+    } else if (field.converter == (PyObject *) &PyFloat_Type) {
+        field.type = extractor_field::FLOAT;
+    } else if (field.converter == (PyObject *) &PyBool_Type) {
+        field.type = extractor_field::BOOL;
+    } else if (field.converter == (PyObject *) &PyPropertyTree_Type) {
+        field.type = extractor_field::TREE;
+    } else if (PyCallable_Check(field.converter)) {
+        field.type = extractor_field::CALL;
+    } else {
+        PyErr_Format(PyExc_TypeError, "the type of field '%U' must be callable", name);
+        return -1;
+    }
+
+    const char *path_utf8 = PyUnicode_AsUTF8(path);
+
+    if (!path_utf8)
+        return -1;
+
+    field.path = path_utf8;
+    field.keys = ptree_split_path(field.path);
+
+    Py_INCREF(field.converter);
+    Py_XINCREF(field.default_value);
+
+    return 0;
+}
+
+
+static void
+PyPropertyTree_Extractor_clear_fields(PyPropertyTree_Extractor *self)
+{
+    if (self->fields) {
+        for (extractor_field &field : *self->fields) {
+            Py_CLEAR(field.converter);
+            Py_CLEAR(field.default_value);
+        }
+        delete self->fields;
+        self->fields = NULL;
+    }
+}
+
+
+static int
+PyPropertyTree_Extractor__tp_init(PyPropertyTree_Extractor *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *spec, *items, *names, *into = Py_None;
+    std::vector<extractor_field> *fields;
+    const char *keywords[] = {"spec", "into", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O|O:Extractor", (char **) keywords, &spec, &into)) {
+        return -1;
+    }
+
+    if (into != Py_None && !PyCallable_Check(into)) {
+        PyErr_SetString(PyExc_TypeError, "into must be None or callable");
+        return -1;
+    }
+
+    if (!(items = PyMapping_Items(spec)))
+        return -1;
+
+    if (!(names = PyTuple_New(PyList_GET_SIZE(items)))) {
+        Py_DECREF(items);
+        return -1;
+    }
+
+    fields = new std::vector<extractor_field>();
+    fields->reserve(PyList_GET_SIZE(items));
+
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(items); i++) {
+        PyObject *item = PyList_GET_ITEM(items, i);
+        extractor_field field;
+
+        if (PyPropertyTree_Extractor_parse_field(PyTuple_GET_ITEM(item, 0), PyTuple_GET_ITEM(item, 1), field) < 0) {
+            for (extractor_field &parsed : *fields) {
+                Py_DECREF(parsed.converter);
+                Py_XDECREF(parsed.default_value);
             }
+            delete fields;
+            Py_DECREF(names);
+            Py_DECREF(items);
+            return -1;
         }
-    } catch (boost::property_tree::ptree_bad_data const &exc) {
-        PyErr_SetString((PyObject *) PyPropertyTreeBadDataError_Type, exc.what());
-        return NULL;
+
+        fields->push_back(field);
+        Py_INCREF(PyTuple_GET_ITEM(item, 0));
+        PyTuple_SET_ITEM(names, i, PyTuple_GET_ITEM(item, 0));
     }
 
-    Py_RETURN_FALSE;
+    Py_DECREF(items);
+
+    PyPropertyTree_Extractor_clear_fields(self);
+    self->fields = fields;
+
+    Py_XSETREF(self->names, names);
+    Py_INCREF(into);
+    Py_XSETREF(self->into, into);
+
+    return 0;
 }
 
 
 static int
-PyPropertyTree__nb_bool(PyPropertyTree *self)
+PyPropertyTree_Extractor__tp_traverse(PyPropertyTree_Extractor *self, visitproc visit, void *arg)
 {
-    try {
-        return self->obj->get_value<bool>();
-    } catch (boost::property_tree::ptree_bad_data const &exc) {
-        PyErr_SetString((PyObject *) PyPropertyTreeBadDataError_Type, exc.what());
-        return -1;
+    Py_VISIT(self->into);
+
+    if (self->fields) {
+        for (extractor_field &field : *self->fields) {
+            Py_VISIT(field.converter);
+            Py_VISIT(field.default_value);
+        }
     }
+    return 0;
 }
 
 
-static PyObject*
-PyPropertyTree__nb_int(PyPropertyTree *self)
+static int
+PyPropertyTree_Extractor__tp_clear(PyPropertyTree_Extractor *self)
 {
-    try {
-        return PyLong_FromLong(self->obj->get_value<int>());
-    } catch (boost::property_tree::ptree_bad_data const &exc) {
-        PyErr_SetString((PyObject *) PyPropertyTreeBadDataError_Type, exc.what());
-        return NULL;
+    PyPropertyTree_Extractor_clear_fields(self);
+    Py_CLEAR(self->into);
+    Py_CLEAR(self->names);
+    return 0;
+}
+
+
+static void
+PyPropertyTree_Extractor__tp_dealloc(PyPropertyTree_Extractor *self)
+{
+    PyObject_GC_UnTrack(self);
+    PyPropertyTree_Extractor__tp_clear(self);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_Extractor__doc__,
+"Extractor(spec, into=None)\n\n"
+"    Pull the same fields out of many trees, resolving them natively.\n"
+"    * spec maps field names to a type, (path, type) or (path, type, default),\n"
+"      the path defaults to the field name.\n"
+"    * str, int, float, bool and Tree are converted natively, any other\n"
+"      callable is called with the string value.\n"
+"    * A missing field without a default raises a KeyError.\n"
+"    * Records are tuples if into is None, dicts if into is dict, otherwise\n"
+"      into is called with the fields as keyword arguments, e.g. a\n"
+"      dataclass or a namedtuple.\n"
+"    e.g. Extractor({\"id\": int, \"rating\": (\"rating.average\", float, None)}, into=Show)\n");
+
+
+PyTypeObject PyPropertyTree_ExtractorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    (char *) "property_tree.Extractor",                         /* tp_name */
+    sizeof(PyPropertyTree_Extractor),                           /* tp_basicsize */
+    0,                                                          /* tp_itemsize */
+    (destructor)PyPropertyTree_Extractor__tp_dealloc,           /* tp_dealloc */
+    (printfunc)0,                                               /* tp_print */
+    (getattrfunc)NULL,                                          /* tp_getattr */
+    (setattrfunc)NULL,                                          /* tp_setattr */
+    (PyAsyncMethods*)NULL,                                      /* tp_compare */
+    (reprfunc)NULL,                                             /* tp_repr */
+    (PyNumberMethods*)NULL,                                     /* tp_as_number */
+    (PySequenceMethods*)NULL,                                   /* tp_as_sequence */
+    (PyMappingMethods*)NULL,                                    /* tp_as_mapping */
+    (hashfunc)NULL,                                             /* tp_hash */
+    (ternaryfunc)PyPropertyTree_Extractor__tp_call,             /* tp_call */
+    (reprfunc)NULL,                                             /* tp_str */
+    (getattrofunc)NULL,                                         /* tp_getattro */
+    (setattrofunc)NULL,                                         /* tp_setattro */
+    (PyBufferProcs*)NULL,                                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_GC,                      /* tp_flags */
+    PyPropertyTree_Extractor__doc__,                            /* Documentation string */
+    (traverseproc)PyPropertyTree_Extractor__tp_traverse,        /* tp_traverse */
+    (inquiry)PyPropertyTree_Extractor__tp_clear,                /* tp_clear */
+    (richcmpfunc)NULL,                                          /* tp_richcompare */
+    0,                                                          /* tp_weaklistoffset */
+    (getiterfunc)NULL,                                          /* tp_iter */
+    (iternextfunc)NULL,                                         /* tp_iternext */
+    (struct PyMethodDef*)PyPropertyTree_Extractor_methods,      /* tp_methods */
+    (struct PyMemberDef*)0,                                     /* tp_members */
+    PyPropertyTree_Extractor__getsets,                          /* tp_getset */
+    NULL,                                                       /* tp_base */
+    NULL,                                                       /* tp_dict */
+    (descrgetfunc)NULL,                                         /* tp_descr_get */
+    (descrsetfunc)NULL,                                         /* tp_descr_set */
+    0,                                                          /* tp_dictoffset */
+    (initproc)PyPropertyTree_Extractor__tp_init,                /* tp_init */
+    (allocfunc)PyType_GenericAlloc,                             /* tp_alloc */
+    (newfunc)PyType_GenericNew,                                 /* tp_new */
+    (freefunc)0,                                                /* tp_free */
+    (inquiry)NULL,                                              /* tp_is_gc */
+    NULL,                                                       /* tp_bases */
+    NULL,                                                       /* tp_mro */
+    NULL,                                                       /* tp_cache */
+    NULL,                                                       /* tp_subclasses */
+    NULL,                                                       /* tp_weaklist */
+    (destructor) NULL                                           /* tp_del */
+};
+
+
+/* --- group by --- */
+
+
+/* the groups, rebuilt first if the tree changed since they were built */
+static ptree_groups&
+PyPropertyTree_GroupBy_groups(PyPropertyTree_GroupBy *self)
+{
+    unsigned long generation = PyPropertyTree_Generation(self->container);
+
+    if (self->generation != generation) {
+        self->groups->build(*self->container->obj);
+        self->generation = generation;
     }
+
+    return *self->groups;
 }
 
 
 static PyObject*
-PyPropertyTree__nb_float(PyPropertyTree *self)
+PyPropertyTree_GroupBy_members(PyPropertyTree_GroupBy *self, std::size_t group)
 {
-    try {
-        return PyFloat_FromDouble(self->obj->get_value<double>());
-    } catch (boost::property_tree::ptree_bad_data const &exc) {
-        PyErr_SetString((PyObject *) PyPropertyTreeBadDataError_Type, exc.what());
-        return NULL;
+    const std::vector<boost::property_tree::ptree::value_type*> &members = self->groups->members[group];
+    PyObject *list = PyList_New(members.size());
+
+    for (std::size_t i = 0; list && i < members.size(); i++) {
+        PyList_SET_ITEM(list, i, (PyObject*)PyPropertyTree_New(&members[i]->second, PTREE_FLAG_OBJECT_NOT_OWNED, self->container));
     }
+
+    return list;
+}
+
+
+static Py_ssize_t
+PyPropertyTree_GroupBy__mp_length(PyPropertyTree_GroupBy *self)
+{
+    return PyPropertyTree_GroupBy_groups(self).keys.size();
 }
 
 
 static PyObject*
-PyPropertyTree__nb_or(PyObject *py_left, PyObject *py_right)
+PyPropertyTree_GroupBy__mp_subscript(PyPropertyTree_GroupBy *self, PyObject *key)
 {
-    PyPropertyTree *left;
-    PyPropertyTree *right;
-    PyPropertyTree *retval;
+    ptree_groups &groups = PyPropertyTree_GroupBy_groups(self);
+    std::string key_std;
 
-    if (!PyObject_IsInstance(py_left, (PyObject*) &PyPropertyTree_Type) ||
-        !PyObject_IsInstance(py_right, (PyObject*) &PyPropertyTree_Type)) {
-        Py_INCREF(Py_NotImplemented);
-        return Py_NotImplemented;
+    if (py_value_to_string(key, key_std) == 0) {
+        std::unordered_map<std::string, std::size_t>::const_iterator found = groups.index.find(key_std);
+
+        if (found != groups.index.end())
+            return PyPropertyTree_GroupBy_members(self, found->second);
     }
 
-    left = (PyPropertyTree*) py_left;
-    right = (PyPropertyTree*) py_right;
+    PyErr_SetObject(PyExc_KeyError, key);
+    return NULL;
+}
 
-    retval = PyPropertyTree_New(new boost::property_tree::ptree(*left->obj), PTREE_FLAG_NONE);
 
-    for (boost::property_tree::ptree::iterator iter = right->obj->begin(); iter != right->obj->end(); iter++) {
-        retval->obj->put_child(iter->first, iter->second);
+static PyMappingMethods PyPropertyTree_GroupBy__tp_as_mapping = {
+    (lenfunc) PyPropertyTree_GroupBy__mp_length,                /* mp_length */
+    (binaryfunc) PyPropertyTree_GroupBy__mp_subscript,          /* mp_subscript */
+    (objobjargproc) NULL,                                       /* mp_ass_subscript */
+};
+
+
+PyDoc_STRVAR(PyPropertyTree_GroupBy_keys__doc__,
+"keys() -> list\n\n"
+"    Get a list of the distinct values, in the order they were first seen.\n");
+
+
+static PyObject*
+PyPropertyTree_GroupBy_keys(PyPropertyTree_GroupBy *self)
+{
+    const std::vector<std::string> &keys = PyPropertyTree_GroupBy_groups(self).keys;
+    PyObject *list = PyList_New(keys.size());
+
+    for (std::size_t i = 0; list && i < keys.size(); i++) {
+        PyList_SET_ITEM(list, i, PyUnicode_FromStringAndSize(keys[i].c_str(), keys[i].size()));
     }
 
-    return (PyObject*)retval;
+    return list;
 }
 
 
+PyDoc_STRVAR(PyPropertyTree_GroupBy_items__doc__,
+"items() -> list\n\n"
+"    Get a list of the (value, children) pairs.\n");
+
+
 static PyObject*
-PyPropertyTree__nb_inplace_or(PyPropertyTree *self, PyObject *py_right)
+PyPropertyTree_GroupBy_items(PyPropertyTree_GroupBy *self)
 {
-    PyPropertyTree *right;
+    const std::vector<std::string> &keys = PyPropertyTree_GroupBy_groups(self).keys;
+    PyObject *list = PyList_New(keys.size());
 
-    if (!PyObject_IsInstance(py_right, (PyObject*) &PyPropertyTree_Type)) {
-        Py_INCREF(Py_NotImplemented);
-        return Py_NotImplemented;
+    for (std::size_t i = 0; list && i < keys.size(); i++) {
+        PyList_SET_ITEM(list, i, Py_BuildValue((char *) "s#N", keys[i].c_str(), keys[i].size(),
+                                               PyPropertyTree_GroupBy_members(self, i)));
     }
 
-    right = (PyPropertyTree*) py_right;
+    return list;
+}
 
-    for (boost::property_tree::ptree::iterator iter = right->obj->begin(); iter != right->obj->end(); iter++) {
-        self->obj->put_child(iter->first, iter->second);
+
+PyDoc_STRVAR(PyPropertyTree_GroupBy_to_tree__doc__,
+"to_tree() -> Tree\n\n"
+"    Copy the groups into a new tree with a child for each distinct value,\n"
+"    holding copies of the children of the group under their own keys.\n");
+
+
+static PyObject*
+PyPropertyTree_GroupBy_to_tree(PyPropertyTree_GroupBy *self)
+{
+    ptree_groups &groups = PyPropertyTree_GroupBy_groups(self);
+    boost::property_tree::ptree *tree = new boost::property_tree::ptree();
+
+    for (std::size_t i = 0; i < groups.keys.size(); i++) {
+        boost::property_tree::ptree &group = tree->push_back(
+            boost::property_tree::ptree::value_type(groups.keys[i], boost::property_tree::ptree()))->second;
+
+        for (boost::property_tree::ptree::value_type *member : groups.members[i])
+            group.push_back(*member);
     }
 
-    Py_INCREF((PyObject*)self);
-    return (PyObject*)self;
+    return (PyObject*)PyPropertyTree_New(tree, PTREE_FLAG_NONE);
 }
 
 
-static PyNumberMethods PyPropertyTree__tp_as_number = {
-    (binaryfunc)  NULL,                                         /* nb_add */
-    (binaryfunc)  NULL,                                         /* nb_subtract */
-    (binaryfunc)  NULL,                                         /* nb_multiply */
-    (binaryfunc)  NULL,                                         /* nb_remainder */
-    (binaryfunc)  NULL,                                         /* nb_divmod */
-    (ternaryfunc) NULL,                                         /* nb_power */
-    (unaryfunc)   NULL,                                         /* nb_negative */
-    (unaryfunc)   NULL,                                         /* nb_positive */
-    (unaryfunc)   NULL,                                         /* nb_absolute */
-    (inquiry)     PyPropertyTree__nb_bool,                      /* nb_bool */
-    (unaryfunc)   NULL,                                         /* nb_invert */
-    (binaryfunc)  NULL,                                         /* nb_lshift */
-    (binaryfunc)  NULL,                                         /* nb_rshift */
-    (binaryfunc)  NULL,                                         /* nb_and */
-    (binaryfunc)  NULL,                                         /* nb_xor */
-    (binaryfunc)  PyPropertyTree__nb_or,                        /* nb_or */
-    (unaryfunc)   PyPropertyTree__nb_int,                       /* nb_int */
-    (void *)      NULL,                                         /* nb_reserved */
-    (unaryfunc)   PyPropertyTree__nb_float,                     /* nb_float */
-    (binaryfunc)  NULL,                                         /* nb_inplace_add */
-    (binaryfunc)  NULL,                                         /* nb_inplace_subtract */
-    (binaryfunc)  NULL,                                         /* nb_inplace_multiply */
-    (binaryfunc)  NULL,                                         /* nb_inplace_remainder */
-    (ternaryfunc) NULL,                                         /* nb_inplace_power */
-    (binaryfunc)  NULL,                                         /* nb_inplace_lshift */
-    (binaryfunc)  NULL,                                         /* nb_inplace_rshift */
-    (binaryfunc)  NULL,                                         /* nb_inplace_and */
-    (binaryfunc)  NULL,                                         /* nb_inplace_xor */
-    (binaryfunc)  PyPropertyTree__nb_inplace_or,                /* nb_inplace_or */
-    (binaryfunc)  NULL,                                         /* nb_floor_divide */
-    (binaryfunc)  NULL,                                         /* nb_true_divide */
-    (binaryfunc)  NULL,                                         /* nb_inplace_floor_divide */
-    (binaryfunc)  NULL,                                         /* nb_inplace_true_divide */
-    (unaryfunc)   NULL,                                         /* nb_index */
-    (binaryfunc)  NULL,                                         /* nb_matrix_multiply */
-    (binaryfunc)  NULL,                                         /* nb_inplace_matrix_multiply */
+static PyMethodDef PyPropertyTree_GroupBy_methods[] = {
+    {(char *) "items",
+     (PyCFunction) PyPropertyTree_GroupBy_items,
+     METH_NOARGS,
+     PyPropertyTree_GroupBy_items__doc__},
+    {(char *) "keys",
+     (PyCFunction) PyPropertyTree_GroupBy_keys,
+     METH_NOARGS,
+     PyPropertyTree_GroupBy_keys__doc__},
+    {(char *) "to_tree",
+     (PyCFunction) PyPropertyTree_GroupBy_to_tree,
+     METH_NOARGS,
+     PyPropertyTree_GroupBy_to_tree__doc__},
+    {NULL, NULL, 0, NULL}
 };
 
 
-static Py_ssize_t
-PyPropertyTree_mp_length(PyObject *self)
+static PyObject*
+PyPropertyTree_GroupBy__tp_iter(PyPropertyTree_GroupBy *self)
 {
-    return ((PyPropertyTree*)self)->obj->size();
+    PyObject *keys = PyPropertyTree_GroupBy_keys(self);
+    PyObject *iter = keys ? PyObject_GetIter(keys) : NULL;
+
+    Py_XDECREF(keys);
+    return iter;
 }
 
 
-static PyObject *
-PyPropertyTree_mp_subscript(PyObject *self, PyObject *key)
+static int
+PyPropertyTree_GroupBy__tp_traverse(PyPropertyTree_GroupBy *self, visitproc visit, void *arg)
 {
-    const char *path;
-    Py_ssize_t path_len;
-    boost::property_tree::ptree *retval;
-    boost::property_tree::ptree *tree = ((PyPropertyTree*)self)->obj;
+    Py_VISIT((PyObject *) self->container);
+    return 0;
+}
 
-    if (PyIndex_Check(key)) {
-        int index = PyLong_AsSsize_t(key);
 
-        if (index < 0)
-            index += (Py_ssize_t)tree->size();
+static int
+PyPropertyTree_GroupBy__tp_clear(PyPropertyTree_GroupBy *self)
+{
+    Py_CLEAR(self->container);
+    return 0;
+}
 
-        if (index >= 0 && index < (Py_ssize_t)tree->size()) {
-            boost::property_tree::ptree::iterator iter(tree->begin());
 
-            for (Py_ssize_t i = 0; i < index; i++)
-                ++iter;
+static void
+PyPropertyTree_GroupBy__tp_dealloc(PyPropertyTree_GroupBy *self)
+{
+    Py_CLEAR(self->container);
+    delete self->groups;
+    self->groups = NULL;
+
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_GroupBy__doc__,
+"    The children of a tree grouped by a value, created with Tree.group_by().\n"
+"    Maps each distinct value to the list of children with that value.\n");
+
+
+PyTypeObject PyPropertyTree_GroupByType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    (char *) "property_tree.GroupBy",                           /* tp_name */
+    sizeof(PyPropertyTree_GroupBy),                             /* tp_basicsize */
+    0,                                                          /* tp_itemsize */
+    (destructor)PyPropertyTree_GroupBy__tp_dealloc,             /* tp_dealloc */
+    (printfunc)0,                                               /* tp_print */
+    (getattrfunc)NULL,                                          /* tp_getattr */
+    (setattrfunc)NULL,                                          /* tp_setattr */
+    (PyAsyncMethods*)NULL,                                      /* tp_compare */
+    (reprfunc)NULL,                                             /* tp_repr */
+    (PyNumberMethods*)NULL,                                     /* tp_as_number */
+    (PySequenceMethods*)NULL,                                   /* tp_as_sequence */
+    (PyMappingMethods*)&PyPropertyTree_GroupBy__tp_as_mapping,  /* tp_as_mapping */
+    (hashfunc)NULL,                                             /* tp_hash */
+    (ternaryfunc)NULL,                                          /* tp_call */
+    (reprfunc)NULL,                                             /* tp_str */
+    (getattrofunc)NULL,                                         /* tp_getattro */
+    (setattrofunc)NULL,                                         /* tp_setattro */
+    (PyBufferProcs*)NULL,                                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_GC,                      /* tp_flags */
+    PyPropertyTree_GroupBy__doc__,                              /* Documentation string */
+    (traverseproc)PyPropertyTree_GroupBy__tp_traverse,          /* tp_traverse */
+    (inquiry)PyPropertyTree_GroupBy__tp_clear,                  /* tp_clear */
+    (richcmpfunc)NULL,                                          /* tp_richcompare */
+    0,                                                          /* tp_weaklistoffset */
+    (getiterfunc)PyPropertyTree_GroupBy__tp_iter,               /* tp_iter */
+    (iternextfunc)NULL,                                         /* tp_iternext */
+    (struct PyMethodDef*)PyPropertyTree_GroupBy_methods,        /* tp_methods */
+    (struct PyMemberDef*)0,                                     /* tp_members */
+    NULL,                                                       /* tp_getset */
+    NULL,                                                       /* tp_base */
+    NULL,                                                       /* tp_dict */
+    (descrgetfunc)NULL,                                         /* tp_descr_get */
+    (descrsetfunc)NULL,                                         /* tp_descr_set */
+    0,                                                          /* tp_dictoffset */
+    (initproc)NULL,                                             /* tp_init */
+    (allocfunc)PyType_GenericAlloc,                             /* tp_alloc */
+    (newfunc)NULL,                                              /* tp_new */
+    (freefunc)0,                                                /* tp_free */
+    (inquiry)NULL,                                              /* tp_is_gc */
+    NULL,                                                       /* tp_bases */
+    NULL,                                                       /* tp_mro */
+    NULL,                                                       /* tp_cache */
+    NULL,                                                       /* tp_subclasses */
+    NULL,                                                       /* tp_weaklist */
+    (destructor) NULL                                           /* tp_del */
+};
+
 
-            return (PyObject*)PyPropertyTree_New(&iter->second, PTREE_FLAG_OBJECT_NOT_OWNED);
-        }
+/* --- value index --- */
 
-        PyErr_Format(PyExc_IndexError, "%s index out of range", Py_TYPE(self)->tp_name);
-        return NULL;
 
-    } else if (!PyUnicode_Check(key)) {
-        PyErr_SetObject(PyExc_KeyError, key);
-        return NULL;
-    }
+void
+ptree_value_index::build(boost::property_tree::ptree &root, const query_plan &plan)
+{
+    std::vector<const boost::property_tree::ptree*> values;
+    std::vector<boost::property_tree::ptree*> records;
 
-    path = PyUnicode_AsUTF8AndSize(key, &path_len);
+    table.clear();
+    plan.eval_field(root, values, &records);
 
-    try {
-        retval = &tree->get_child(std::string(path, path_len));
-    } catch (boost::property_tree::ptree_bad_path const &exc) {
-        PyErr_SetObject(PyExc_KeyError, key);
-        return NULL;
+    for (std::size_t i = 0; i < values.size(); i++) {
+        if (values[i])
+            table[values[i]->data()].push_back(records[i]);
     }
-
-    return (PyObject*)PyPropertyTree_New(retval, PTREE_FLAG_OBJECT_NOT_OWNED);
 }
 
 
-static int
-PyPropertyTree_mp_ass_subscript(PyObject *self, PyObject *key, PyObject *value)
+/* the table, rebuilt first if the tree changed since it was built */
+static ptree_value_index&
+PyPropertyTree_Index_table(PyPropertyTree_Index *self)
 {
-    std::string path_std;
-    std::string value_std;
-    boost::property_tree::ptree *tree = ((PyPropertyTree*)self)->obj;
-
-    if (PyIndex_Check(key)) {
-        int index = PyLong_AsSsize_t(key);
+    unsigned long generation = PyPropertyTree_Generation(self->container);
 
-        if (index < 0)
-            index += (Py_ssize_t)tree->size();
+    if (self->generation != generation) {
+        self->table->build(*self->container->obj, *self->query->plan);
+        self->generation = generation;
+    }
 
-        if (index >= 0 && index < (Py_ssize_t)tree->size()) {
-            boost::property_tree::ptree::iterator iter(tree->begin());
+    return *self->table;
+}
 
-            for (Py_ssize_t i = 0; i < index; i++)
-                ++iter;
 
-            path_std = iter->first;
-        } else {
-            PyErr_Format(PyExc_IndexError, "%s index out of range", Py_TYPE(self)->tp_name);
-            return -1;
-        }
+/* the records with the given value, NULL if there are none */
+static const std::vector<boost::property_tree::ptree*>*
+PyPropertyTree_Index_find(PyPropertyTree_Index *self, PyObject *key)
+{
+    ptree_value_index &index = PyPropertyTree_Index_table(self);
+    std::string key_std;
 
-    } else if (PyUnicode_Check(key)) {
-        Py_ssize_t path_len;
-        const char *path = PyUnicode_AsUTF8AndSize(key, &path_len);
-        path_std = std::string(path, path_len);
-    } else {
-        PyErr_SetObject(PyExc_KeyError, key);
-        return -1;
-    }
+    if (py_value_to_string(key, key_std) == 0) {
+        std::unordered_map<std::string, std::vector<boost::property_tree::ptree*> >::const_iterator
+            found = index.table.find(key_std);
 
-    if (value == NULL) {
-        for (boost::property_tree::ptree::iterator iter = tree->begin(); iter != tree->end(); iter++) {
-            if (iter->first == path_std) {
-                tree->erase(iter);
-                return 0;
-            }
-        }
-        PyErr_SetObject(PyExc_KeyError, key);
-        return -1;
-    } else {
-        if (PyObject_IsInstance(value, (PyObject *) &PyPropertyTree_Type)) {
-            tree->put_child(path_std, *(((PyPropertyTree*)value)->obj));
-        } else if (py_value_to_string(value, value_std) == 0) {
-            boost::property_tree::ptree value_tree(value_std);
-            tree->put_child(path_std, value_tree);
-        } else {
-            PyErr_SetObject(PyExc_ValueError, value);
-            return -1;
-        }
+        if (found != index.table.end())
+            return &found->second;
     }
 
-    return 0;
+    return NULL;
 }
 
 
-static PyMappingMethods PyPropertyTree_as_mapping = {
-    PyPropertyTree_mp_length,
-    PyPropertyTree_mp_subscript,
-    PyPropertyTree_mp_ass_subscript,
-};
-
-
-static int
-PyPropertyTree__sq_contains(PyPropertyTree *self, PyObject *py_value)
+static Py_ssize_t
+PyPropertyTree_Index__mp_length(PyPropertyTree_Index *self)
 {
-    if (PyUnicode_Check(py_value)) {
-        Py_ssize_t value_len;
-        const char *value = PyUnicode_AsUTF8AndSize(py_value, &value_len);
+    return PyPropertyTree_Index_table(self).table.size();
+}
 
-        if (value == NULL || PyErr_Occurred()) {
-            PyErr_Clear();
-            return 0;
-        }
 
-        std::string str(value, value_len);
+static PyObject*
+PyPropertyTree_Index__mp_subscript(PyPropertyTree_Index *self, PyObject *key)
+{
+    const std::vector<boost::property_tree::ptree*> *records = PyPropertyTree_Index_find(self, key);
 
-        // check the keys first then check the data string
-        return (self->obj->find(str) != self->obj->not_found()) ||
-               (self->obj->data().find(str) != std::string::npos);
+    if (!records) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
 
-    } else if (PyObject_IsInstance(py_value, (PyObject*)&PyPropertyTree_Type)) {
-        const std::string &value = ((PyPropertyTree*)py_value)->obj->data();
+    PyObject *list = PyList_New(records->size());
 
-        return (self->obj->find(value) != self->obj->not_found());
+    for (std::size_t i = 0; list && i < records->size(); i++) {
+        PyList_SET_ITEM(list, i, (PyObject*)PyPropertyTree_New((*records)[i], PTREE_FLAG_OBJECT_NOT_OWNED, self->container));
     }
 
-    return 0;
+    return list;
 }
 
 
-PyObject*
-PyPropertyTree__sq_inplace_concat(PyPropertyTree *self, PyObject *py_value)
+static int
+PyPropertyTree_Index__sq_contains(PyPropertyTree_Index *self, PyObject *key)
 {
-    if (PyObject_IsInstance(py_value, (PyObject*)&PyPropertyTree_Type)) {
-        PyPropertyTree *value = (PyPropertyTree*)py_value;
-
-        self->obj->insert(self->obj->end(), value->obj->begin(), value->obj->end());
-
-        Py_INCREF(self);
+    return PyPropertyTree_Index_find(self, key) != NULL;
+}
 
-        return (PyObject*)self;
-    }
 
-    PyErr_Format(PyExc_TypeError, "unsupported operand type(s) for +=: '%s' and '%s'",
-                                  Py_TYPE(self)->tp_name, Py_TYPE(py_value)->tp_name);
-    return NULL;
-}
+static PyMappingMethods PyPropertyTree_Index__tp_as_mapping = {
+    (lenfunc) PyPropertyTree_Index__mp_length,                  /* mp_length */
+    (binaryfunc) PyPropertyTree_Index__mp_subscript,            /* mp_subscript */
+    (objobjargproc) NULL,                                       /* mp_ass_subscript */
+};
 
 
-static PySequenceMethods PyPropertyTree__tp_as_sequence = {
+static PySequenceMethods PyPropertyTree_Index__tp_as_sequence = {
     (lenfunc) NULL,                                             /* sq_length */
     (binaryfunc) NULL,                                          /* sq_concat */
     (ssizeargfunc) NULL,                                        /* sq_repeat */
     (ssizeargfunc) NULL,                                        /* sq_item */
-    NULL,
+    NULL,                                                       /* sq_slice */
     (ssizeobjargproc) NULL,                                     /* sq_ass_item */
-    NULL,
-    (objobjproc) PyPropertyTree__sq_contains,                   /* sq_contains */
-    (binaryfunc) PyPropertyTree__sq_inplace_concat,             /* sq_inplace_concat */
+    NULL,                                                       /* sq_ass_slice */
+    (objobjproc) PyPropertyTree_Index__sq_contains,             /* sq_contains */
+    (binaryfunc) NULL,                                          /* sq_inplace_concat */
     (ssizeargfunc) NULL,                                        /* sq_inplace_repeat */
 };
 
 
-static PyObject*
-PyPropertyTree__tp_iter(PyPropertyTree *self)
-{
-    PyPropertyTree_Iter *iter;
-
-    iter = PyObject_GC_New(PyPropertyTree_Iter, &PyPropertyTree_IterType);
-    Py_INCREF(self);
-    iter->container = self;
-    iter->iterator = new boost::property_tree::ptree::iterator(self->obj->begin());
-    iter->callable = NULL;
-
-    return (PyObject*)iter;
-}
+PyDoc_STRVAR(PyPropertyTree_Index_get__doc__,
+"get(value, default=None) -> Tree\n\n"
+"    Return the first record with the given value, else default.\n");
 
 
 static PyObject*
-PyPropertyTree__tp_str(PyPropertyTree *self)
-{
-    return PyUnicode_DecodeUTF8(self->obj->data().c_str(), self->obj->data().size(), NULL);
-}
-
-
-static int
-PyPropertyTree__tp_init(PyPropertyTree *self, PyObject *args, PyObject *kwargs)
+PyPropertyTree_Index_get(PyPropertyTree_Index *self, PyObject *args, PyObject *kwargs)
 {
-    PyObject *key, *value = NULL;
-    std::string value_std;
+    PyObject *key, *py_default = Py_None;
+    const char *keywords[] = {"value", "default", NULL};
 
-    // dict style keyword constructor
-    // t = Tree(a=1, b=2, c=3)
-    // len(t)                        -> 3
-    // t.keys()                      -> ['a', 'b', 'c']
-    // [v.value for v in t.values()] -> ['1', '2', '3']
-    if (kwargs != NULL && PyTuple_GET_SIZE(args) == 0 && PyArg_ValidateKeywordArguments(kwargs)) {
-        Py_ssize_t pos = 0;
-        self->obj = new boost::property_tree::ptree();
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O|O:get", (char **) keywords, &key, &py_default)) {
+        return NULL;
+    }
 
-        while (PyDict_Next(kwargs, &pos, &key, &value)) {
-            Py_ssize_t key_len;
-            const char *c_key = PyUnicode_AsUTF8AndSize(key, &key_len);
+    const std::vector<boost::property_tree::ptree*> *records = PyPropertyTree_Index_find(self, key);
 
-            if (PyObject_IsInstance(value, (PyObject *) &PyPropertyTree_Type)) {
-                self->obj->push_back({std::string(c_key, key_len), *((PyPropertyTree *)value)->obj});
-            } else if (py_value_to_string(value, value_std) == 0) {
-                boost::property_tree::ptree tree(value_std);
-                self->obj->push_back({std::string(c_key, key_len), tree});
-            } else {
-                PyErr_SetObject(PyExc_ValueError, value);
-                return -1;
-            }
-        }
-    // regular t = Tree("foo") value constructor
-    } else if (PyArg_ParseTuple(args, (char *) "|O", &value)) {
-        if (kwargs != NULL) {
-            PyErr_Format(PyExc_TypeError, "Tree() doesn't support mixed keyword/value args");
-            return -1;
-        }
-        if (value) {
-            if (PyObject_IsInstance(value, (PyObject*)&PyPropertyTree_Type)) {
-                self->obj = new boost::property_tree::ptree(*((PyPropertyTree*)value)->obj);
-            } else if (py_value_to_string(value, value_std) == 0) {
-                self->obj = new boost::property_tree::ptree(value_std);
-            } else {
-                PyErr_Format(PyExc_TypeError, "unsupported argument type: '%s'", Py_TYPE(value)->tp_name);
-                return -1;
-            }
-        } else {
-            self->obj = new boost::property_tree::ptree();
-        }
-    } else {
-        return -1;
+    if (!records) {
+        Py_INCREF(py_default);
+        return py_default;
     }
 
-    self->flags = PTREE_FLAG_NONE;
-    return 0;
+    return (PyObject*)PyPropertyTree_New(records->front(), PTREE_FLAG_OBJECT_NOT_OWNED, self->container);
 }
 
 
-static void
-PyPropertyTree__tp_dealloc(PyPropertyTree *self)
-{
-    boost::property_tree::ptree *tmp = self->obj;
-    self->obj = NULL;
-    if (!(self->flags & PTREE_FLAG_OBJECT_NOT_OWNED)) {
-        delete tmp;
-    }
-    Py_TYPE(self)->tp_free((PyObject*)self);
-}
+static PyMethodDef PyPropertyTree_Index_methods[] = {
+    {(char *) "get",
+     (PyCFunction) PyPropertyTree_Index_get,
+     METH_KEYWORDS|METH_VARARGS,
+     PyPropertyTree_Index_get__doc__},
+    {NULL, NULL, 0, NULL}
+};
 
 
-static PyObject*
-PyPropertyTree__tp_getattro(PyPropertyTree *self, PyObject *name)
+static int
+PyPropertyTree_Index__tp_traverse(PyPropertyTree_Index *self, visitproc visit, void *arg)
 {
-    // do normal lookup first so we don't break stuff like function calls
-    PyObject *attr = PyObject_GenericGetAttr((PyObject*)self, name);
-
-    if (attr)
-        return attr;
-
-    // PyObject_GenericGetAttr() didn't find anything look, in the children
-    if (PyErr_Occurred() && PyErr_ExceptionMatches(PyExc_AttributeError)) {
-
-        boost::property_tree::ptree *retval;
-        Py_ssize_t key_len;
-        const char *key = PyUnicode_AsUTF8AndSize(name, &key_len); // assume python already checked the type
-
-        try {
-            retval = &self->obj->get_child(std::string(key, key_len));
-        } catch (boost::property_tree::ptree_bad_path const &exc) {
-            /* rethrow AttributeError */
-            return NULL;
-        }
-
-        PyErr_Clear(); // found a child, clear the exception
-
-        return (PyObject*)PyPropertyTree_New(retval, PTREE_FLAG_OBJECT_NOT_OWNED);
-    }
-
-    /* keep whatever exception python threw */
-    return NULL;
+    Py_VISIT((PyObject *) self->container);
+    Py_VISIT((PyObject *) self->query);
+    return 0;
 }
 
 
 static int
-PyPropertyTree__tp_setattro(PyPropertyTree *self, PyObject *name, PyObject *value)
+PyPropertyTree_Index__tp_clear(PyPropertyTree_Index *self)
 {
-    // do normal lookup first -- might not even be needed...
-    if (PyObject_GenericSetAttr((PyObject*)self, name, value) == 0)
-        return 0;
+    Py_CLEAR(self->container);
+    Py_CLEAR(self->query);
+    return 0;
+}
 
-    if (PyErr_Occurred() && PyErr_ExceptionMatches(PyExc_AttributeError)) {
-        Py_ssize_t key_len;
-        const char *key = PyUnicode_AsUTF8AndSize(name, &key_len);
-        std::string value_std, key_std(key, key_len);
 
-        if (PyObject_IsInstance(value, (PyObject *) &PyPropertyTree_Type)) {
-            self->obj->put_child(key_std, *(((PyPropertyTree *)value)->obj));
-        } else if (py_value_to_string(value, value_std) == 0) {
-            boost::property_tree::ptree tree(value_std);
-            self->obj->put_child(key_std, tree);
-        } else {
-            PyErr_Clear();
-            PyErr_SetObject(PyExc_ValueError, value);
-            return -1;
-        }
-        PyErr_Clear();
-        return 0;
-    }
+static void
+PyPropertyTree_Index__tp_dealloc(PyPropertyTree_Index *self)
+{
+    Py_CLEAR(self->container);
+    Py_CLEAR(self->query);
+    delete self->table;
+    self->table = NULL;
 
-    /* keep whatever exception python threw */
-    return -1;
+    Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
 
-PyDoc_STRVAR(PyPropertyTree__doc__,
-"    Property tree main structure.\n"
-"    A property tree is a hierarchical data structure which has one data element\n"
-"    in each node as well as an ordered sequence of sub-nodes which are\n"
-"    additionally identified by a non-unique key.\n");
+PyDoc_STRVAR(PyPropertyTree_Index__doc__,
+"    Records of a tree indexed by the value of a field, created with Tree.build_index().\n"
+"    Maps each value to the list of records with that value.\n");
 
 
-PyTypeObject PyPropertyTree_Type = {
+PyTypeObject PyPropertyTree_IndexType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    (char *) "property_tree.Tree",                              /* tp_name */
-    sizeof(PyPropertyTree),                                     /* tp_basicsize */
+    (char *) "property_tree.Index",                             /* tp_name */
+    sizeof(PyPropertyTree_Index),                               /* tp_basicsize */
     0,                                                          /* tp_itemsize */
-    (destructor)PyPropertyTree__tp_dealloc,                     /* tp_dealloc */
+    (destructor)PyPropertyTree_Index__tp_dealloc,               /* tp_dealloc */
     (printfunc)0,                                               /* tp_print */
     (getattrfunc)NULL,                                          /* tp_getattr */
     (setattrfunc)NULL,                                          /* tp_setattr */
     (PyAsyncMethods*)NULL,                                      /* tp_compare */
     (reprfunc)NULL,                                             /* tp_repr */
-    (PyNumberMethods*)&PyPropertyTree__tp_as_number,            /* tp_as_number */
-    (PySequenceMethods*)&PyPropertyTree__tp_as_sequence,        /* tp_as_sequence */
-    (PyMappingMethods*)&PyPropertyTree_as_mapping,              /* tp_as_mapping */
+    (PyNumberMethods*)NULL,                                     /* tp_as_number */
+    (PySequenceMethods*)&PyPropertyTree_Index__tp_as_sequence,  /* tp_as_sequence */
+    (PyMappingMethods*)&PyPropertyTree_Index__tp_as_mapping,    /* tp_as_mapping */
     (hashfunc)NULL,                                             /* tp_hash */
     (ternaryfunc)NULL,                                          /* tp_call */
-    (reprfunc)PyPropertyTree__tp_str,                           /* tp_str */
-    (getattrofunc)PyPropertyTree__tp_getattro,                  /* tp_getattro */
-    (setattrofunc)PyPropertyTree__tp_setattro,                  /* tp_setattro */
+    (reprfunc)NULL,                                             /* tp_str */
+    (getattrofunc)NULL,                                         /* tp_getattro */
+    (setattrofunc)NULL,                                         /* tp_setattro */
     (PyBufferProcs*)NULL,                                       /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,                                         /* tp_flags */
-    PyPropertyTree__doc__,                                      /* Documentation string */
-    (traverseproc)NULL,                                         /* tp_traverse */
-    (inquiry)NULL,                                              /* tp_clear */
-    (richcmpfunc)PyPropertyTree__tp_richcompare,                /* tp_richcompare */
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_GC,                      /* tp_flags */
+    PyPropertyTree_Index__doc__,                                /* Documentation string */
+    (traverseproc)PyPropertyTree_Index__tp_traverse,            /* tp_traverse */
+    (inquiry)PyPropertyTree_Index__tp_clear,                    /* tp_clear */
+    (richcmpfunc)NULL,                                          /* tp_richcompare */
     0,                                                          /* tp_weaklistoffset */
-    (getiterfunc)PyPropertyTree__tp_iter,                       /* tp_iter */
+    (getiterfunc)NULL,                                          /* tp_iter */
     (iternextfunc)NULL,                                         /* tp_iternext */
-    (struct PyMethodDef*)PyPropertyTree_methods,                /* tp_methods */
+    (struct PyMethodDef*)PyPropertyTree_Index_methods,          /* tp_methods */
     (struct PyMemberDef*)0,                                     /* tp_members */
-    PyPropertyTree__getsets,                                    /* tp_getset */
+    NULL,                                                       /* tp_getset */
     NULL,                                                       /* tp_base */
     NULL,                                                       /* tp_dict */
     (descrgetfunc)NULL,                                         /* tp_descr_get */
     (descrsetfunc)NULL,                                         /* tp_descr_set */
     0,                                                          /* tp_dictoffset */
-    (initproc)PyPropertyTree__tp_init,                          /* tp_init */
+    (initproc)NULL,                                             /* tp_init */
     (allocfunc)PyType_GenericAlloc,                             /* tp_alloc */
-    (newfunc)PyType_GenericNew,                                 /* tp_new */
+    (newfunc)NULL,                                              /* tp_new */
     (freefunc)0,                                                /* tp_free */
     (inquiry)NULL,                                              /* tp_is_gc */
     NULL,                                                       /* tp_bases */
@@ -1692,188 +7565,364 @@ PyTypeObject PyPropertyTree_Type = {
 };
 
 
-static void
-PyPropertyTree_Iter__tp_clear(PyPropertyTree_Iter *self)
+/* --- transactions --- */
+
+
+ptree_undo_state&
+ptree_undo_log::state(boost::property_tree::ptree &node)
 {
-    Py_CLEAR(self->container);
-    delete self->iterator;
-    self->iterator = NULL;
+    std::pair<std::unordered_map<const boost::property_tree::ptree*, std::size_t>::iterator, bool> found =
+        index.insert(std::make_pair(&node, states.size()));
+
+    if (found.second)
+        states.push_back({&node, false, false, std::string(), {}, {}});
+
+    return states[found.first->second];
 }
 
 
-static int
-PyPropertyTree_Iter__tp_traverse(PyPropertyTree_Iter *self, visitproc visit, void *arg)
+void
+ptree_undo_log::save_value(boost::property_tree::ptree &node)
 {
-    Py_VISIT((PyObject *) self->container);
-    return 0;
+    ptree_undo_state &saved = state(node);
+
+    if (!saved.has_value) {
+        saved.value = node.data();
+        saved.has_value = true;
+    }
 }
 
 
-static void
-PyPropertyTree_Iter__tp_dealloc(PyPropertyTree_Iter *self)
+/* Only the addresses of the children are saved, the ones that are still there
+ * are put back in place and their own changes are undone separately */
+void
+ptree_undo_log::save_children(boost::property_tree::ptree &node)
 {
-    Py_CLEAR(self->container);
-    delete self->iterator;
-    self->iterator = NULL;
-    Py_XDECREF(self->callable);
+    ptree_undo_state &saved = state(node);
 
-    Py_TYPE(self)->tp_free((PyObject*)self);
+    if (!saved.has_children) {
+        saved.children.reserve(node.size());
+        for (const boost::property_tree::ptree::value_type &child : node)
+            saved.children.push_back(&child);
+        saved.has_children = true;
+    }
 }
 
 
-static PyObject*
-PyPropertyTree_Iter__tp_iter(PyPropertyTree_Iter *self)
+/* Copy the child as it was when the transaction started. The copy is kept
+ * with the parent, a child moved out keeps its address in its new parent, and
+ * the first one at an address is the one that was there then */
+void
+ptree_undo_log::save_removed(boost::property_tree::ptree &parent, const boost::property_tree::ptree::value_type &child)
 {
-    Py_INCREF(self);
-    return (PyObject*) self;
+    save_children(parent);
+
+    ptree_undo_state &saved = state(parent);
+
+    if (!saved.removed.count(&child)) {
+        std::pair<std::string, boost::property_tree::ptree> &removed = saved.removed[&child];
+
+        removed.first = child.first;
+        copy(child.second, removed.second);
+    }
+
+    forget(child.second);
 }
 
 
-static PyObject*
-PyPropertyTree_Iter__tp_iternext(PyPropertyTree_Iter *self)
+void
+ptree_undo_log::save_content(boost::property_tree::ptree &node)
 {
-    while (1) {
-        boost::property_tree::ptree::iterator iter = *self->iterator;
+    save_value(node);
+    save_children(node);
 
-        if (iter == self->container->obj->end()) {
-            PyErr_SetNone(PyExc_StopIteration);
-            return NULL;
-        }
+    for (const boost::property_tree::ptree::value_type &child : node)
+        save_removed(node, child);
+}
 
-        ++(*self->iterator);
 
-        std::string key = iter->first;
+/* Copy the node as it was when the transaction started, the copies of its
+ * removed children are taken since it is leaving the tree */
+void
+ptree_undo_log::copy(const boost::property_tree::ptree &node, boost::property_tree::ptree &copy)
+{
+    std::unordered_map<const boost::property_tree::ptree*, std::size_t>::const_iterator
+        found = index.find(&node);
+    ptree_undo_state *saved = found != index.end() ? &states[found->second] : NULL;
 
-        PyPropertyTree *py_ptree = PyPropertyTree_New(&iter->second, PTREE_FLAG_OBJECT_NOT_OWNED);
+    copy.data() = saved && saved->has_value ? saved->value : node.data();
 
-        if (self->callable) {
-            PyObject *retval = PyObject_CallFunction(self->callable, (char *) "s#O", key.c_str(), key.size(), py_ptree);
+    if (!saved || !saved->has_children) {
+        for (const boost::property_tree::ptree::value_type &child : node)
+            this->copy(child.second, copy.push_back({child.first, boost::property_tree::ptree()})->second);
+        return;
+    }
 
-            if (!retval) {
-                Py_DECREF(py_ptree);
-                /* keep whatever exception PyObject_CallFunction threw */
-                return NULL;
-            } else if (PyObject_IsTrue(retval)) {
-                Py_DECREF(retval);
-            } else {
-                Py_DECREF(retval);
-                Py_DECREF(py_ptree);
-                continue;
-            }
+    for (const boost::property_tree::ptree::value_type *child : saved->children) {
+        std::unordered_map<const boost::property_tree::ptree::value_type*,
+                           std::pair<std::string, boost::property_tree::ptree> >::iterator
+            gone = saved->removed.find(child);
+
+        if (gone != saved->removed.end()) {
+            copy.push_back({gone->second.first, boost::property_tree::ptree()})->second.swap(gone->second.second);
+        } else {
+            this->copy(child->second, copy.push_back({child->first, boost::property_tree::ptree()})->second);
         }
+    }
+}
 
-        return Py_BuildValue((char *) "s#N", key.c_str(), key.size(), py_ptree);
+
+/* Drop the states of a node leaving the tree and of the nodes inside it */
+void
+ptree_undo_log::forget(const boost::property_tree::ptree &node)
+{
+    if (index.empty())
+        return;
+
+    std::unordered_map<const boost::property_tree::ptree*, std::size_t>::iterator found = index.find(&node);
+
+    if (found != index.end()) {
+        states[found->second].node = NULL;
+        index.erase(found);
     }
+
+    for (const boost::property_tree::ptree::value_type &child : node)
+        forget(child.second);
 }
 
 
-PyTypeObject PyPropertyTree_IterType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    (char *) "property_tree.TreeIter",                          /* tp_name */
-    sizeof(PyPropertyTree_Iter),                                /* tp_basicsize */
-    0,                                                          /* tp_itemsize */
-    (destructor)PyPropertyTree_Iter__tp_dealloc,                /* tp_dealloc */
-    (printfunc)0,                                               /* tp_print */
-    (getattrfunc)NULL,                                          /* tp_getattr */
-    (setattrfunc)NULL,                                          /* tp_setattr */
-    (PyAsyncMethods*)NULL,                                      /* tp_compare */
-    (reprfunc)NULL,                                             /* tp_repr */
-    (PyNumberMethods*)NULL,                                     /* tp_as_number */
-    (PySequenceMethods*)NULL,                                   /* tp_as_sequence */
-    (PyMappingMethods*)NULL,                                    /* tp_as_mapping */
-    (hashfunc)NULL,                                             /* tp_hash */
-    (ternaryfunc)NULL,                                          /* tp_call */
-    (reprfunc)NULL,                                             /* tp_str */
-    (getattrofunc)NULL,                                         /* tp_getattro */
-    (setattrofunc)NULL,                                         /* tp_setattro */
-    (PyBufferProcs*)NULL,                                       /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_GC,                      /* tp_flags */
-    NULL,                                                       /* Documentation string */
-    (traverseproc)PyPropertyTree_Iter__tp_traverse,             /* tp_traverse */
-    (inquiry)PyPropertyTree_Iter__tp_clear,                     /* tp_clear */
-    (richcmpfunc)NULL,                                          /* tp_richcompare */
-    0,                                                          /* tp_weaklistoffset */
-    (getiterfunc)PyPropertyTree_Iter__tp_iter,                  /* tp_iter */
-    (iternextfunc)PyPropertyTree_Iter__tp_iternext,             /* tp_iternext */
-    (struct PyMethodDef*)NULL,                                  /* tp_methods */
-    (struct PyMemberDef*)0,                                     /* tp_members */
-    NULL,                                                       /* tp_getset */
-    NULL,                                                       /* tp_base */
-    NULL,                                                       /* tp_dict */
-    (descrgetfunc)NULL,                                         /* tp_descr_get */
-    (descrsetfunc)NULL,                                         /* tp_descr_set */
-    0,                                                          /* tp_dictoffset */
-    (initproc)NULL,                                             /* tp_init */
-    (allocfunc)PyType_GenericAlloc,                             /* tp_alloc */
-    (newfunc)PyType_GenericNew,                                 /* tp_new */
-    (freefunc)0,                                                /* tp_free */
-    (inquiry)NULL,                                              /* tp_is_gc */
-    NULL,                                                       /* tp_bases */
-    NULL,                                                       /* tp_mro */
-    NULL,                                                       /* tp_cache */
-    NULL,                                                       /* tp_subclasses */
-    NULL,                                                       /* tp_weaklist */
-    (destructor) NULL                                           /* tp_del */
-};
+/* Put the value and the children of the node back. The children that are
+ * still there keep their place, so their views still see them, the removed
+ * ones are added back from their copies and the ones added since are erased */
+void
+ptree_undo_log::restore(ptree_undo_state &saved)
+{
+    boost::property_tree::ptree &node = *saved.node;
 
+    if (saved.has_value)
+        node.data().swap(saved.value);
 
-static void
-PyPropertyTree_AssocIter__tp_clear(PyPropertyTree_AssocIter *self)
+    if (!saved.has_children)
+        return;
+
+    std::vector<const boost::property_tree::ptree::value_type*> &children = saved.children;
+
+    for (const boost::property_tree::ptree::value_type *&child : children) {
+        std::unordered_map<const boost::property_tree::ptree::value_type*,
+                           std::pair<std::string, boost::property_tree::ptree> >::iterator
+            gone = saved.removed.find(child);
+
+        if (gone != saved.removed.end()) {
+            boost::property_tree::ptree::iterator added =
+                node.push_back({gone->second.first, boost::property_tree::ptree()});
+
+            added->second.swap(gone->second.second);
+            child = &*added;
+        }
+    }
+
+    // usually the children are still first and in order, with new ones after them
+    boost::property_tree::ptree::iterator tail = node.begin();
+    std::size_t kept = 0;
+
+    while (kept < children.size() && tail != node.end() && &*tail == children[kept]) {
+        ++tail;
+        ++kept;
+    }
+
+    if (kept < children.size()) {
+        std::unordered_map<const boost::property_tree::ptree::value_type*, std::size_t> position;
+        std::vector<std::size_t> order;
+        std::size_t i = 0;
+
+        for (const boost::property_tree::ptree::value_type &child : node)
+            position[&child] = i++;
+
+        order.reserve(node.size());
+        for (const boost::property_tree::ptree::value_type *child : children) {
+            std::unordered_map<const boost::property_tree::ptree::value_type*, std::size_t>::iterator
+                found = position.find(child);
+
+            if (found != position.end()) {
+                order.push_back(found->second);
+                position.erase(found);
+            }
+        }
+        kept = order.size();
+        for (const boost::property_tree::ptree::value_type &child : node) {
+            if (position.count(&child))
+                order.push_back(position[&child]);
+        }
+
+        ptree_sort_relink(node, order);
+
+        tail = node.begin();
+        std::advance(tail, kept);
+    }
+
+    while (tail != node.end())
+        tail = node.erase(tail);
+}
+
+
+/* The nodes inside the children added to a node were changed after it, so
+ * going backwards they are put back before those children are erased */
+void
+ptree_undo_log::rollback()
 {
-    Py_CLEAR(self->container);
+    for (std::vector<ptree_undo_state>::reverse_iterator saved = states.rbegin(); saved != states.rend(); ++saved) {
+        if (saved->node)
+            restore(*saved);
+    }
+
+    states.clear();
+    index.clear();
 }
 
 
+/* End the transaction, undoing its changes unless it is committed. The copies
+ * and snapshots of the tree are split off first so they keep what they see */
 static int
-PyPropertyTree_AssocIter__tp_traverse(PyPropertyTree_AssocIter *self, visitproc visit, void *arg)
+PyPropertyTree_Transaction_end(PyPropertyTree_Transaction *self, bool commit)
 {
-    Py_VISIT((PyObject *) self->container);
+    PyPropertyTree *root = self->container;
+    ptree_undo_log *undo = root->undo;
+
+    if (!self->active) {
+        PyErr_SetString(PyExc_RuntimeError, "transaction isn't in progress");
+        return -1;
+    }
+
+    self->active = false;
+    root->undo = NULL;
+
+    if (!commit && !undo->states.empty()) {
+        if (PyPropertyTree_Modified(root) < 0) {
+            delete undo;
+            return -1;
+        }
+        undo->rollback();
+    }
+
+    delete undo;
     return 0;
 }
 
 
-static void
-PyPropertyTree_AssocIter__tp_dealloc(PyPropertyTree_AssocIter *self)
+static PyObject*
+PyPropertyTree_Transaction__enter__(PyPropertyTree_Transaction *self)
 {
-    Py_CLEAR(self->container);
-    Py_TYPE(self)->tp_free((PyObject*)self);
+    if (self->active || self->container->undo) {
+        PyErr_SetString(PyExc_RuntimeError, "a transaction is already in progress on this tree");
+        return NULL;
+    }
+
+    self->container->undo = new ptree_undo_log();
+    self->active = true;
+
+    Py_INCREF(self);
+    return (PyObject*)self;
 }
 
 
 static PyObject*
-PyPropertyTree_AssocIter__tp_iter(PyPropertyTree_AssocIter *self)
+PyPropertyTree_Transaction__exit__(PyPropertyTree_Transaction *self, PyObject *args)
 {
-    Py_INCREF(self);
-    return (PyObject*) self;
+    PyObject *exc_type, *exc_value, *traceback;
+
+    if (!PyArg_ParseTuple(args, (char *) "OOO:__exit__", &exc_type, &exc_value, &traceback)) {
+        return NULL;
+    }
+
+    // ended already by commit() or rollback() inside the with block
+    if (!self->active)
+        Py_RETURN_FALSE;
+
+    if (PyPropertyTree_Transaction_end(self, exc_type == Py_None) < 0)
+        return NULL;
+
+    Py_RETURN_FALSE;
+}
+
+
+PyDoc_STRVAR(PyPropertyTree_Transaction_commit__doc__,
+"commit()\n\n"
+"    Keep the changes made so far and end the transaction.\n");
+
+
+static PyObject*
+PyPropertyTree_Transaction_commit(PyPropertyTree_Transaction *self)
+{
+    if (PyPropertyTree_Transaction_end(self, true) < 0)
+        return NULL;
+
+    Py_RETURN_NONE;
 }
 
 
-static PyObject*
-PyPropertyTree_AssocIter__tp_iternext(PyPropertyTree_AssocIter *self)
+PyDoc_STRVAR(PyPropertyTree_Transaction_rollback__doc__,
+"rollback()\n\n"
+"    Undo the changes made so far and end the transaction.\n");
+
+
+static PyObject*
+PyPropertyTree_Transaction_rollback(PyPropertyTree_Transaction *self)
+{
+    if (PyPropertyTree_Transaction_end(self, false) < 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+
+static PyMethodDef PyPropertyTree_Transaction_methods[] = {
+    {(char *) "__enter__",
+     (PyCFunction) PyPropertyTree_Transaction__enter__,
+     METH_NOARGS,
+     NULL},
+    {(char *) "__exit__",
+     (PyCFunction) PyPropertyTree_Transaction__exit__,
+     METH_VARARGS,
+     NULL},
+    {(char *) "commit",
+     (PyCFunction) PyPropertyTree_Transaction_commit,
+     METH_NOARGS,
+     PyPropertyTree_Transaction_commit__doc__},
+    {(char *) "rollback",
+     (PyCFunction) PyPropertyTree_Transaction_rollback,
+     METH_NOARGS,
+     PyPropertyTree_Transaction_rollback__doc__},
+    {NULL, NULL, 0, NULL}
+};
+
+
+/* a transaction that is dropped while in progress keeps its changes */
+static void
+PyPropertyTree_Transaction__tp_dealloc(PyPropertyTree_Transaction *self)
 {
-    boost::property_tree::ptree::assoc_iterator iter = self->iterator.first;
-
-    if (iter == self->iterator.second) {
-        PyErr_SetNone(PyExc_StopIteration);
-        return NULL;
+    if (self->active) {
+        delete self->container->undo;
+        self->container->undo = NULL;
     }
 
-    self->iterator.first++;
+    Py_CLEAR(self->container);
 
-    const std::string &key = iter->first;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
 
-    PyPropertyTree *py_ptree = PyPropertyTree_New(&iter->second, PTREE_FLAG_OBJECT_NOT_OWNED);
 
-    return Py_BuildValue((char *) "s#N", key.c_str(), key.size(), py_ptree);
-}
+PyDoc_STRVAR(PyPropertyTree_Transaction__doc__,
+"    Changes to a tree that can be undone, created with Tree.transaction().\n"
+"    Used as a context manager the changes are rolled back if an exception\n"
+"    escapes the with block and kept otherwise.\n");
 
 
-PyTypeObject PyPropertyTree_AssocIterType = {
+PyTypeObject PyPropertyTree_TransactionType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    (char *) "property_tree.AssocTreeIter",                     /* tp_name */
-    sizeof(PyPropertyTree_AssocIter),                           /* tp_basicsize */
+    (char *) "property_tree.Transaction",                       /* tp_name */
+    sizeof(PyPropertyTree_Transaction),                         /* tp_basicsize */
     0,                                                          /* tp_itemsize */
-    (destructor)PyPropertyTree_AssocIter__tp_dealloc,           /* tp_dealloc */
+    (destructor)PyPropertyTree_Transaction__tp_dealloc,         /* tp_dealloc */
     (printfunc)0,                                               /* tp_print */
     (getattrfunc)NULL,                                          /* tp_getattr */
     (setattrfunc)NULL,                                          /* tp_setattr */
@@ -1888,15 +7937,15 @@ PyTypeObject PyPropertyTree_AssocIterType = {
     (getattrofunc)NULL,                                         /* tp_getattro */
     (setattrofunc)NULL,                                         /* tp_setattro */
     (PyBufferProcs*)NULL,                                       /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_GC,                      /* tp_flags */
-    NULL,                                                       /* Documentation string */
-    (traverseproc)PyPropertyTree_AssocIter__tp_traverse,        /* tp_traverse */
-    (inquiry)PyPropertyTree_AssocIter__tp_clear,                /* tp_clear */
+    Py_TPFLAGS_DEFAULT,                                         /* tp_flags */
+    PyPropertyTree_Transaction__doc__,                          /* Documentation string */
+    (traverseproc)NULL,                                         /* tp_traverse */
+    (inquiry)NULL,                                              /* tp_clear */
     (richcmpfunc)NULL,                                          /* tp_richcompare */
     0,                                                          /* tp_weaklistoffset */
-    (getiterfunc)PyPropertyTree_AssocIter__tp_iter,             /* tp_iter */
-    (iternextfunc)PyPropertyTree_AssocIter__tp_iternext,        /* tp_iternext */
-    (struct PyMethodDef*)NULL,                                  /* tp_methods */
+    (getiterfunc)NULL,                                          /* tp_iter */
+    (iternextfunc)NULL,                                         /* tp_iternext */
+    (struct PyMethodDef*)PyPropertyTree_Transaction_methods,    /* tp_methods */
     (struct PyMemberDef*)0,                                     /* tp_members */
     NULL,                                                       /* tp_getset */
     NULL,                                                       /* tp_base */
@@ -1906,7 +7955,7 @@ PyTypeObject PyPropertyTree_AssocIterType = {
     0,                                                          /* tp_dictoffset */
     (initproc)NULL,                                             /* tp_init */
     (allocfunc)PyType_GenericAlloc,                             /* tp_alloc */
-    (newfunc)PyType_GenericNew,                                 /* tp_new */
+    (newfunc)NULL,                                              /* tp_new */
     (freefunc)0,                                                /* tp_free */
     (inquiry)NULL,                                              /* tp_is_gc */
     NULL,                                                       /* tp_bases */
@@ -2561,12 +8610,539 @@ static struct PyModuleDef property_tree_info_moduledef = {
 /* --- property_tree module --- */
 
 
+/* --- structural diff --- */
+
+
+struct ptree_diff_op
+{
+    enum { ADD, REMOVE, CHANGE } op;
+    std::string path;
+    boost::property_tree::ptree *old_node;
+    boost::property_tree::ptree *new_node;
+};
+
+
+/* The changes from one tree to another. Equal subtrees are skipped, named
+ * children are matched by key and array items by the value of their key field
+ * if one is given, whatever their order, and else in order by being equal,
+ * the items left between two matches are compared by position. The items that
+ * aren't the same at either end are matched through a hash of each subtree,
+ * kept so each one is hashed once. The children of a node that were removed
+ * come first, by their index in the old node, then the others by their index
+ * in the new one */
+class ptree_differ
+{
+public:
+    std::vector<ptree_diff_op> ops;
+
+    ptree_differ(const std::vector<std::string> &key, const std::string &separator, bool brackets)
+        : key(key), separator(separator), brackets(brackets) {}
+
+    void diff(boost::property_tree::ptree &old_node, boost::property_tree::ptree &new_node, std::string &path)
+    {
+        if (same(old_node, new_node))
+            return;
+
+        if (old_node.data() != new_node.data())
+            ops.push_back({ptree_diff_op::CHANGE, path, &old_node, &new_node});
+
+        std::unordered_map<std::string, std::vector<std::pair<boost::property_tree::ptree*, std::size_t> > > named;
+        std::vector<std::pair<boost::property_tree::ptree*, std::size_t> > old_items, new_items;
+        // the old child each new one is matched with, by their index
+        std::vector<boost::property_tree::ptree*> matched(new_node.size(), NULL);
+        std::vector<bool> kept(old_node.size(), false);
+        std::size_t index = 0;
+
+        // the nth child with a key is matched with the nth one with that key
+        for (boost::property_tree::ptree::reverse_iterator child = old_node.rbegin(); child != old_node.rend(); child++) {
+            if (!child->first.empty())
+                named[child->first].push_back({&child->second, old_node.size() - 1 - index});
+            index++;
+        }
+
+        index = 0;
+        for (boost::property_tree::ptree::value_type &child : old_node) {
+            if (child.first.empty())
+                old_items.push_back({&child.second, index});
+            index++;
+        }
+
+        index = 0;
+        for (boost::property_tree::ptree::value_type &child : new_node) {
+            if (child.first.empty()) {
+                new_items.push_back({&child.second, index++});
+                continue;
+            }
+
+            std::vector<std::pair<boost::property_tree::ptree*, std::size_t> > &candidates = named[child.first];
+
+            if (!candidates.empty()) {
+                matched[index] = candidates.back().first;
+                kept[candidates.back().second] = true;
+                candidates.pop_back();
+            }
+            index++;
+        }
+
+        if (!old_items.empty() && !new_items.empty()) {
+            std::vector<std::pair<std::size_t, std::size_t> > pairs;
+
+            match_items(old_items, new_items, pairs);
+
+            for (std::pair<std::size_t, std::size_t> &pair : pairs) {
+                matched[new_items[pair.second].second] = old_items[pair.first].first;
+                kept[old_items[pair.first].second] = true;
+            }
+        }
+
+        std::size_t len = path.size();
+
+        index = 0;
+        for (boost::property_tree::ptree::value_type &child : old_node) {
+            if (!kept[index]) {
+                ptree_path_append(path, child.first, index, separator, brackets);
+                ops.push_back({ptree_diff_op::REMOVE, path, &child.second, NULL});
+                path.resize(len);
+            }
+            index++;
+        }
+
+        index = 0;
+        for (boost::property_tree::ptree::value_type &child : new_node) {
+            ptree_path_append(path, child.first, index, separator, brackets);
+            if (matched[index])
+                diff(*matched[index], child.second, path);
+            else
+                ops.push_back({ptree_diff_op::ADD, path, NULL, &child.second});
+            path.resize(len);
+            index++;
+        }
+    }
+
+private:
+    std::unordered_map<const boost::property_tree::ptree*, std::size_t> hashes;
+    std::vector<std::string> key;
+    std::string separator;
+    bool brackets;
+
+    std::size_t hash(const boost::property_tree::ptree &node)
+    {
+        std::unordered_map<const boost::property_tree::ptree*, std::size_t>::const_iterator
+            found = hashes.find(&node);
+
+        if (found != hashes.end())
+            return found->second;
+
+        std::size_t h = std::hash<std::string>()(node.data());
+
+        for (const boost::property_tree::ptree::value_type &child : node) {
+            h = (h ^ std::hash<std::string>()(child.first)) * 0x100000001B3ull;
+            h = (h ^ hash(child.second)) * 0x9E3779B97F4A7C15ull;
+        }
+
+        hashes[&node] = h;
+        return h;
+    }
+
+    /* compared directly, the hashes are only there to tell apart the items
+     * that were hashed to be matched */
+    bool same(const boost::property_tree::ptree &lhs, const boost::property_tree::ptree &rhs)
+    {
+        if (&lhs == &rhs)
+            return true;
+
+        if (lhs.size() != rhs.size() || lhs.data() != rhs.data())
+            return false;
+
+        std::unordered_map<const boost::property_tree::ptree*, std::size_t>::const_iterator
+            lhs_hash = hashes.find(&lhs), rhs_hash = hashes.find(&rhs);
+
+        if (lhs_hash != hashes.end() && rhs_hash != hashes.end() && lhs_hash->second != rhs_hash->second)
+            return false;
+
+        return lhs == rhs;
+    }
+
+    /* the value the items are matched on, NULL if they are matched on being equal */
+    const std::string *match_value(const boost::property_tree::ptree &item)
+    {
+        const boost::property_tree::ptree *field = query_resolve_field(item, key);
+
+        return field ? &field->data() : NULL;
+    }
+
+    /* the (old, new) positions of the items that are diffed with each other,
+     * the others are removed or added */
+    void match_items(const std::vector<std::pair<boost::property_tree::ptree*, std::size_t> > &old_items,
+                     const std::vector<std::pair<boost::property_tree::ptree*, std::size_t> > &new_items,
+                     std::vector<std::pair<std::size_t, std::size_t> > &pairs)
+    {
+        std::vector<std::pair<std::size_t, std::size_t> > matches;
+        std::size_t first = 0, old_last = old_items.size(), new_last = new_items.size();
+
+        // the same items at either end are matched without hashing the others
+        while (first < old_last && first < new_last && same(*old_items[first].first, *new_items[first].first))
+            first++;
+        while (old_last > first && new_last > first && same(*old_items[old_last - 1].first, *new_items[new_last - 1].first)) {
+            old_last--;
+            new_last--;
+        }
+
+        for (std::size_t i = 0; i < first; i++)
+            pairs.push_back({i, i});
+        for (std::size_t i = 0; old_last + i < old_items.size(); i++)
+            pairs.push_back({old_last + i, new_last + i});
+
+        // with a key the nth item with a value is matched with the nth one
+        // with that value, wherever it is
+        if (!key.empty()) {
+            std::unordered_map<std::string, std::vector<std::size_t> > by_value;
+
+            for (std::size_t j = new_last; j-- > first;) {
+                if (const std::string *value = match_value(*new_items[j].first))
+                    by_value[*value].push_back(j);
+            }
+
+            for (std::size_t i = first; i < old_last; i++) {
+                const std::string *value = match_value(*old_items[i].first);
+
+                if (!value)
+                    continue;
+
+                std::unordered_map<std::string, std::vector<std::size_t> >::iterator
+                    candidates = by_value.find(*value);
+
+                if (candidates != by_value.end() && !candidates->second.empty()) {
+                    pairs.push_back({i, candidates->second.back()});
+                    candidates->second.pop_back();
+                }
+            }
+            return;
+        }
+
+        // each item is matched with the first equal one after the last match
+        std::unordered_map<std::size_t, std::vector<std::size_t> > by_hash;
+        std::size_t next = first;
+
+        for (std::size_t j = new_last; j-- > first;)
+            by_hash[hash(*new_items[j].first)].push_back(j);
+
+        for (std::size_t i = first; i < old_last; i++) {
+            std::vector<std::size_t> &candidates = by_hash[hash(*old_items[i].first)];
+
+            while (!candidates.empty() && candidates.back() < next)
+                candidates.pop_back();
+
+            if (!candidates.empty() && same(*old_items[i].first, *new_items[candidates.back()].first)) {
+                matches.push_back({i, candidates.back()});
+                next = candidates.back() + 1;
+                candidates.pop_back();
+            }
+        }
+
+        std::size_t old_from = first, new_from = first;
+
+        matches.push_back({old_last, new_last});
+
+        // the items between two matches are compared by position, equal ones
+        // are skipped by diff() anyway
+        for (std::pair<std::size_t, std::size_t> &match : matches) {
+            std::size_t count = std::min(match.first - old_from, match.second - new_from);
+
+            for (std::size_t i = 0; i < count; i++)
+                pairs.push_back({old_from + i, new_from + i});
+            if (match.first < old_last)
+                pairs.push_back(match);
+
+            old_from = match.first + 1;
+            new_from = match.second + 1;
+        }
+    }
+};
+
+
+PyDoc_STRVAR(property_tree_diff__doc__,
+"diff(a, b, key=None, sep=\".\", arrays=\"index\") -> list\n\n"
+"    Return the changes that turn tree a into tree b as a list of\n"
+"    (op, path, old, new) tuples.\n"
+"    * (\"add\", path, None, node) for a node of b that isn't in a.\n"
+"    * (\"remove\", path, node, None) for a node of a that isn't in b.\n"
+"    * (\"change\", path, old_value, new_value) for a node in both trees\n"
+"      whose value changed.\n"
+"    * Nodes are views of a and b. Paths are formatted as in flatten().\n"
+"    * The change of a node comes first, then its children that were\n"
+"      removed, with their index in a, then its other children in the\n"
+"      order of b, with their index in b.\n"
+"    * Named children are matched by key whatever their order.\n"
+"    * Array items are matched by the value of the key path if given,\n"
+"      e.g. key=\"id\", whatever their order, items without it are added\n"
+"      and removed. Otherwise they are matched in order with an equal\n"
+"      item, the items between two matches are compared by position.\n"
+"    * Equal subtrees are skipped, items that moved are found by a hash\n"
+"      of each subtree.\n");
+
+
+static PyObject*
+property_tree_diff(PyObject * Py_UNUSED(dummy), PyObject *args, PyObject *kwargs)
+{
+    PyPropertyTree *a, *b;
+    const char *key = NULL;
+    const char *sep = ".";
+    Py_ssize_t sep_len = 1;
+    const char *arrays = "index";
+    bool brackets;
+    const char *keywords[] = {"a", "b", "key", "sep", "arrays", NULL};
+    static const char *names[] = {"add", "remove", "change"};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O!O!|zs#s:diff", (char **) keywords,
+                                     &PyPropertyTree_Type, &a, &PyPropertyTree_Type, &b,
+                                     &key, &sep, &sep_len, &arrays)) {
+        return NULL;
+    }
+
+    if (py_arrays_format(arrays, brackets) < 0)
+        return NULL;
+
+    ptree_differ differ(key ? ptree_split_path(key) : std::vector<std::string>(),
+                        std::string(sep, sep_len), brackets);
+    std::string path;
+
+    differ.diff(*a->obj, *b->obj, path);
+
+    PyObject *list = PyList_New(differ.ops.size());
+
+    for (std::size_t i = 0; list && i < differ.ops.size(); i++) {
+        ptree_diff_op &op = differ.ops[i];
+        PyObject *item;
+
+        if (op.op == ptree_diff_op::CHANGE) {
+            item = Py_BuildValue((char *) "(ss#s#s#)", names[op.op], op.path.c_str(), (Py_ssize_t) op.path.size(),
+                                 op.old_node->data().c_str(), (Py_ssize_t) op.old_node->data().size(),
+                                 op.new_node->data().c_str(), (Py_ssize_t) op.new_node->data().size());
+        } else if (op.op == ptree_diff_op::ADD) {
+            item = Py_BuildValue((char *) "(ss#ON)", names[op.op], op.path.c_str(), (Py_ssize_t) op.path.size(),
+                                 Py_None, PyPropertyTree_New(op.new_node, PTREE_FLAG_OBJECT_NOT_OWNED, b));
+        } else {
+            item = Py_BuildValue((char *) "(ss#NO)", names[op.op], op.path.c_str(), (Py_ssize_t) op.path.size(),
+                                 PyPropertyTree_New(op.old_node, PTREE_FLAG_OBJECT_NOT_OWNED, a), Py_None);
+        }
+
+        if (!item)
+            Py_CLEAR(list);
+        else
+            PyList_SET_ITEM(list, i, item);
+    }
+
+    return list;
+}
+
+
+PyDoc_STRVAR(property_tree_join__doc__,
+"join(left, right, left_on, right_on=None, how=\"inner\", merged=False) -> list\n\n"
+"    Match the children of two trees on the values at the given paths.\n"
+"    * right_on defaults to left_on.\n"
+"    * Returns the (left, right) pairs in the order of the left children,\n"
+"      the matches of each in the order of the right children.\n"
+"    * With how=\"left\" the left children without a match are paired with None.\n"
+"    * With merged=True a new tree is returned instead, with a copy of each\n"
+"      left child updated with the children of its match.\n"
+"    * The hash table is built on the smaller side.\n");
+
+
+static PyObject*
+property_tree_join(PyObject * Py_UNUSED(dummy), PyObject *args, PyObject *kwargs)
+{
+    PyPropertyTree *left, *right;
+    const char *left_on, *right_on = NULL, *how = "inner";
+    int merged = 0;
+    bool outer;
+    const char *keywords[] = {"left", "right", "left_on", "right_on", "how", "merged", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "O!O!s|zsp:join", (char **) keywords,
+                                     &PyPropertyTree_Type, &left, &PyPropertyTree_Type, &right,
+                                     &left_on, &right_on, &how, &merged)) {
+        return NULL;
+    }
+
+    if (strcmp(how, "inner") == 0) {
+        outer = false;
+    } else if (strcmp(how, "left") == 0) {
+        outer = true;
+    } else {
+        PyErr_Format(PyExc_ValueError, "how must be \"inner\" or \"left\", not \"%s\"", how);
+        return NULL;
+    }
+
+    std::vector<std::string> left_field = ptree_split_path(left_on);
+    std::vector<std::string> right_field = ptree_split_path(right_on ? right_on : left_on);
+    std::vector<boost::property_tree::ptree*> left_nodes, right_nodes;
+    std::vector<std::vector<boost::property_tree::ptree*> > matches;
+
+    for (boost::property_tree::ptree::value_type &child : *left->obj)
+        left_nodes.push_back(&child.second);
+    for (boost::property_tree::ptree::value_type &child : *right->obj)
+        right_nodes.push_back(&child.second);
+
+    matches.resize(left_nodes.size());
+
+    if (right_nodes.size() <= left_nodes.size()) {
+        // hash the right side, probe it with each left child
+        std::unordered_map<std::string, std::vector<boost::property_tree::ptree*> > table;
+
+        table.reserve(right_nodes.size());
+        for (boost::property_tree::ptree *node : right_nodes) {
+            const boost::property_tree::ptree *key = query_resolve_field(*node, right_field);
+
+            if (key)
+                table[key->data()].push_back(node);
+        }
+
+        for (std::size_t i = 0; i < left_nodes.size(); i++) {
+            const boost::property_tree::ptree *key = query_resolve_field(*left_nodes[i], left_field);
+
+            if (!key)
+                continue;
+
+            std::unordered_map<std::string, std::vector<boost::property_tree::ptree*> >::const_iterator
+                found = table.find(key->data());
+
+            if (found != table.end())
+                matches[i] = found->second;
+        }
+    } else {
+        // hash the left side, stream the right side through it
+        std::unordered_map<std::string, std::vector<std::size_t> > table;
+
+        table.reserve(left_nodes.size());
+        for (std::size_t i = 0; i < left_nodes.size(); i++) {
+            const boost::property_tree::ptree *key = query_resolve_field(*left_nodes[i], left_field);
+
+            if (key)
+                table[key->data()].push_back(i);
+        }
+
+        for (boost::property_tree::ptree *node : right_nodes) {
+            const boost::property_tree::ptree *key = query_resolve_field(*node, right_field);
+
+            if (!key)
+                continue;
+
+            std::unordered_map<std::string, std::vector<std::size_t> >::const_iterator
+                found = table.find(key->data());
+
+            if (found != table.end()) {
+                for (std::size_t i : found->second)
+                    matches[i].push_back(node);
+            }
+        }
+    }
+
+    if (merged) {
+        boost::property_tree::ptree *tree = new boost::property_tree::ptree();
+        boost::property_tree::ptree::iterator iter = left->obj->begin();
+
+        for (std::size_t i = 0; i < left_nodes.size(); i++, ++iter) {
+            if (matches[i].empty() && outer)
+                tree->push_back(*iter);
+
+            for (boost::property_tree::ptree *match : matches[i]) {
+                boost::property_tree::ptree &node = tree->push_back(*iter)->second;
+
+                for (boost::property_tree::ptree::value_type &child : *match) {
+                    if (child.first.empty())
+                        node.push_back(child);
+                    else
+                        node.put_child(boost::property_tree::ptree::path_type(child.first, '\0'), child.second);
+                }
+            }
+        }
+
+        return (PyObject *) PyPropertyTree_New(tree, PTREE_FLAG_NONE);
+    }
+
+    PyObject *list = PyList_New(0);
+
+    for (std::size_t i = 0; list && i < left_nodes.size(); i++) {
+        PyObject *pair = NULL;
+
+        if (matches[i].empty() && outer) {
+            pair = Py_BuildValue((char *) "(NO)",
+                                 PyPropertyTree_New(left_nodes[i], PTREE_FLAG_OBJECT_NOT_OWNED, left), Py_None);
+            if (!pair || PyList_Append(list, pair) < 0)
+                Py_CLEAR(list);
+            Py_XDECREF(pair);
+        }
+
+        for (std::size_t j = 0; list && j < matches[i].size(); j++) {
+            pair = Py_BuildValue((char *) "(NN)",
+                                 PyPropertyTree_New(left_nodes[i], PTREE_FLAG_OBJECT_NOT_OWNED, left),
+                                 PyPropertyTree_New(matches[i][j], PTREE_FLAG_OBJECT_NOT_OWNED, right));
+            if (!pair || PyList_Append(list, pair) < 0)
+                Py_CLEAR(list);
+            Py_XDECREF(pair);
+        }
+    }
+
+    return list;
+}
+
+
+PyDoc_STRVAR(property_tree_where__doc__,
+"where(path) -> Predicate\n\n"
+"    Return a predicate on the field at the given path of a node for use\n"
+"    with Tree.search(), evaluated without calling into python.\n"
+"    * On its own the predicate tests whether the field exists.\n"
+"    * Comparing it with == != < <= > >= or calling contains() tests\n"
+"      the value of the field, numbers are compared numerically.\n"
+"    * Predicates are combined with & (and), | (or) and ~ (not), nesting them\n"
+"      deeper than 1000 raises RecursionError.\n"
+"    e.g. tree.shows.search((where(\"network.id\") == 12) & ~where(\"name\").contains(\"Panda\"))\n");
+
+
+static PyObject*
+property_tree_where(PyObject * Py_UNUSED(dummy), PyObject *args, PyObject *kwargs)
+{
+    const char *path;
+    Py_ssize_t path_len;
+    std::shared_ptr<query_filter> filter;
+    const char *keywords[] = {"path", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, (char *) "s#:where", (char **) keywords, &path, &path_len)) {
+        return NULL;
+    }
+
+    filter = std::make_shared<query_filter>();
+    filter->op = query_filter::EXISTS;
+
+    filter->field = ptree_split_path(std::string(path, path_len));
+
+    return PyPropertyTree_Predicate_New(filter);
+}
+
+
+static PyMethodDef property_tree_functions[] = {
+    {(char *) "diff",
+     (PyCFunction) property_tree_diff,
+     METH_KEYWORDS|METH_VARARGS,
+     property_tree_diff__doc__},
+    {(char *) "join",
+     (PyCFunction) property_tree_join,
+     METH_KEYWORDS|METH_VARARGS,
+     property_tree_join__doc__},
+    {(char *) "where",
+     (PyCFunction) property_tree_where,
+     METH_KEYWORDS|METH_VARARGS,
+     property_tree_where__doc__},
+    {NULL, NULL, 0, NULL}
+};
+
+
 static struct PyModuleDef property_tree_moduledef = {
     PyModuleDef_HEAD_INIT,
     "property_tree",
     NULL,
     -1,
-    NULL,
+    property_tree_functions,
 };
 
 
@@ -2608,6 +9184,60 @@ PyInit_property_tree(void)
         return NULL;
     }
 
+    /* Register the recursive walk iterator class */
+
+    if (PyType_Ready(&PyPropertyTree_WalkIterType)) {
+        return NULL;
+    }
+
+    /* Register the query engine class */
+
+    if (PyType_Ready(&PyPropertyTree_QueryType)) {
+        return NULL;
+    }
+
+    PyModule_AddObject(m, (char *) "Query", (PyObject *) &PyPropertyTree_QueryType);
+
+    /* Register the native search predicate class */
+
+    if (PyType_Ready(&PyPropertyTree_PredicateType)) {
+        return NULL;
+    }
+
+    PyModule_AddObject(m, (char *) "Predicate", (PyObject *) &PyPropertyTree_PredicateType);
+
+    /* Register the record extractor class */
+
+    if (PyType_Ready(&PyPropertyTree_ExtractorType)) {
+        return NULL;
+    }
+
+    PyModule_AddObject(m, (char *) "Extractor", (PyObject *) &PyPropertyTree_ExtractorType);
+
+    /* Register the grouped view class */
+
+    if (PyType_Ready(&PyPropertyTree_GroupByType)) {
+        return NULL;
+    }
+
+    PyModule_AddObject(m, (char *) "GroupBy", (PyObject *) &PyPropertyTree_GroupByType);
+
+    /* Register the value index class */
+
+    if (PyType_Ready(&PyPropertyTree_IndexType)) {
+        return NULL;
+    }
+
+    PyModule_AddObject(m, (char *) "Index", (PyObject *) &PyPropertyTree_IndexType);
+
+    /* Register the transaction class */
+
+    if (PyType_Ready(&PyPropertyTree_TransactionType)) {
+        return NULL;
+    }
+
+    PyModule_AddObject(m, (char *) "Transaction", (PyObject *) &PyPropertyTree_TransactionType);
+
     /* Register the 'boost::property_tree::ptree_bad_data' exception */
 
     if ((PyPropertyTreeBadDataError_Type = (PyTypeObject*) PyErr_NewException((char*)"property_tree.BadDataError", NULL, NULL)) == NULL) {
@@ -2626,6 +9256,15 @@ PyInit_property_tree(void)
     Py_INCREF((PyObject *) PyPropertyTreeBadPathError_Type);
     PyModule_AddObject(m, (char *) "BadPathError", (PyObject *) PyPropertyTreeBadPathError_Type);
 
+    /* Register the query syntax exception */
+
+    if ((PyPropertyTreeQueryError_Type = (PyTypeObject*) PyErr_NewException((char*)"property_tree.QueryError", NULL, NULL)) == NULL) {
+        return NULL;
+    }
+
+    Py_INCREF((PyObject *) PyPropertyTreeQueryError_Type);
+    PyModule_AddObject(m, (char *) "QueryError", (PyObject *) PyPropertyTreeQueryError_Type);
+
     /* Register the property_tree.json submodule */
 
     submodule = PyModule_Create(&property_tree_json_moduledef);
@@ -1,5 +1,8 @@
 import unittest
+import array
+import collections
 import copy
+import threading
 import property_tree as ptree
 
 class TestTree(unittest.TestCase):
@@ -330,6 +333,929 @@ class TestTree(unittest.TestCase):
         self.assertEqual(pt.index("four"),  3)
         self.assertEqual(pt[3], 4)
 
+        # sort by a key function, called once per child
+        calls = []
+        def by_value(key, value):
+            calls.append(key)
+            return -int(value)
+
+        pt.sort(key=by_value)
+        self.assertEqual(list(pt.keys()), ["four", "three", "two", "one"])
+        self.assertEqual(len(calls), 4)
+
+        pt.sort(key=lambda key, value: key, reverse=True)
+        self.assertEqual(list(pt.keys()), ["two", "three", "one", "four"])
+
+        pt.sort(cmp=lambda lhs, rhs: int(lhs[1]) < int(rhs[1]), reverse=True)
+        self.assertEqual(list(pt.keys()), ["four", "three", "two", "one"])
+
+        pt.sort(reverse=True)
+        self.assertEqual(list(pt.keys()), ["two", "three", "one", "four"])
+
+        # the sort is stable for every kind of key
+        for key in (lambda k, v: int(v) % 2, lambda k, v: float(int(v) % 2),
+                    lambda k, v: str(int(v) % 2), lambda k, v: (int(v) % 2,), lambda k, v: 2 ** 70 * (int(v) % 2)):
+            pt.sort(key=key)
+            self.assertEqual(list(pt.keys()), ["two", "four", "three", "one"])
+            pt.sort(key=key, reverse=True)
+            self.assertEqual(list(pt.keys()), ["three", "one", "two", "four"])
+            pt.sort(key=lambda k, v: k, reverse=True)
+
+        # nothing is changed if the keys can't be compared
+        self.assertRaises(TypeError, pt.sort, key=lambda key, value: 1 if key == "one" else "1")
+        self.assertRaises(ZeroDivisionError, pt.sort, key=lambda key, value: 1 / 0)
+        self.assertEqual(list(pt.keys()), ["two", "three", "one", "four"])
+        self.assertRaises(TypeError, pt.sort, lambda lhs, rhs: True, key=lambda key, value: key)
+
+        # a key function must not change the tree
+        def erase_next(key, value):
+            pt.erase("one")
+            return key
+
+        self.assertRaises(RuntimeError, pt.sort, key=erase_next)
+        self.assertEqual(list(pt.keys()), ["two", "three", "four"])
+        self.assertRaises(RuntimeError, pt.sort, key=lambda key, value: pt.put(key, "1") or key)
+
+        class Key(object):
+            def __init__(self, key):
+                self.key = key
+
+            def __lt__(self, other):
+                pt.clear()
+                return self.key < other.key
+
+        self.assertRaises(RuntimeError, pt.sort, key=lambda key, value: Key(key))
+        self.assertEqual(len(pt), 0)
+
+    def test_sort_by(self):
+        pt = ptree.json.loads('[{"id": 10, "name": "b"}, {"id": 9, "name": "a"}, {"name": "c"},'
+                              ' {"id": "x", "name": "d"}, {"id": 10, "name": "e"}, {"id": -1.5, "name": "f"}]')
+        names = lambda: "".join(v.name.value for k, v in pt)
+
+        pt.sort(by="id", numeric=True)
+        self.assertEqual(names(), "fabecd")
+        pt.sort(by="id", numeric=True, reverse=True)
+        self.assertEqual(names(), "beafcd")
+
+        pt.sort(by="id")
+        self.assertEqual(names(), "fbeadc")
+        pt.sort(by="name", stable=False)
+        self.assertEqual(names(), "abcdef")
+
+        values = ptree.json.loads('["10", "9", "100", "-2"]')
+        values.sort(by_value=True, numeric=True, reverse=True)
+        self.assertEqual([v.value for k, v in values], ["100", "10", "9", "-2"])
+        values.sort(by_value=True)
+        self.assertEqual([v.value for k, v in values], ["-2", "10", "100", "9"])
+
+        # views still see the same child after a sort
+        first = pt[0]
+        pt.sort(by="name", reverse=True)
+        self.assertEqual(first.name, "a")
+        self.assertEqual(pt[5].name, "a")
+
+        self.assertRaises(TypeError, pt.sort, by="id", key=lambda key, value: key)
+        self.assertRaises(TypeError, pt.sort, by="id", by_value=True)
+
+    def test_select(self):
+        pt = ptree.json.loads('''{"shows": [
+            {"id": 1, "name": "one", "language": "English", "schedule": {"time": "22:00"}},
+            {"id": 2, "name": "two", "language": "German", "schedule": {"time": "22:00"}},
+            {"id": 10, "name": "ten", "language": "English", "schedule": {"time": "20:00"}}
+        ]}''')
+
+        names = lambda nodes: [v.value for v in nodes]
+
+        self.assertEqual(names(pt.select("shows[?language=='English' && schedule.time=='22:00'].name")), ["one"])
+        self.assertEqual(names(pt.select("shows[?id > 1].name")), ["two", "ten"])
+        self.assertEqual(names(pt.select("shows[?!(id < 10) || name == 'one'].name")), ["one", "ten"])
+        self.assertEqual(names(pt.select("shows[*].id")), ["1", "2", "10"])
+        self.assertEqual(names(pt.select("shows[-1].name")), ["ten"])
+        self.assertEqual(names(pt.select("$..time")), ["22:00", "22:00", "20:00"])
+        self.assertEqual(pt.select("shows[?missing]"), [])
+
+        query = ptree.Query("shows[?schedule.time == '20:00'].name")
+        self.assertEqual(names(pt.select(query)), ["ten"])
+
+        self.assertRaises(ptree.QueryError, ptree.Query, "shows[?id ==")
+        self.assertRaises(ptree.QueryError, pt.select, "shows[?1 == 2]")
+
+        # filters nested too deeply to evaluate
+        self.assertRaises(ptree.QueryError, ptree.Query, "a[?" + "!" * 200000 + "a]")
+        self.assertRaises(ptree.QueryError, ptree.Query, "a[?" + "(" * 200000 + "a" + ")" * 200000 + "]")
+        self.assertRaises(ptree.QueryError, ptree.Query, "a[?" + " || ".join(["a"] * 200000) + "]")
+        self.assertEqual(names(pt.select("shows[?" + "!" * 998 + "(id > 1)].name")), ["two", "ten"])
+
+        # a Query that was never given an expression
+        empty = ptree.Query.__new__(ptree.Query)
+        self.assertRaises(ValueError, pt.select, empty)
+        self.assertEqual((repr(empty), empty.expression), ("Query(None)", None))
+    def test_search_predicate(self):
+        where = ptree.where
+        pt = ptree.json.loads('''{
+            "a": {"name": "Big Panda", "network": {"id": 12}, "status": "Running"},
+            "b": {"name": "Cat",       "network": {"id": 8},  "status": "Running"},
+            "c": {"name": "Panda Two", "status": "Ended"}
+        }''')
+
+        keys = lambda pred: [k for k, v in pt.search(pred)]
+
+        self.assertEqual(keys(where("network.id") == 12), ["a"])
+        self.assertEqual(keys(where("network.id") < 10), ["b"])
+        self.assertEqual(keys(where("name").contains("Panda")), ["a", "c"])
+        self.assertEqual(keys(where("network")), ["a", "b"])
+        self.assertEqual(keys(where("name").contains("Panda") & ~where("network")), ["c"])
+        self.assertEqual(keys((where("status") == "Ended") | (where("network.id") == 8)), ["b", "c"])
+
+        with self.assertRaises(TypeError):
+            bool(where("name"))
+
+        with self.assertRaises(TypeError):
+            (where("name") == "Cat") == "Cat"
+
+        # predicates nested too deeply to evaluate
+        pred = where("network")
+        for _ in range(999):
+            pred = ~pred
+        self.assertEqual(keys(pred), ["c"])
+        self.assertRaises(RecursionError, lambda: ~pred)
+        self.assertRaises(RecursionError, lambda: pred & where("name"))
+        chain = where("name")
+        with self.assertRaises(RecursionError):
+            for _ in range(200000):
+                chain = chain | (where("status") == "Ended")
+    def test_parallel_search(self):
+        where = ptree.where
+        pt = ptree.Tree()
+
+        for i in range(20000):
+            pt.append(str(i), ptree.Tree(id=i, odd=i % 2))
+
+        pred = (where("odd") == 1) & (where("id") >= 100)
+        expected = [k for k, v in pt.search(pred)]
+
+        self.assertEqual(len(expected), 9950)
+        self.assertEqual([k for k, v in pt.search(pred, threads=4)], expected)
+        self.assertEqual([k for k, v in pt.search(pred, threads=0)], expected)
+
+        query = "[?odd == 1 && id >= 100].id"
+        self.assertEqual([v.value for v in pt.select(query, threads=4)], expected)
+
+        self.assertRaises(TypeError, pt.search, lambda k, v: True, threads=4)
+
+        # writers from other threads wait for the scan of the tree to end
+        c = copy.copy(pt)
+        done = threading.Event()
+        errors = []
+        writes = []
+
+        def writer():
+            while not done.is_set():
+                try:
+                    pt.put("writes", len(writes))
+                    writes.append(1)
+                except Exception as exc:
+                    errors.append(exc)
+                    break
+
+        thread = threading.Thread(target=writer)
+        thread.start()
+        try:
+            for _ in range(50):
+                self.assertEqual([v.value for v in c.select(query, threads=4)], expected)
+                self.assertEqual([v.value for v in pt.select(query, threads=4)], expected)
+        finally:
+            done.set()
+            thread.join()
+        self.assertEqual(errors, [])
+        self.assertTrue(writes)
+        self.assertEqual(len(pt), 20001)
+
+    def test_match(self):
+        pt = ptree.json.loads('{"shows": [{"id": 1, "name": "Big Panda", "links": {"imdb": "tt01"}},'
+                              ' {"id": 2, "name": "Cat"}], "panda_count": "1"}')
+
+        self.assertEqual([(p, v.value) for p, v in pt.match(value="Panda")],
+                         [("shows[0].name", "Big Panda")])
+        self.assertEqual([p for p, v in pt.match(key="^(id|imdb)$")],
+                         ["shows[0].id", "shows[0].links.imdb", "shows[1].id"])
+        self.assertEqual([p for p, v in pt.match(key="^id$", value="2")], ["shows[1].id"])
+        self.assertEqual([p for p, v in pt.match(key="a", recursive=False)],
+                         ["panda_count"])
+
+        self.assertRaises(TypeError, pt.match)
+        self.assertRaises(ValueError, pt.match, key="(")
+
+    def test_grep(self):
+        pt = ptree.json.loads('{"shows": [{"name": "Big Panda", "summary": "a panda and a cat"},'
+                              ' {"name": "Cat", "summary": "a very long summary about a Panda bear"}],'
+                              ' "Panda": ""}')
+
+        self.assertEqual(list(pt.grep("Panda")), ["shows[0].name", "shows[1].summary"])
+        self.assertEqual(list(pt.grep("Panda", keys=True)), ["shows[0].name", "shows[1].summary", "Panda"])
+        self.assertEqual(list(pt.grep("Panda", keys=True, recursive=False)), ["Panda"])
+        self.assertEqual(list(pt.grep("missing")), [])
+
+        self.assertTrue("bear" in pt.shows[1].summary)
+        self.assertFalse("bears" in pt.shows[1].summary)
+
+    def test_walk(self):
+        pt = ptree.json.loads('{"a": {"b": "1", "c": ["x", "y"]}, "d": "2"}')
+
+        self.assertEqual([p for p, v in pt.walk()],
+                         ["a", "a.b", "a.c", "a.c[0]", "a.c[1]", "d"])
+        self.assertEqual([p for p, v in pt.walk(order="post")],
+                         ["a.b", "a.c[0]", "a.c[1]", "a.c", "a", "d"])
+        self.assertEqual([p for p, v in pt.walk(max_depth=2)], ["a", "a.b", "a.c", "d"])
+        self.assertEqual([(p, v.value) for p, v in pt.walk(leaves_only=True)],
+                         [("a.b", "1"), ("a.c[0]", "x"), ("a.c[1]", "y"), ("d", "2")])
+        self.assertEqual([p for p, v in pt.walk(order="post", max_depth=1)], ["a", "d"])
+
+        self.assertRaises(ValueError, pt.walk, order="in")
+        self.assertRaises(ValueError, pt.walk, max_depth=0)
+
+    def test_flatten(self):
+        pt = ptree.json.loads('{"a": {"b": "1", "c": ["x", {"d": "y"}]}, "e": "2"}')
+
+        flat = pt.flatten()
+        self.assertEqual(flat, {"a.b": "1", "a.c.0": "x", "a.c.1.d": "y", "e": "2"})
+        self.assertEqual(ptree.Tree.unflatten(flat), pt)
+
+        flat = pt.flatten(sep="/", arrays="brackets")
+        self.assertEqual(flat, {"a/b": "1", "a/c[0]": "x", "a/c[1]/d": "y", "e": "2"})
+        self.assertEqual(ptree.Tree.unflatten(flat, sep="/", arrays="brackets"), pt)
+
+        pt = ptree.Tree.unflatten({"a.b": 1, "a.c": True, "d": ptree.Tree(e="f")})
+        self.assertEqual(pt.get("a.b"), "1")
+        self.assertEqual(pt.get("a.c"), "true")
+        self.assertEqual(pt.get("d.e"), "f")
+
+        self.assertRaises(ValueError, pt.flatten, arrays="list")
+        self.assertRaises(ValueError, ptree.Tree.unflatten, {"a[x]": "1"}, arrays="brackets")
+
+        # array items in any order land at their index
+        pt = ptree.Tree.unflatten({"a.1": "y", "a.0": "x"})
+        self.assertEqual([v.value for k, v in pt.a], ["x", "y"])
+        pt = ptree.Tree.unflatten({"a[2]": "z", "b": "1", "c": "2"}, arrays="brackets")
+        self.assertEqual([v.value for k, v in pt.a], ["", "", "z"])
+
+        self.assertRaisesRegex(ValueError, "out of range", ptree.Tree.unflatten,
+                               {"a[99999999999999999999999]": "x"}, arrays="brackets")
+        self.assertRaisesRegex(ValueError, "out of range", ptree.Tree.unflatten, {"a[5]": "y"}, arrays="brackets")
+        self.assertRaisesRegex(ValueError, "with a key", ptree.Tree.unflatten,
+                               {"a": ptree.Tree(b="n"), "a[0]": "x"}, arrays="brackets")
+
+        # numbers that aren't 0 to n - 1 are keys, keys that are get quoted
+        pt = ptree.Tree.unflatten({"shows.250.name": "A", "shows.1.name": "B", "a.5": "y", "b.x": "n", "b.0": "z"})
+        self.assertEqual(list(pt.shows.keys()), ["250", "1"])
+        self.assertEqual((pt.shows["250"].name, pt.a["5"], pt.b["0"]), ("A", "y", "z"))
+        pt = ptree.json.loads('{"a": {"0": "x", "1": {"1": "y"}}, "b": ["z", {"\'c": "w"}]}')
+        self.assertEqual(pt.flatten(), {"a.'0'": "x", "a.'1'.1": "y", "b.0": "z", "b.1.'''c'": "w"})
+        self.assertEqual(ptree.Tree.unflatten(pt.flatten()), pt)
+
+    def test_extractor(self):
+        pt = ptree.json.loads('{"shows": [{"id": 1, "name": "A", "rating": {"average": "8.5"}, "ended": "true"},'
+                              ' {"id": 2, "name": "B", "rating": {}, "ended": "false"}]}')
+        Show = collections.namedtuple("Show", "id name rating")
+
+        ex = ptree.Extractor({"id": int, "name": str, "rating": ("rating.average", float, None)}, into=Show)
+        self.assertEqual(ex.fields, ("id", "name", "rating"))
+        self.assertEqual(ex(pt.shows[0]), Show(1, "A", 8.5))
+        self.assertEqual(ex.many(pt.shows), [Show(1, "A", 8.5), Show(2, "B", None)])
+        self.assertEqual(ex.many(pt.shows.search(lambda k, v: v.id == "2")), [Show(2, "B", None)])
+
+        ex = ptree.Extractor({"ended": bool, "name": ("name", str.lower)})
+        self.assertEqual(ex.many(pt.shows), [(True, "a"), (False, "b")])
+
+        ex = ptree.Extractor({"id": int}, into=dict)
+        self.assertEqual(ex(pt.shows[1]), {"id": 2})
+
+        self.assertRaises(KeyError, ptree.Extractor({"rating": ("rating.average", float)}).many, pt.shows)
+        self.assertRaises(ValueError, ptree.Extractor({"name": int}), pt.shows[0])
+        self.assertRaises(TypeError, ptree.Extractor, {"id": 1})
+        self.assertRaises(UnicodeEncodeError, ptree.Extractor, {"id": ("\ud800", int)})
+        self.assertRaises(ValueError, ptree.Extractor.__new__(ptree.Extractor), pt.shows[0])
+        self.assertRaises(ValueError, ptree.Extractor.__new__(ptree.Extractor).many, pt.shows)
+
+    def test_column(self):
+        pt = ptree.json.loads('{"shows": [{"id": 1, "rating": {"average": "8.5"}},'
+                              ' {"id": 2, "rating": {"average": null}}, {"id": 3, "rating": {}}]}')
+
+        ratings = pt.column("shows.*.rating.average")
+        self.assertIsInstance(ratings, array.array)
+        self.assertEqual(ratings.typecode, "d")
+        self.assertEqual(ratings[0], 8.5)
+        self.assertTrue(ratings[1] != ratings[1] and ratings[2] != ratings[2])
+
+        self.assertEqual(pt.column("shows.*.id", dtype="i4").tolist(), [1, 2, 3])
+        self.assertEqual(pt.column("shows[?id > 1].rating.average", "f4", default=0).tolist(), [0, 0])
+        self.assertEqual(pt.column("shows.*.rating.average", "u8", default=7).tolist(), [7, 7, 7])
+
+        self.assertRaises(ValueError, pt.column, "shows.*.rating.average", "i8")
+        self.assertRaises(ValueError, pt.column, "shows.*.id", "c")
+
+    def test_aggregate(self):
+        pt = ptree.json.loads('{"shows": [{"status": "Ended", "rating": {"average": "8.5"}},'
+                              ' {"status": "Running", "rating": {"average": null}},'
+                              ' {"status": "Ended", "rating": {"average": 7}}, {"id": 1}]}')
+
+        self.assertEqual(pt.aggregate("shows.*.rating.average"),
+                         {"count": 2, "sum": 15.5, "min": 7.0, "max": 8.5, "mean": 7.75})
+        self.assertEqual(pt.aggregate("shows.*.status", ops=["count", "max"]), {"count": 0, "max": None})
+        self.assertRaises(ValueError, pt.aggregate, "shows.*.id", ops=["median"])
+
+        counts = pt.value_counts("shows.*.status")
+        self.assertEqual(list(counts.items()), [("Ended", 2), ("Running", 1)])
+
+    def test_group_by(self):
+        pt = ptree.json.loads('{"shows": [{"id": 1, "network": {"name": "BBC"}}, {"id": 2, "network": {"name": "HBO"}},'
+                              ' {"id": 3, "network": {"name": "BBC"}}, {"id": 4}]}')
+
+        groups = pt.shows.group_by("network.name")
+        self.assertEqual(len(groups), 2)
+        self.assertEqual(list(groups), ["BBC", "HBO"])
+        self.assertEqual([v.id for v in groups["BBC"]], ["1", "3"])
+        self.assertEqual([(k, len(v)) for k, v in groups.items()], [("BBC", 2), ("HBO", 1)])
+        self.assertRaises(KeyError, groups.__getitem__, "ABC")
+
+        # the groups refer to the children, they aren't copies
+        groups["HBO"][0].put("id", 5)
+        self.assertEqual(pt.shows[1].id, "5")
+
+        tree = groups.to_tree()
+        self.assertEqual(ptree.json.dumps(tree, False).strip(),
+                         '{"BBC":[{"id":"1","network":{"name":"BBC"}},{"id":"3","network":{"name":"BBC"}}],'
+                         '"HBO":[{"id":"5","network":{"name":"HBO"}}]}')
+
+    def test_join(self):
+        pt = ptree.json.loads('{"episodes": [{"show": {"id": 1}, "name": "a"}, {"show": {"id": 2}, "name": "b"},'
+                              ' {"show": {"id": 1}, "name": "c"}, {"show": {"id": 9}, "name": "d"}],'
+                              ' "shows": [{"id": 1, "title": "x"}, {"id": 2, "title": "y"}, {"id": 1, "title": "z"}]}')
+        episodes, shows = pt.episodes, pt.shows
+
+        pairs = ptree.join(episodes, shows, "show.id", "id")
+        self.assertEqual([(l.name, r.title) for l, r in pairs],
+                         [("a", "x"), ("a", "z"), ("b", "y"), ("c", "x"), ("c", "z")])
+
+        # the hash table is built on the other side, the order is the same
+        pairs = ptree.join(shows, episodes, "id", "show.id")
+        self.assertEqual([(l.title, r.name) for l, r in pairs],
+                         [("x", "a"), ("x", "c"), ("y", "b"), ("z", "a"), ("z", "c")])
+
+        pairs = ptree.join(episodes, shows, "show.id", "id", how="left")
+        self.assertEqual(len(pairs), 6)
+        self.assertEqual(pairs[-1][0].name, "d")
+        self.assertIsNone(pairs[-1][1])
+
+        merged = ptree.join(episodes, shows, "show.id", "id", how="left", merged=True)
+        self.assertEqual([(v.name, v.get("title", "")) for k, v in merged],
+                         [("a", "x"), ("a", "z"), ("b", "y"), ("c", "x"), ("c", "z"), ("d", "")])
+
+        self.assertRaises(ValueError, ptree.join, episodes, shows, "show.id", "id", how="outer")
+
+    def test_diff(self):
+        a = ptree.json.loads('{"name": "x", "opts": {"a": 1, "b": 2}, "list": [1, 2, 3],'
+                             ' "shows": [{"id": 1, "v": 1}, {"id": 2, "v": 2}, {"id": 3}]}')
+        b = ptree.json.loads('{"name": "y", "opts": {"b": 2, "c": 3}, "list": [1, 9, 2, 3],'
+                             ' "shows": [{"id": 2, "v": 5}, {"id": 3}, {"id": 4}], "new": 1}')
+
+        self.assertEqual([(op, path) for op, path, old, new in ptree.diff(a, b)],
+                         [("change", "name"), ("remove", "opts.a"), ("add", "opts.c"), ("add", "list.1"),
+                          ("remove", "shows.1"), ("change", "shows.0.id"), ("change", "shows.0.v"),
+                          ("add", "shows.2"), ("add", "new")])
+        self.assertEqual(ptree.diff(a, b)[0], ("change", "name", "x", "y"))
+
+        # array items matched on a key field
+        self.assertEqual([(op, path) for op, path, old, new in ptree.diff(a.shows, b.shows, key="id")],
+                         [("remove", "0"), ("change", "0.v"), ("add", "2")])
+        self.assertEqual(ptree.diff(a.list, b.list, arrays="brackets")[0][1], "[1]")
+
+        # whatever their order, removed items first with their index in a
+        c = ptree.json.loads('{"a": [{"id": 1}, {"id": 2, "v": 2}]}')
+        d = ptree.json.loads('{"a": [{"id": 2, "v": 5}, {"id": 1}]}')
+        self.assertEqual(ptree.diff(c, d, key="id"), [("change", "a.0.v", "2", "5")])
+        d = ptree.json.loads('{"a": [{"id": 3}, {"id": 2, "v": 5}, {"id": 4}, {"v": 1}]}')
+        c.a.append("", ptree.Tree(id=3))
+        diff = ptree.diff(c, d, key="id")
+        self.assertEqual([(op, path) for op, path, old, new in diff],
+                         [("remove", "a.0"), ("change", "a.1.v"), ("add", "a.2"), ("add", "a.3")])
+        self.assertEqual((diff[0][2].id, diff[2][3].id), ("1", "4"))
+
+        # the nodes are views of the trees
+        op, path, old, new = ptree.diff(a.shows, b.shows, key="id")[0]
+        self.assertEqual((old.id, new), ("1", None))
+
+        self.assertEqual(ptree.diff(a, copy.copy(a)), [])
+        self.assertEqual(ptree.diff(b, ptree.json.loads(ptree.json.dumps(b))), [])
+        self.assertRaises(ValueError, ptree.diff, a, b, arrays="dots")
+
+    def test_build_index(self):
+        pt = ptree.json.loads('{"shows": [{"id": 1, "externals": {"imdb": "tt1"}}, {"id": 2, "externals": {"imdb": "tt2"}},'
+                              ' {"id": 3, "externals": {"imdb": "tt1"}}, {"id": 4}]}')
+
+        index = pt.shows.build_index("*.externals.imdb")
+        self.assertEqual(len(index), 2)
+        self.assertEqual([v.id for v in index["tt1"]], ["1", "3"])
+        self.assertEqual(index.get("tt2").id, "2")
+        self.assertIsNone(index.get("tt9"))
+        self.assertTrue("tt2" in index)
+        self.assertRaises(KeyError, index.__getitem__, "tt9")
+
+        # changes through any view of the tree make the index rebuild
+        pt.shows.append("", ptree.Tree(id=5, externals=ptree.Tree(imdb="tt9")))
+        self.assertEqual(index.get("tt9").id, "5")
+        pt.shows[0].externals.imdb = "tt7"
+        self.assertEqual([v.id for v in index["tt1"]], ["3"])
+
+        groups = pt.shows.group_by("externals.imdb")
+        pt.shows.popitem()
+        self.assertEqual(list(groups), ["tt7", "tt2", "tt1"])
+
+        self.assertEqual(pt.build_index("shows[*].id").get(3).externals.imdb, "tt1")
+
+    def test_upsert_from(self):
+        pt = ptree.json.loads('{"1": {"id": 1, "name": "a", "rating": {"average": 5, "votes": 10}, "genres": ["x", "y"]}}')
+        feed = ptree.json.loads('[{"id": 1, "name": "b", "rating": {"average": 6}, "genres": ["z"]},'
+                                ' {"id": 2, "name": "c"}, {"id": 2, "name": "d"}]')
+
+        self.assertEqual(pt.upsert_from(feed), (1, 0))
+        self.assertEqual(list(pt.keys()), ["1", "2"])
+        self.assertEqual(pt["1"].name, "a")
+        self.assertEqual(pt["2"].name, "c")
+
+        self.assertEqual(pt.upsert_from(feed, mode="merge"), (0, 3))
+        self.assertEqual(pt["1"].name, "b")
+        self.assertEqual(pt["1"].rating.average, "6")
+        self.assertEqual(pt["1"].rating.votes, "10")
+        self.assertEqual([v.value for k, v in pt["1"].genres], ["z"])
+        self.assertEqual(pt["2"].name, "d")
+
+        self.assertEqual(pt.upsert_from(feed, "name", mode="replace"), (3, 0))
+        self.assertEqual(list(pt.keys()), ["1", "2", "b", "c", "d"])
+
+        pt = ptree.Tree()
+        self.assertEqual(pt.upsert_from(feed, mode="replace"), (2, 1))
+        self.assertEqual(pt["2"].name, "d")
+
+        self.assertRaises(KeyError, pt.upsert_from, feed, "rating.average")
+        self.assertEqual(len(pt), 2)
+        self.assertRaises(ValueError, pt.upsert_from, feed, mode="update")
+
+        # the source can be a part of the same tree
+        self.assertEqual(pt.upsert_from(pt, "name"), (2, 0))
+        self.assertEqual(list(pt.keys()), ["1", "2", "b", "d"])
+
+    def test_merge(self):
+        defaults = ptree.json.loads('{"server": {"host": "localhost", "port": 80, "tls": {"enabled": false}},'
+                                    ' "plugins": ["a", "b"], "debug": false}')
+        site = ptree.json.loads('{"server": {"port": 8080, "tls": {"enabled": true, "cert": "site.pem"}},'
+                                ' "plugins": ["c"], "log": {"level": "info"}, "debug": {"level": 1}}')
+
+        config = defaults.merge(site, copy=True)
+        self.assertEqual(defaults.server.port, "80")
+        self.assertEqual(config.server.host, "localhost")
+        self.assertEqual(config.server.port, "8080")
+        self.assertEqual(config.server.tls.enabled, "true")
+        self.assertEqual(config.server.tls.cert, "site.pem")
+        self.assertEqual([v.value for k, v in config.plugins], ["c"])
+        self.assertEqual(config.log.level, "info")
+        self.assertEqual(config.debug.level, "1")
+
+        config = defaults.merge(site, arrays="concat", strategy="keep", copy=True)
+        self.assertEqual(config.server.port, "80")
+        self.assertEqual(config.server.tls.enabled, "false")
+        self.assertEqual(config.server.tls.cert, "site.pem")
+        self.assertEqual([v.value for k, v in config.plugins], ["a", "b", "c"])
+        self.assertEqual(config.debug, "false")
+
+        config = defaults.merge(site, strategy="append", copy=True)
+        self.assertEqual([v.value for v in config.server.tls.select("enabled")], ["false", "true"])
+        self.assertEqual(config.count("debug"), 2)
+
+        # merges in place by default and returns the tree to chain merges
+        host = ptree.Tree(server=ptree.Tree(host="example.com"))
+        self.assertIs(defaults.merge(site).merge(host), defaults)
+        self.assertEqual(defaults.server.host, "example.com")
+        self.assertEqual(defaults.server.port, "8080")
+
+        # an empty object changes nothing
+        defaults.merge(ptree.json.loads('{"server": {}}'))
+        self.assertEqual(defaults.server.port, "8080")
+
+        # merging a part of the tree into itself
+        defaults.server.merge(defaults.server.tls)
+        self.assertEqual(defaults.server.cert, "site.pem")
+
+        self.assertRaises(ValueError, defaults.merge, site, strategy="union")
+        self.assertRaises(ValueError, defaults.merge, site, arrays="zip")
+
+    def test_nlargest(self):
+        pt = ptree.json.loads('[{"id": 1, "rating": {"average": 7.5}}, {"id": 2, "rating": {"average": 9}},'
+                              ' {"id": 3, "rating": {"average": null}}, {"id": 4}, {"id": 5, "rating": {"average": 10}},'
+                              ' {"id": 6, "rating": {"average": 7.5}}, {"id": 7, "rating": {"average": "-1e1"}}]')
+
+        self.assertEqual([v.id for v in pt.nlargest(3, "rating.average")], ["5", "2", "1"])
+        self.assertEqual([v.id for v in pt.nsmallest(3, by="rating.average")], ["7", "1", "6"])
+        self.assertEqual([v.id for v in pt.nlargest(10, "rating.average")], ["5", "2", "1", "6", "7"])
+        self.assertEqual([v.id for v in pt.nlargest(10, "rating.average", numeric=False)],
+                         ["3", "2", "1", "6", "5", "7"])
+        self.assertEqual(pt.nlargest(0, "id"), [])
+        self.assertEqual(pt.nsmallest(-1, "id"), [])
+
+        # the results are views of the children
+        pt.nsmallest(1, "id")[0].id = 8
+        self.assertEqual(pt[0].id, "8")
+
+    def test_move(self):
+        pt = ptree.Tree()
+        piece = ptree.json.loads('{"id": 1, "cast": [{"name": "a"}, {"name": "b"}]}')
+        cast = piece.cast
+
+        moved = pt.append("", piece, move=True)
+        self.assertEqual(moved.id, "1")
+        self.assertTrue(piece.empty())
+        self.assertEqual(piece.value, "")
+
+        # views of the moved children see them in the new tree
+        cast.append("", ptree.Tree(name="c"))
+        self.assertEqual([v.name.value for k, v in pt[0].cast], ["a", "b", "c"])
+
+        # and keep it alive
+        del pt, moved
+        self.assertEqual(cast[2].name, "c")
+
+        # a borrowed source is left empty where it is
+        pt = ptree.json.loads('{"a": {"x": 1}, "b": {"y": 2}}')
+        pt.put("c", pt.a, move=True)
+        pt.add("d.e", pt.b, move=True)
+        self.assertEqual(list(pt.keys()), ["a", "b", "c", "d"])
+        self.assertTrue(pt.a.empty())
+        self.assertEqual(pt.c.x, "1")
+        self.assertEqual(pt.d.e.y, "2")
+
+        pt.insert(0, "f", pt.c, move=True)
+        pt.setdefault("g", pt.f, move=True)
+        pt.setdefault("g", pt.d, move=True)
+        self.assertEqual(pt.g.x, "1")
+        self.assertEqual(pt.d.e.y, "2")
+
+        pieces = [ptree.Tree(id=i) for i in range(3)]
+        pt.extend([("h", p) for p in pieces], move=True)
+        self.assertEqual([v.id.value for v in pt.select("h")], ["0", "1", "2"])
+        self.assertTrue(all(p.empty() for p in pieces))
+
+        # a value that isn't a tree is converted as usual
+        self.assertEqual(pt.append("i", 5, move=True), "5")
+
+        self.assertRaises(ValueError, pt.d.e.append, "x", pt.d, move=True)
+        self.assertRaises(ValueError, pt.append, "x", pt, move=True)
+        self.assertEqual(pt.d.e.y, "2")
+
+        # the views of the moved children change the tree they are in now
+        a = ptree.json.loads('{"x": {"k": "v"}}')
+        b = ptree.Tree()
+        x, keys = a.x, a.x.keys()
+        b.append("y", a, move=True)
+        snap, index = b.snapshot(), b.build_index("*.x.k")
+        x.put("k", "z")
+        self.assertEqual((snap.y.x.k, b.y.x.k, index.get("z").x.k), ("v", "z", "z"))
+        with self.assertRaises(KeyError):
+            with b.transaction():
+                x.put("k", "w")
+                raise KeyError("k")
+        self.assertEqual((b.y.x.k, list(keys)), ("z", ["k"]))
+
+    def test_splice(self):
+        keys = lambda tree: "".join(tree.keys())
+        src = ptree.json.loads('{"a": {"x": {"y": 1}}, "b": 2, "c": 3, "d": 4}')
+        dst = ptree.json.loads('{"e": 5, "f": 6}')
+        y = src.a.x.y
+
+        dst.splice(1, src, slice(0, 2))
+        self.assertEqual(keys(dst), "eabf")
+        self.assertEqual(keys(src), "cd")
+        self.assertEqual(dst.a.x.y, "1")
+
+        # views of the descendants see them in their new place and keep it alive
+        y.value = "7"
+        self.assertEqual(dst.a.x.y, "7")
+        del dst
+        self.assertEqual(y, "7")
+
+        dst = ptree.Tree()
+        dst.splice(0, src, -1)
+        dst.splice(-1, src)
+        self.assertEqual(keys(dst), "dc")
+        self.assertTrue(src.empty())
+
+        # reordering within a node
+        pt = ptree.json.loads('{"a": 1, "b": 2, "c": 3, "d": 4, "e": 5}')
+        a = pt[0]
+        pt.splice(4, pt, slice(0, 2))
+        self.assertEqual(keys(pt), "cdabe")
+        pt.splice(0, pt, slice(2, 4))
+        self.assertEqual(keys(pt), "abcde")
+        pt.splice(3, pt, slice(2, 5))
+        self.assertEqual(keys(pt), "abcde")
+        pt.splice(5, pt, 0)
+        self.assertEqual(keys(pt), "bcdea")
+        self.assertEqual(a, "1")
+
+        pt = ptree.json.loads('{"a": {"b": {"c": 1}}}')
+        self.assertRaises(ValueError, pt.a.b.splice, 0, pt)
+        self.assertRaises(ValueError, pt.splice, 0, pt.a, slice(0, 2, 2))
+        self.assertRaises(IndexError, pt.splice, 0, pt.a, 1)
+        self.assertRaises(IndexError, pt.splice, 2, pt.a)
+        self.assertRaises(TypeError, pt.splice, 0, pt.a, "b")
+        pt.splice(1, pt.a)
+        self.assertEqual(keys(pt), "ab")
+        self.assertEqual(pt.b.c, "1")
+
+        # the views of the children moved see them in their new place, their changes go to their new tree
+        src = ptree.json.loads('{"a": {"x": 1}, "b": 2}')
+        dst = ptree.Tree()
+        a = src.a
+        dst.splice(0, src, 0)
+        snap = dst.snapshot()
+        a.x = 3
+        self.assertEqual((dst.a.x, snap.a.x, keys(src)), ("3", "1", "b"))
+
+    def test_pop_moves(self):
+        pt = ptree.json.loads('{"a": {"b": {"c": 1}}, "d": {"e": 2}}')
+        c = pt.a.b.c
+        a = pt.pop("a")
+        key, d = pt.popitem()
+        self.assertEqual(a.b.c, "1")
+        self.assertEqual((key, d.e), ("d", "2"))
+        self.assertTrue(pt.empty())
+
+        # views of the descendants of a popped child see it in the popped tree
+        c.value = "3"
+        self.assertEqual(a.b.c, "3")
+
+    def test_erase_if(self):
+        pt = ptree.json.loads('[{"id": 1, "rating": 9}, {"id": 2, "rating": 4}, {"id": 3},'
+                              ' {"id": 4, "rating": 8}, {"id": 5, "rating": 2}]')
+
+        self.assertEqual(pt.erase_if(ptree.where("rating") < 5), 2)
+        self.assertEqual([v.id.value for k, v in pt], ["1", "3", "4"])
+
+        self.assertEqual(pt.erase_if(lambda key, value: "rating" not in value), 1)
+        self.assertEqual([v.id.value for k, v in pt], ["1", "4"])
+        self.assertEqual(pt.erase_if(lambda key, value: False), 0)
+
+        # nothing is erased if the function fails or changes the tree
+        self.assertRaises(ZeroDivisionError, pt.erase_if, lambda key, value: 1 / 0)
+        self.assertRaises(RuntimeError, pt.erase_if, lambda key, value: value.put("x", 1))
+        self.assertEqual(len(pt), 2)
+        self.assertRaises(TypeError, pt.erase_if, "rating")
+
+    def test_erase_paths(self):
+        pt = ptree.json.loads('{"a": {"b": {"c": 1, "d": 2}, "e": 3}, "f": 4, "g": 5}')
+        pt.add("a.e", 6)
+
+        self.assertEqual(pt.erase_paths(["a.e", "a.b.c", "a.b", "g", "x.y", "a.z"]), 5)
+        self.assertEqual(list(pt.keys()), ["a", "f"])
+        self.assertEqual(list(pt.a.keys()), [])
+
+        self.assertEqual(pt.erase_paths(p for p in ("f", "a")), 2)
+        self.assertTrue(pt.empty())
+        self.assertRaises(TypeError, pt.erase_paths, [1])
+
+    def test_copy_on_write(self):
+        pt = ptree.json.loads('{"a": {"x": 1, "y": 2}, "b": [1, 2, 3]}')
+        c1 = copy.copy(pt)
+        c2 = ptree.Tree(pt)
+        a = c1.a
+        items = iter(c1.b)
+        next(items)
+
+        # changing the original leaves the copies and their views and iterators alone
+        pt.a.x = 10
+        pt.b.append("", 4)
+        self.assertEqual(pt.a.x, "10")
+        self.assertEqual((c1.a.x, c2.a.x, a.x), ("1", "1", "1"))
+        self.assertEqual([v.value for k, v in items], ["2", "3"])
+        self.assertEqual(len(c1.b), 3)
+
+        # views of a copy change the copy only
+        a.y = 20
+        self.assertEqual((c1.a.y, c2.a.y, pt.a.y), ("20", "2", "2"))
+
+        # changing a copy leaves the original alone
+        c3 = copy.copy(c2)
+        c2.b.pop("")
+        self.assertEqual((len(c2.b), len(c3.b), len(pt.b)), (2, 3, 4))
+        c3.clear()
+        self.assertEqual(c2.a.x, "1")
+
+        # iterators of a copy move along to the tree it gets when changed
+        c4 = copy.copy(c2)
+        items = iter(c4)
+        next(items)
+        c4.put("k9", "v")
+        self.assertEqual([k for k, v in items], ["b", "k9"])
+        c5 = copy.copy(c2)
+        items = iter(c5.b)
+        next(items)
+        c5.b.append("", 4)
+        self.assertEqual([v.value for k, v in items], ["3", "4"])
+        self.assertEqual(len(c2.b), 2)
+
+        # copies of a subtree
+        sub = copy.copy(pt.a)
+        pt.erase("a")
+        self.assertEqual(sub.x, "10")
+        self.assertEqual(list(sub.keys()), ["x", "y"])
+
+        # the copies and the original outlive each other
+        del pt
+        self.assertEqual(ptree.json.dumps(c2), ptree.json.dumps(ptree.json.loads('{"a": {"x": 1, "y": 2}, "b": [2, 3]}')))
+
+    def test_snapshot(self):
+        pt = ptree.json.loads('{"a": {"x": 1}, "b": [1, 2, 3]}')
+        snap = pt.snapshot()
+        a = snap.a
+        items = iter(snap.b)
+        next(items)
+
+        # writers don't disturb readers of the snapshot
+        pt.a.x = 10
+        pt.erase("b")
+        self.assertEqual((snap.a.x, a.x, pt.a.x), ("1", "1", "10"))
+        self.assertEqual([v.value for k, v in items], ["2", "3"])
+
+        # iterators over the snapshot itself too
+        pt.put("c", 1)
+        snap2 = pt.snapshot()
+        items = iter(snap2)
+        next(items)
+        pt.put("k1", "x")
+        self.assertEqual([k for k, v in items], ["c"])
+
+        # reading a snapshot doesn't copy it, walks and key lookups move along
+        # when the tree changes
+        keyed = ptree.Tree()
+        keyed.append("k", "1")
+        keyed.insert(0, "k", "2")
+        keyed.append("j", ptree.Tree(x=1, y=2))
+        snap4 = keyed.snapshot()
+        found, ordered = snap4.search("k"), snap4.sorted()
+        walked, post = snap4.walk(), snap4.walk(order="post")
+        grepped, matched = snap4.grep("2"), snap4.match(key="x|y")
+        self.assertEqual((next(found)[1], next(ordered)[0]), ("1", "j"))
+        self.assertEqual((next(walked)[0], next(walked)[0], next(post)[0]), ("k", "k", "k"))
+        self.assertEqual((next(grepped), next(matched)[0]), ("k", "j.x"))
+        keyed.clear()
+        keyed.put("k", "3")
+        self.assertEqual([v.value for k, v in found], ["2"])
+        self.assertEqual([k for k, v in ordered], ["k", "k"])
+        self.assertEqual([p for p, v in walked], ["j", "j.x", "j.y"])
+        self.assertEqual([p for p, v in post], ["k", "j.x", "j.y", "j"])
+        self.assertEqual((list(grepped), [p for p, v in matched]), (["j.y"], ["j.y"]))
+        self.assertEqual(snap4.pop("z", None), None)
+
+        # the snapshots taken before a change move to one copy of the tree,
+        # snapshots of a subtree too
+        many = ptree.json.loads('{"a": {"x": 1}, "b": [1, 2]}')
+        snaps = [many.snapshot() for i in range(3)] + [many.a.snapshot()]
+        views = [snaps[0].a, snaps[3]]
+        items = iter(snaps[1].b)
+        next(items)
+        many.a.x = 2
+        many.b.append("", 3)
+        self.assertEqual([s.a.x for s in snaps[:3]] + [snaps[3].x] + [v.x for v in views], ["1"] * 6)
+        self.assertEqual([v.value for k, v in items], ["2"])
+        c = copy.copy(snaps[1])
+        c.a.x = 3
+        del snaps[0], views
+        self.assertEqual((c.a.x, snaps[0].a.x, snaps[1].b[-1], snaps[2].x, many.a.x), ("3", "1", "2", "1", "2"))
+
+        # readers in other threads keep the version they took while a writer
+        # changes the tree
+        shows = ptree.Tree(shows=ptree.Tree())
+        for i in range(5000):
+            shows.shows.append("", ptree.Tree(id=i))
+        done = threading.Event()
+
+        def writer():
+            while not done.is_set():
+                if shows.shows.empty():
+                    break
+                shows.shows.popitem()
+                shows.put("writes", 1)
+
+        thread = threading.Thread(target=writer)
+        thread.start()
+        try:
+            for _ in range(20):
+                snap3 = shows.snapshot()
+                size = len(snap3.shows)
+                ids = [v.id.value for k, v in snap3.shows]
+                self.assertEqual(len(ids), size)
+                self.assertEqual([v.value for v in snap3.select("shows[*].id", threads=4)], ids)
+                self.assertEqual(len(list(snap3.shows.search(ptree.where("id") >= 0, threads=4))), size)
+                self.assertEqual(len(snap3.shows), size)
+        finally:
+            done.set()
+            thread.join()
+
+        # the snapshot and its views are read-only
+        for change in (lambda: snap.put("a.x", 2), lambda: snap.b.append("", 4),
+                       lambda: snap.clear(), lambda: snap.erase("a"), lambda: snap.pop("a"),
+                       lambda: snap.sort(), lambda: a.__setattr__("x", "2"),
+                       lambda: snap.__setitem__("c", 1), lambda: pt.append("", snap.b, move=True),
+                       lambda: pt.splice(0, snap.b)):
+            self.assertRaises(TypeError, change)
+        self.assertEqual(ptree.json.dumps(snap), ptree.json.dumps(ptree.json.loads('{"a": {"x": 1}, "b": [1, 2, 3]}')))
+        self.assertEqual(pt.a.x, "10")
+
+        # copies of a snapshot can be changed
+        c = copy.copy(snap)
+        c.a.x = 5
+        self.assertEqual((c.a.x, snap.a.x), ("5", "1"))
+        self.assertEqual(snap.merge(c, copy=True).a.x, "5")
+
+        # a snapshot outlives its tree
+        del pt
+        self.assertEqual(len(snap.b), 3)
+
+    def test_transaction(self):
+        source = '{"a": {"x": 1, "y": 2}, "b": [1, 2, 3], "c": "3"}'
+        pt = ptree.json.loads(source)
+        a = pt.a
+        snap = pt.snapshot()
+
+        with self.assertRaises(KeyError):
+            with pt.transaction():
+                pt.put("a.x", 10)
+                a.put("z.w", 5)
+                pt.a.z.put("w", 6)
+                pt.b.append("", 4)
+                pt.b.sort(key=lambda k, v: -int(v.value))
+                pt.b.erase("")
+                pt.pop("c")
+                pt.a.erase("y")
+                pt.add("d", 1)
+                raise KeyError("d")
+
+        self.assertEqual(ptree.json.dumps(pt), ptree.json.dumps(ptree.json.loads(source)))
+        self.assertEqual(ptree.json.dumps(snap), ptree.json.dumps(ptree.json.loads(source)))
+
+        # views of the nodes that are back see them
+        first = pt.b[0]
+        with self.assertRaises(ValueError):
+            with pt.transaction():
+                a.x = 7
+                pt.b.reverse()
+                raise ValueError()
+        self.assertEqual((a.x, first.value), ("1", "1"))
+
+        # children moved within the tree go back to where they were
+        source = ptree.json.dumps(pt)
+        with self.assertRaises(ValueError):
+            with pt.transaction():
+                pt.put("m", pt.a, move=True)
+                pt.m.erase_if(lambda key, value: key == "x")
+                pt.m.put("n", 1)
+                pt.splice(0, pt.b, slice(0, 2))
+                pt.merge(ptree.json.loads('{"a": {"q": 1}, "c": [4]}'))
+                raise ValueError()
+        self.assertEqual(ptree.json.dumps(pt), source)
+        self.assertEqual(list(pt.keys()), ["a", "b", "c"])
+
+        # changes are kept without an exception
+        with pt.transaction() as transaction:
+            pt.put("a.x", 2)
+            self.assertRaises(RuntimeError, pt.a.transaction().__enter__)
+        self.assertEqual(a.x, "2")
+        self.assertRaises(RuntimeError, transaction.commit)
+
+        with pt.transaction() as transaction:
+            pt.clear()
+            transaction.rollback()
+            pt.put("e", 1)
+        self.assertEqual((pt.a.x, pt.e, len(pt)), ("2", "1", 4))
+
+        # a change to one record leaves the others and their views alone
+        pt = ptree.Tree()
+        for i in range(100):
+            pt.append("", ptree.Tree(id=i))
+        records = [pt[i] for i in range(100)]
+        with self.assertRaises(ValueError):
+            with pt.transaction():
+                pt[5].id = 500
+                pt.put("k1", "x")
+                pt.popitem(7)
+                raise ValueError()
+        self.assertEqual(len(pt), 100)
+        self.assertEqual([r.id.value for r in records[:7]], [str(i) for i in range(7)])
+        self.assertEqual(pt[7].id, "7")
+
+    def test_view_lifetime(self):
+        shows = ptree.json.loads('{"shows": [{"id": 1}]}').shows
+        self.assertEqual(shows[0].id, "1")
+
 
 if __name__ == '__main__':
     unittest.main()